@@ -9,43 +9,335 @@
 / v2 - August 2014
 /----------------------------------------------------------------------------*/
 #include <avr/io.h> 
+#include <avr/pgmspace.h>
+#include <util/crc16.h>
 #include <util/delay.h>
 #include "xmega_digital.h"
+#include "xmega_baud.h"
 #include "sp_driver.h"
+#include "tealoader_app.h"
 /*---------------------------------------------------------------------------*/
-int16_t getch();
+uint8_t getch();
+uint32_t get_address();
 void init_uart();
-void initClock_32Mhz();
+void init_timer();
+void initClock();
 void sendch(uint8_t ch);
+void skip_command(uint8_t cmd);
+void set_baud(uint16_t ctrl);
+uint8_t probe_baud();
+uint16_t stage_crc(uint8_t pages);
+uint8_t api_stage_page(uint8_t page, const uint8_t* buf);
 void (*funcptr)(void) = 0x0000;
 /*---------------------------------------------------------------------------*/
-/* SPM_PAGESIZE is 128 for Xmega32E5 */
+/* SPM_PAGESIZE is 128 for Xmega32E5, the host sends pages of that size */
+#if SPM_PAGESIZE != 128
+    #error "The host protocol carries 128 byte pages"
+#endif
 uint8_t pageBuf[SPM_PAGESIZE];
 /*---------------------------------------------------------------------------*/
-#define VERSION 2
+/* Runtime counters, sent out as is with the 's' command. Little endian. */
+typedef struct
+{
+    uint32_t rxBytes;
+    uint16_t pages;
+    uint16_t spmOps;
+    uint32_t spmTicks;
+    uint16_t spmMaxTicks;
+    uint16_t overruns;
+    uint16_t frameErrors;
+    uint16_t dropped;
+    uint32_t tickHz;
+    uint16_t verifyErrors;
+} stats_t;
+stats_t stats;
+/*---------------------------------------------------------------------------*/
+/* Multi-drop: every node sees every byte. Only the selected node answers,
+   in broadcast mode the nodes which joined with 'j' act on the commands and
+   stay silent, the others just read past the commands. The node address is
+   the first byte of the user signature row, an erased row counts as 0. */
+#define NODE_BROADCAST 0xFF
+#define NODE_SELECTED 0
+#define NODE_LISTEN 1
+#define NODE_IDLE 2
+uint8_t nodeAddress;
+uint8_t nodeMode;
+uint8_t nodeJoined;
+/*---------------------------------------------------------------------------*/
+/* One bit per application page, set once the page verified. Cleared by
+   'd', read out with 'm' so the host only resends what a node missed. */
+uint8_t pageMap[BOOTSTART / SPM_PAGESIZE / 8];
+/*---------------------------------------------------------------------------*/
+/* Staging region for A/B updates, see tealoader_app.h. 'i' copies it down
+   to address 0, so the image has to fit below it as well. */
+#define STAGE_PAGES TEALOADER_STAGE_PAGES
+#if (TEALOADER_STAGE_START < BOOTSTART / 2) || (TEALOADER_STAGE_START >= BOOTSTART)
+    #error "The staging region has to be in the upper half of the application section"
+#endif
+/*---------------------------------------------------------------------------*/
+/* Every session starts at BAUD, the host has to be built for the same */
+#ifndef BAUD
+    #define BAUD 115200
+#endif
+#if !BAUD_OK(BAUD)
+    #error "BAUD is off by more than BAUD_MAX_ERROR at this F_CPU"
+#endif
+/* Rates for the 'u' command, the index is what the host sends. Those this
+   clock can't hit closely enough are BAUD_NONE and refused. */
+#define BAUD_COUNT 7
+#define BAUD_NONE 0xFFFF
+#define BAUD_ENTRY(baud) (BAUD_OK(baud) ? BAUD_CTRL(baud) : BAUD_NONE)
+const uint16_t baudTable[BAUD_COUNT] =
+{
+    BAUD_ENTRY(115200), BAUD_ENTRY(230400), BAUD_ENTRY(460800),
+    BAUD_ENTRY(921600), BAUD_ENTRY(500000), BAUD_ENTRY(1000000),
+    BAUD_ENTRY(2000000)
+};
+uint16_t baudCtrl;
+/* How long a new rate waits for the host's first ping */
+#define BAUD_PROBE_MS 100
+/*---------------------------------------------------------------------------*/
+#define VERSION 13
 #define WDT_Reset() asm("wdr")
 #define getByte() (USARTD0.DATA)
 #define newMessage() (USARTD0.STATUS & USART_RXCIF_bm)
+/* Spaces out frames the host streams without flow control. Skipped where
+   a command is expected, and not counted as a lost byte. */
+#define STREAM_FILL 0x00
+/* A byte wait_spm() took off the UART for the command loop */
+uint8_t heldByte;
+uint8_t held;
 #define WDT_IsSyncBusy() (WDT.STATUS & WDT_SYNCBUSY_bm)
 /*---------------------------------------------------------------------------*/
+#ifndef FLOW_CONTROL
+    #define FLOW_CONTROL 0
+#endif
+#if FLOW_CONTROL
+    /* CTS towards the host on PD4, active low. High while we can't listen. */
+    #define ctsBusy() digitalWrite(D,4,HIGH)
+    #define ctsReady() digitalWrite(D,4,LOW)
+#else
+    #define ctsBusy()
+    #define ctsReady()
+#endif
+/*---------------------------------------------------------------------------*/
+#ifndef RS485
+    #define RS485 0
+#endif
+#if RS485
+    /* Transceiver DE (and inverted RE) on PD5, the bus is ours only while
+       a byte goes out. Nodes come up silent, the host selects them. */
+    #define busTalk() digitalWrite(D,5,HIGH)
+    #define busListen() digitalWrite(D,5,LOW)
+    #define NODE_MODE_RESET NODE_LISTEN
+#else
+    #define busTalk()
+    #define busListen()
+    #define NODE_MODE_RESET NODE_SELECTED
+#endif
+/*---------------------------------------------------------------------------*/
+/* SP_WaitForSPM() with the busy time accumulated in the stats. We keep
+   executing from the boot section meanwhile, so filler coming in behind a
+   streamed frame is read off instead of overrunning the UART. Everything
+   arriving here is at a command boundary, the first other byte is kept
+   for the command loop. */
+static void wait_spm()
+{
+    uint16_t t;
+
+    t = TCC4.CNT;
+    while(NVM.STATUS & NVM_NVMBUSY_bm)
+    {
+        if(!held && newMessage())
+        {
+            heldByte = getch();
+            held = (heldByte != STREAM_FILL);
+        }
+    }
+    NVM.CMD = NVM_CMD_NO_OPERATION_gc;
+    t = TCC4.CNT - t;
+
+    stats.spmOps++;
+    stats.spmTicks += t;
+    if(t > stats.spmMaxTicks)
+    {
+        stats.spmMaxTicks = t;
+    }
+}
+/*---------------------------------------------------------------------------*/
 static void boot_program_page(uint32_t pageOffset, uint8_t *buf)
 {
+    ctsBusy();
     SP_LoadFlashPage(buf);
     SP_EraseWriteApplicationPage(pageOffset);
+    wait_spm();
+    ctsReady();
+    stats.pages++;
+}
+/*---------------------------------------------------------------------------*/
+/* Write only, the page must already be erased */
+static void boot_write_page(uint32_t pageOffset, uint8_t *buf)
+{
+    ctsBusy();
+    SP_LoadFlashPage(buf);
+    SP_WriteApplicationPage(pageOffset);
+    wait_spm();
+    ctsReady();
+    stats.pages++;
+}
+/*---------------------------------------------------------------------------*/
+/* Reads the freshly programmed page back, 'Y' if it matches buf and 'V'
+   otherwise. The application section is below 64K, plain LPM reaches it. */
+static uint8_t verify_page(uint32_t pageOffset, uint8_t *buf)
+{
+    uint8_t i;
+    uint16_t address = pageOffset & ~((uint32_t)SPM_PAGESIZE - 1);
+
+    for(i=0;i<SPM_PAGESIZE;i++)
+    {
+        if(pgm_read_byte(address + i) != buf[i])
+        {
+            stats.verifyErrors++;
+            return 'V';
+        }
+    }
+
+    address /= SPM_PAGESIZE;
+    if(address < sizeof(pageMap) * 8)
+    {
+        pageMap[address / 8] |= 1 << (address % 8);
+    }
+
+    return 'Y';
+}
+/*---------------------------------------------------------------------------*/
+/* Reads the ops of an 'e' frame until they make up a page. 0x80|(n-1) and a
+   16-bit flash address copy n bytes of the flash as it is now, n-1 and n
+   bytes are a literal. Without build they are only read past. */
+static void read_delta(uint8_t build)
+{
+    uint8_t i = 0;
+    uint8_t n;
+    uint8_t op;
+    uint8_t c;
+    uint16_t source = 0;
+
+    while(i < SPM_PAGESIZE)
+    {
+        op = getch();
+        n = (op & 0x7F) + 1;
+
+        if(op & 0x80)
+        {
+            source = getch();
+            source |= (uint16_t)getch() << 8;
+        }
+
+        while(n--)
+        {
+            c = (op & 0x80) ? pgm_read_byte(source++) : getch();
+
+            /* A run past the end of the page is read, but dropped */
+            if(build && (i < SPM_PAGESIZE))
+            {
+                pageBuf[i] = c;
+            }
+            i++;
+        }
+    }
+}
+/*---------------------------------------------------------------------------*/
+/* CRC-16/XMODEM of the first pages of the staging region */
+uint16_t stage_crc(uint8_t pages)
+{
+    uint16_t i;
+    uint16_t crc = 0;
+
+    for(i=0;i<(uint16_t)pages*SPM_PAGESIZE;i++)
+    {
+        if((i % SPM_PAGESIZE) == 0)
+        {
+            WDT_Reset();
+        }
+        crc = _crc_xmodem_update(crc,pgm_read_byte(TEALOADER_STAGE_START + i));
+    }
+
+    return crc;
+}
+/*---------------------------------------------------------------------------*/
+/* Called by the running application through boot_api(), with its clock,
+   interrupts and RAM. Must not touch our globals, timers or the UART. */
+uint8_t api_stage_page(uint8_t page, const uint8_t* buf)
+{
+    uint8_t i;
+    uint8_t sreg;
+    uint16_t address;
+
+    if(page >= STAGE_PAGES)
+    {
+        return 'V';
+    }
+
+    address = TEALOADER_STAGE_START + (uint16_t)page * SPM_PAGESIZE;
+
+    sreg = SREG;
+    cli();
     SP_WaitForSPM();
+    SP_LoadFlashPage(buf);
+    SP_EraseWriteApplicationPage(address);
+    SP_WaitForSPM();
+    SREG = sreg;
+
+    for(i=0;i<SPM_PAGESIZE;i++)
+    {
+        if(pgm_read_byte(address + i) != buf[i])
+        {
+            return 'V';
+        }
+    }
+
+    return 'Y';
+}
+/*---------------------------------------------------------------------------*/
+/* Function table for the application at TEALOADER_API_ADDR, placed there by
+   the Makefile. New entries go after the magic word. */
+void boot_api() __attribute__((naked, used, section(".bootapi")));
+void boot_api()
+{
+    asm volatile("jmp api_stage_page\n\t"
+                 ".word %0" :: "i" (TEALOADER_API_MAGIC));
+}
+/*---------------------------------------------------------------------------*/
+/* Runs before .data and .bss are set up, which may overwrite the magic.
+   GPIOR0 carries the result over to main(). */
+void check_app_entry() __attribute__((naked, used, section(".init3")));
+void check_app_entry()
+{
+    GPIOR0 = 0;
+
+    if((RST.STATUS & RST_SRF_bm) &&
+       (*(volatile uint32_t*)TEALOADER_MAGIC_ADDR == TEALOADER_MAGIC))
+    {
+        GPIOR0 = 1;
+    }
+
+    *(volatile uint32_t*)TEALOADER_MAGIC_ADDR = 0;
 }
 /*---------------------------------------------------------------------------*/
 int main(void) 
 {    
     uint16_t i;
     uint8_t msg;
+    uint8_t* p;
+    uint16_t crc;
+    uint16_t sum;
     uint32_t t32;
     uint8_t run = 1;
     uint32_t pageOffset;
     uint32_t counter = 0;
    
     /* If we are here because of a WDT reset, go directly to the user app. */
-    if(RST.STATUS & RST_WDRF_bm)
+    if((RST.STATUS & RST_WDRF_bm) && !GPIOR0)
     {
         /* Clear the flag */        
         RST.STATUS |= RST_WDRF_bm;
@@ -69,33 +361,60 @@ int main(void)
     pinMode(C,7,OUTPUT);
     digitalWrite(C,7,HIGH);
 
-    initClock_32Mhz();
+    initClock();
     init_uart();
+    init_timer();
 
-    /* Wait until a message arrives or timeout */
-    while(!newMessage());
+    nodeMode = NODE_MODE_RESET;
+    nodeAddress = SP_ReadUserSignatureByte(0);
+    if(nodeAddress == NODE_BROADCAST)
+    {
+        nodeAddress = 0;
+    }
 
-    /* Was it correct message? */
-    if(getByte() != 'a')
+    if(GPIOR0)
     {
-        /* WDT will eventually jump to the user app. */
-        while(1);
+        /* The application asked for us, the host is waiting already */
+        RST.STATUS = RST_SRF_bm;
+        sendch('Y');
     }
     else
     {
-        /* Send ACK */
-        sendch('Y');    
-    }    
+        /* Wait until a message arrives or timeout */
+        while(!newMessage());
+
+        /* Was it correct message? */
+        if(getch() != 'a')
+        {
+            /* WDT will eventually jump to the user app. */
+            while(1);
+        }
+        else
+        {
+            /* Send ACK */
+            sendch('Y');    
+        }    
+    }
 
     while(1)
     {        
-        while(!newMessage());
-        
-        msg = getByte();
+        msg = getch();
         
         WDT_Reset();
 
         togglePin(C,7);
+
+        if(msg == STREAM_FILL)
+        {
+            continue;
+        }
+
+        /* Another node is being talked to */
+        if((nodeMode == NODE_IDLE) && (msg != 'n'))
+        {
+            skip_command(msg);
+            continue;
+        }
         
         switch(msg)
         {
@@ -114,8 +433,7 @@ int main(void)
 
                 for(i=0;i<SPM_PAGESIZE;i++)
                 {
-                    while(!newMessage());
-                    pageBuf[i] = getByte();
+                    pageBuf[i] = getch();
                 }
 
                 break;
@@ -126,38 +444,116 @@ int main(void)
                 /* Send ACK */
                 sendch('Y');
 
-                while(!newMessage());
-                pageOffset = getByte();
+                pageOffset = get_address();
 
-                while(!newMessage());
-                t32 = getByte();
-                t32 = t32 << 8;
-                pageOffset += t32;
+                boot_program_page(pageOffset,pageBuf);
 
-                while(!newMessage());
-                t32 = getByte();
-                t32 = t32 << 16;
-                pageOffset += t32;
+                /* Send ACK, or NAK if it didn't stick. pageBuf is kept,
+                   a 'c' with the same address programs it again. */
+                sendch(verify_page(pageOffset,pageBuf));
+                break;
+            }
+            /* Address first, then the page. The erase runs while the
+               data comes in, only the write is left at the end. */
+            case 'w':
+            {
+                /* Send ACK */
+                sendch('Y');
 
-                while(!newMessage());
-                t32 = getByte();
-                t32 = t32 << 24;
-                pageOffset += t32;
+                pageOffset = get_address();
 
-                boot_program_page(pageOffset,pageBuf);
+                /* Doesn't wait, we keep executing from the boot section */
+                SP_EraseApplicationPage(pageOffset);
+
+                for(i=0;i<SPM_PAGESIZE;i++)
+                {
+                    pageBuf[i] = getch();
+                }
+
+                /* Page buffer can't be loaded before the erase is over.
+                   The host is held off from here, boot_write_page() lets
+                   it go once the write is done too. */
+                ctsBusy();
+                wait_spm();
+                boot_write_page(pageOffset,pageBuf);
 
+                /* Send ACK, or NAK if it didn't stick */
+                sendch(verify_page(pageOffset,pageBuf));
+                break;
+            }
+            /* Patch a few bytes inside one page, the rest of the
+               page is read back from flash and kept as it is */
+            case 'p':
+            {
                 /* Send ACK */
                 sendch('Y');
+
+                pageOffset = get_address();
+                msg = getch();
+
+                t32 = pageOffset & ~((uint32_t)SPM_PAGESIZE - 1);
+                SP_ReadFlashPage(pageBuf, t32);
+
+                for(i=0;i<msg;i++)
+                {
+                    /* Wraps inside the page, never touches the next one */
+                    pageBuf[(pageOffset + i) & (SPM_PAGESIZE - 1)] = getch();
+                }
+
+                boot_program_page(t32,pageBuf);
+
+                /* Send ACK, or NAK if it didn't stick */
+                sendch(verify_page(t32,pageBuf));
+                break;
+            }
+            /* Rebuild a page from what the flash holds now and literal
+               bytes. It is only programmed if it adds up to the CRC the
+               host sent, else the host's idea of the flash was wrong. */
+            case 'e':
+            {
+                /* Send ACK */
+                sendch('Y');
+
+                pageOffset = get_address();
+                crc = getch();
+                crc |= (uint16_t)getch() << 8;
+
+                read_delta(1);
+
+                sum = 0;
+                for(i=0;i<SPM_PAGESIZE;i++)
+                {
+                    sum = _crc_xmodem_update(sum,pageBuf[i]);
+                }
+
+                if(sum != crc)
+                {
+                    stats.verifyErrors++;
+                    sendch('V');
+                    break;
+                }
+
+                boot_program_page(pageOffset,pageBuf);
+
+                /* Send ACK, or NAK if it didn't stick */
+                sendch(verify_page(pageOffset,pageBuf));
                 break;
             }
             /* Delete the pages */
             case 'd':
             {   
+                ctsBusy();
                 for(t32=0;t32<BOOTSTART;t32+=SPM_PAGESIZE)
                 {
                     WDT_Reset(); SP_EraseApplicationPage(t32);
-                    WDT_Reset(); SP_WaitForSPM();
+                    WDT_Reset(); wait_spm();
                 }                    
+                ctsReady();
+
+                for(i=0;i<sizeof(pageMap);i++)
+                {
+                    pageMap[i] = 0;
+                }
 
                 /* Send ACK */
                 sendch('Y');
@@ -169,6 +565,143 @@ int main(void)
                 sendch(VERSION);
                 break;
             }
+            /* Runtime statistics readout */
+            case 's':
+            {
+                p = (uint8_t*)&stats;
+                for(i=0;i<sizeof(stats);i++)
+                {
+                    sendch(p[i]);
+                }
+                break;
+            }
+            /* Node select, NODE_BROADCAST for all of them */
+            case 'n':
+            {
+                msg = getch();
+
+                if(msg == NODE_BROADCAST)
+                    nodeMode = nodeJoined ? NODE_LISTEN : NODE_IDLE;
+                else if(msg == nodeAddress)
+                    nodeMode = NODE_SELECTED;
+                else
+                    nodeMode = NODE_IDLE;
+
+                break;
+            }
+            /* Take part in broadcasts from now on. Nodes the host didn't
+               ask stay out of them, their application is left alone. */
+            case 'j':
+            {
+                nodeJoined = 1;
+
+                /* Send ACK */
+                sendch('Y');
+                break;
+            }
+            /* Map of the pages which verified since the last erase */
+            case 'm':
+            {
+                for(i=0;i<sizeof(pageMap);i++)
+                {
+                    sendch(pageMap[i]);
+                }
+                break;
+            }
+            /* CRC-16/XMODEM of each page in a row, so the host can tell
+               which pages made it before an upload broke off */
+            case 'k':
+            {
+                pageOffset = get_address();
+                msg = getch();
+
+                for(;msg>0;msg--)
+                {
+                    WDT_Reset();
+
+                    crc = 0;
+                    for(i=0;i<SPM_PAGESIZE;i++)
+                    {
+                        crc = _crc_xmodem_update(crc,pgm_read_byte((uint16_t)pageOffset + i));
+                    }
+
+                    sendch(crc & 0xFF);
+                    sendch(crc >> 8);
+                    pageOffset += SPM_PAGESIZE;
+                }
+                break;
+            }
+            /* Baud rate switch. ACKed at the old rate, then the host
+               has to ping at the new one or we go back. */
+            case 'u':
+            {
+                /* Only with a single node listening, nodes left behind
+                   at another rate would lose the bus */
+                msg = getch();
+                if((msg >= BAUD_COUNT) || (baudTable[msg] == BAUD_NONE) ||
+                   (nodeMode != NODE_SELECTED))
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                sendch('Y');
+
+                /* The ACK has to be out before the rate changes */
+                while(!(USARTD0.STATUS & USART_TXCIF_bm));
+
+                i = baudCtrl;
+                set_baud(baudTable[msg]);
+                if(probe_baud())
+                {
+                    sendch('Y');
+                }
+                else
+                {
+                    set_baud(i);
+                }
+                break;
+            }
+            /* Install the staged image: page count and CRC-16/XMODEM. The
+               second ACK says whether the staging region holds that image,
+               nothing is touched otherwise. The third one comes after the
+               copy, a copy which broke off can simply be run again. */
+            case 'i':
+            {
+                /* Send ACK */
+                sendch('Y');
+
+                msg = getch();
+                crc = getch();
+                crc |= (uint16_t)getch() << 8;
+
+                if((msg == 0) || (msg > STAGE_PAGES) || (stage_crc(msg) != crc))
+                {
+                    sendch('V');
+                    break;
+                }
+                sendch('Y');
+
+                ctsBusy();
+                for(i=0;i<msg;i++)
+                {
+                    WDT_Reset();
+
+                    t32 = (uint32_t)i * SPM_PAGESIZE;
+                    SP_ReadFlashPage(pageBuf, TEALOADER_STAGE_START + t32);
+                    boot_program_page(t32,pageBuf);
+
+                    if(verify_page(t32,pageBuf) != 'Y')
+                    {
+                        break;
+                    }
+                }
+                ctsReady();
+
+                /* Send ACK, or NAK if a page didn't stick */
+                sendch((i == msg) ? 'Y' : 'V');
+                break;
+            }
             /* Go to user app ... */
             case 'x':
             {
@@ -177,6 +710,12 @@ int main(void)
 
                 break;
             }
+            /* Unknown command, probably a byte lost somewhere */
+            default:
+            {
+                stats.dropped++;
+                break;
+            }
         }     
     }
     
@@ -186,11 +725,99 @@ int main(void)
     return 0;
 }
 /*---------------------------------------------------------------------------*/
+uint8_t getch()
+{
+    uint8_t status;
+
+    if(held)
+    {
+        held = 0;
+        return heldByte;
+    }
+
+    while(!((status = USARTD0.STATUS) & USART_RXCIF_bm));
+
+    /* Error flags are only valid before DATA is read */
+    if(status & USART_BUFOVF_bm)
+    {
+        stats.overruns++;
+    }
+    if(status & USART_FERR_bm)
+    {
+        stats.frameErrors++;
+    }
+    stats.rxBytes++;
+
+    return getByte();
+}
+/*---------------------------------------------------------------------------*/
+/* 32-bit little endian byte address */
+uint32_t get_address()
+{
+    uint32_t t32;
+    uint32_t address;
+
+    address = getch();
+
+    t32 = getch();
+    t32 = t32 << 8;
+    address += t32;
+
+    t32 = getch();
+    t32 = t32 << 16;
+    address += t32;
+
+    t32 = getch();
+    t32 = t32 << 24;
+    address += t32;
+
+    return address;
+}
+/*---------------------------------------------------------------------------*/
 void sendch(uint8_t ch)
 {
+    /* Nobody asked this node, the bus belongs to someone else */
+    if(nodeMode != NODE_SELECTED)
+    {
+        return;
+    }
+
+    busTalk();
+
     while(!(USARTD0.STATUS & USART_DREIF_bm));
 
+    USARTD0.STATUS = USART_TXCIF_bm;
     USARTD0.DATA = ch;
+
+#if RS485
+    /* Hold the bus until the stop bit is out */
+    while(!(USARTD0.STATUS & USART_TXCIF_bm));
+#endif
+
+    busListen();
+}
+/*---------------------------------------------------------------------------*/
+/* Reads the arguments of a command meant for another node */
+void skip_command(uint8_t cmd)
+{
+    uint8_t n = 0;
+
+    switch(cmd)
+    {
+        case 'b': n = SPM_PAGESIZE; break;
+        case 'c': n = 4; break;
+        case 'w': n = 4 + SPM_PAGESIZE; break;
+        case 'p': get_address(); n = getch(); break;
+        case 'k': n = 5; break;
+        case 'u': n = 1; break;
+        case 'i': n = 3; break;
+        case 'e': get_address(); getch(); getch(); read_delta(0); break;
+    }
+
+    while(n--)
+    {
+        getch();
+    }
 }
 /*---------------------------------------------------------------------------*/
 void init_uart()
@@ -201,21 +828,76 @@ void init_uart()
 
     /* Remap the UART pins */
     PORTD.REMAP = PORT_USART0_bm;
+
+#if FLOW_CONTROL
+    pinMode(D,4,OUTPUT);
+    ctsReady();
+#endif
+
+#if RS485
+    pinMode(D,5,OUTPUT);
+    busListen();
+#endif
     
     USARTD0.CTRLB = USART_RXEN_bm|USART_TXEN_bm;
     USARTD0.CTRLC = USART_CMODE_ASYNCHRONOUS_gc|USART_PMODE_DISABLED_gc|USART_CHSIZE_8BIT_gc;
 
-    /* 115200 baud rate with 32MHz clock */
-    USARTD0.BAUDCTRLA = 131; USARTD0.BAUDCTRLB = (-3 << USART_BSCALE_gp);
+    set_baud(BAUD_CTRL(BAUD));
+}
+/*---------------------------------------------------------------------------*/
+/* ctrl is a BAUD_CTRL() value, BAUDCTRLA has to be written last */
+void set_baud(uint16_t ctrl)
+{
+    baudCtrl = ctrl;
+    USARTD0.BAUDCTRLB = ctrl >> 8;
+    USARTD0.BAUDCTRLA = ctrl & 0xFF;
+}
+/*---------------------------------------------------------------------------*/
+/* 1 if the first byte within BAUD_PROBE_MS is a ping. The timer ticks at
+   F_CPU/64, one round of the inner loop is a millisecond. */
+uint8_t probe_baud()
+{
+    uint8_t ms;
+    uint16_t t;
+
+    for(ms=0;ms<BAUD_PROBE_MS;ms++)
+    {
+        t = TCC4.CNT;
+        while((uint16_t)(TCC4.CNT - t) < (F_CPU / 64 / 1000))
+        {
+            if(newMessage())
+            {
+                return getch() == 'a';
+            }
+        }
+    }
+
+    return 0;
+}
+/*---------------------------------------------------------------------------*/
+void init_timer()
+{
+    /* Free running timebase for the SPM busy time measurement */
+    TCC4.CTRLA = TC45_CLKSEL_DIV64_gc;
+    stats.tickHz = F_CPU / 64;
 }
 /*---------------------------------------------------------------------------*/
-void initClock_32Mhz()
+/* F_CPU from the internal 2MHz oscillator, through the PLL above that */
+#if F_CPU == 2000000
+    #define PLL_FACTOR 0
+#elif ((F_CPU % 2000000) == 0) && (F_CPU >= 10000000) && (F_CPU <= 32000000)
+    #define PLL_FACTOR (F_CPU / 2000000)
+#else
+    #error "F_CPU has to be 2MHz or a multiple of 2MHz from 10MHz to 32MHz"
+#endif
+void initClock()
 {
-    /* Generates 32Mhz clock from internal 2Mhz clock via PLL */
-    OSC.PLLCTRL = OSC_PLLSRC_RC2M_gc | 16;
+#if PLL_FACTOR
+    OSC.PLLCTRL = OSC_PLLSRC_RC2M_gc | PLL_FACTOR;
     OSC.CTRL |= OSC_PLLEN_bm ;
     while((OSC.STATUS & OSC_PLLRDY_bm) == 0);
     CCP = CCP_IOREG_gc;
     CLK.CTRL = CLK_SCLKSEL_PLL_gc;
+#endif
 }
 /*---------------------------------------------------------------------------*/
@@ -0,0 +1,75 @@
+/*-----------------------------------------------------------------------------
+/ Bootloader entry from the application, without the reset lines.
+/------------------------------------------------------------------------------
+/ Include this in the application and call tealoader_enter() when the host
+/ asks for it, e.g. on a serial command. It leaves a magic value at the start
+/ of the internal SRAM and issues a software reset. The bootloader picks the
+/ value up before its own startup code reuses that RAM, answers with 'Y' and
+/ waits for commands straight away.
+/
+/ On the host: tealoader -a <command> ... sends the command first and falls
+/ back to RTS/DTR when no 'Y' comes back.
+/------------------------------------------------------------------------------
+/ Staged updates: an application which fits below TEALOADER_STAGE_START can
+/ take the next image over its own link while it keeps running and write it
+/ page by page into the staging region above with tealoader_stage_page().
+/ Only the bootloader can write flash, the call goes through its function
+/ table at TEALOADER_API_ADDR. Once the whole image is there, the host runs
+/ tealoader -I -a <command> -f <same image> ... and the bootloader checks the
+/ staged pages against the image's length and CRC and copies them down to
+/ address 0. The application is only gone for that copy.
+/----------------------------------------------------------------------------*/
+#ifndef TEALOADER_APP_H
+#define TEALOADER_APP_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define TEALOADER_MAGIC_ADDR INTERNAL_SRAM_START
+#define TEALOADER_MAGIC 0x7EA10ADBUL
+
+/* Both have to match the bootloader's Makefile */
+#ifndef TEALOADER_STAGE_START
+    #define TEALOADER_STAGE_START 0x4000
+#endif
+#ifndef TEALOADER_API_ADDR
+    #define TEALOADER_API_ADDR 0x8FF0
+#endif
+
+#define TEALOADER_STAGE_PAGES \
+    ((BOOT_SECTION_START - TEALOADER_STAGE_START) / SPM_PAGESIZE)
+
+/* Follows the jumps in the table, erased flash on older bootloaders */
+#define TEALOADER_API_MAGIC 0x7EA1
+
+static inline void tealoader_enter(void) __attribute__((noreturn));
+static inline void tealoader_enter(void)
+{
+    cli();
+
+    *(volatile uint32_t*)TEALOADER_MAGIC_ADDR = TEALOADER_MAGIC;
+
+    /* SRAM keeps its contents over a software reset */
+    CCP = CCP_IOREG_gc;
+    RST.CTRL = RST_SWRST_bm;
+
+    while(1);
+}
+
+/* 1 if the bootloader can write the staging region for us */
+static inline uint8_t tealoader_can_stage(void)
+{
+    return pgm_read_word(TEALOADER_API_ADDR + 4) == TEALOADER_API_MAGIC;
+}
+
+/* Erases and writes page 0 .. TEALOADER_STAGE_PAGES-1 of the staging region
+   with SPM_PAGESIZE bytes from buf. 'Y' if it reads back as written, 'V'
+   otherwise. Interrupts are off for the few ms the flash is busy. */
+static inline uint8_t tealoader_stage_page(uint8_t page, const uint8_t* buf)
+{
+    /* Function pointers are word addresses */
+    return ((uint8_t (*)(uint8_t, const uint8_t*))(TEALOADER_API_ADDR / 2))(page, buf);
+}
+
+#endif /* TEALOADER_APP_H */
@@ -0,0 +1,56 @@
+/*-----------------------------------------------------------------------------
+/ Xmega USART baud rate settings, worked out by the compiler from F_CPU.
+/------------------------------------------------------------------------------
+/ CLK2X off. With BSCALE = -n the USART runs at
+/
+/     F_CPU / (16 * (BSEL / 2^n + 1))
+/
+/ so BSEL = 2^n * (F_CPU / (16 * baud) - 1), rounded. The largest n which
+/ keeps BSEL within 12 bits gives the finest steps, e.g. 2094 and -7 for
+/ 115200 baud at 32MHz. The integer part of BSEL / 2^n is kept at 1 or more,
+/ below that only BSCALE 0 is used.
+/
+/ Everything is a constant expression, it works in #if as well as in
+/ initializers. F_CPU must not carry an unsigned suffix.
+/----------------------------------------------------------------------------*/
+#ifndef XMEGA_BAUD_H
+#define XMEGA_BAUD_H
+
+/* Worst rate error a build accepts, in 1/1000. The host's adapter adds its
+   own, 2% on each side is where framing errors start. */
+#ifndef BAUD_MAX_ERROR
+    #define BAUD_MAX_ERROR 20
+#endif
+
+#define BAUD_BSEL_N(baud,n) \
+    (((F_CPU) * (1LL << (n)) - 16LL * (baud) * (1LL << (n)) + 8LL * (baud)) / (16LL * (baud)))
+
+#define BAUD_FITS(baud,n) \
+    ((BAUD_BSEL_N(baud,n) <= 4095) && (BAUD_BSEL_N(baud,n) >= (1LL << (n))))
+
+/* n, BSCALE is its negative */
+#define BAUD_SCALE(baud) \
+    (BAUD_FITS(baud,7) ? 7 : BAUD_FITS(baud,6) ? 6 : BAUD_FITS(baud,5) ? 5 : \
+     BAUD_FITS(baud,4) ? 4 : BAUD_FITS(baud,3) ? 3 : BAUD_FITS(baud,2) ? 2 : \
+     BAUD_FITS(baud,1) ? 1 : 0)
+
+#define BAUD_BSEL(baud) BAUD_BSEL_N(baud, BAUD_SCALE(baud))
+
+/* What the USART really does with these settings */
+#define BAUD_ACTUAL(baud) \
+    ((F_CPU) * (1LL << BAUD_SCALE(baud)) / \
+     (16LL * (BAUD_BSEL(baud) + (1LL << BAUD_SCALE(baud)))))
+
+/* In 1/1000 of baud */
+#define BAUD_ERROR(baud) \
+    (((BAUD_ACTUAL(baud) > (baud)) ? (BAUD_ACTUAL(baud) - (baud)) : \
+      ((baud) - BAUD_ACTUAL(baud))) * 1000 / (baud))
+
+#define BAUD_OK(baud) \
+    ((BAUD_BSEL(baud) <= 4095) && (BAUD_ERROR(baud) <= BAUD_MAX_ERROR))
+
+/* BAUDCTRLB in the high byte, BAUDCTRLA in the low one */
+#define BAUD_CTRL(baud) \
+    ((((16 - BAUD_SCALE(baud)) & 0x0F) << 12) | BAUD_BSEL(baud))
+
+#endif /* XMEGA_BAUD_H */
@@ -0,0 +1,381 @@
+/*-------------------------------------------------------------------------------------------------
+/ Microbenchmarks for the host side parsing, framing and serial I/O paths.
+/
+/ Usage: bench [-j <file.json>] [-q]
+/   -j: also write the results as JSON, to compare against a baseline
+/   -q: quick run with fewer and smaller samples
+/------------------------------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "serial_lib.h"
+#include "image.h"
+#include "crc.h"
+/*-----------------------------------------------------------------------------------------------*/
+#define MAX_RESULTS 32
+/*-----------------------------------------------------------------------------------------------*/
+typedef struct
+{
+    char name[48];
+    double value;
+    const char* unit;
+    double perOp;       /* nanoseconds per operation */
+    long ops;
+} result_t;
+/*-----------------------------------------------------------------------------------------------*/
+static result_t results[MAX_RESULTS];
+static int resultCount = 0;
+static int quick = 0;
+static tl_image image;
+static char tmpDir[64];
+static volatile uint32_t sink;   /* keeps results alive so the timed loops aren't optimized out */
+/*-----------------------------------------------------------------------------------------------*/
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void addResult(const char* name, double value, const char* unit, double perOp, long ops)
+{
+    result_t* r;
+
+    if(resultCount >= MAX_RESULTS)
+        return;
+
+    r = &results[resultCount++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->value = value;
+    r->unit = unit;
+    r->perOp = perOp;
+    r->ops = ops;
+
+    printf("  %-32s %12.2f %-10s %12.1f ns/op  (%ld ops)\n", name, value, unit, perOp, ops);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Writes a hex file with dataSize payload bytes in 16 byte records. Addresses wrap inside the
+   64K image, so large files stress the parser without outgrowing the buffer. */
+static long makeHex(const char* path, long dataSize)
+{
+    FILE* out;
+    long done;
+    int i, n, sum, address;
+    uint8_t rec[16];
+    uint32_t seed = 12345;
+
+    if((out = fopen(path, "w")) == NULL)
+        return -1;
+
+    for(done=0;done<dataSize;done+=n)
+    {
+        n = (dataSize - done) < 16 ? (dataSize - done) : 16;
+        address = done % IMAGE_SIZE;
+        sum = n + (address >> 8) + (address & 0xFF);
+
+        fprintf(out, ":%02X%04X00", n, address);
+        for(i=0;i<n;i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            rec[i] = seed >> 16;
+            sum += rec[i];
+            fprintf(out, "%02X", rec[i]);
+        }
+        fprintf(out, "%02X\n", (-sum) & 0xFF);
+    }
+    fprintf(out, ":00000001FF\n");
+
+    done = ftell(out);
+    fclose(out);
+
+    return done;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void benchParse(void)
+{
+    int r, runs;
+    long textSize;
+    uint64_t t, best;
+    char path[128];
+    char name[48];
+    long i;
+    const long sizes[] = {4096, 32768, 262144, 1048576, 4194304};
+    int sizeCount = quick ? 3 : 5;
+
+    printf("parseIntelHex\n");
+
+    for(i=0;i<sizeCount;i++)
+    {
+        snprintf(path, sizeof(path), "%s/synthetic_%ld.hex", tmpDir, sizes[i]);
+        if((textSize = makeHex(path, sizes[i])) < 0)
+        {
+            printf("  couldn't write %s\n", path);
+            continue;
+        }
+
+        runs = (sizes[i] >= 1048576) ? 3 : (quick ? 5 : 20);
+        best = ~0ULL;
+        for(r=0;r<runs;r++)
+        {
+            image_init(&image);
+            t = nowNs();
+            parseIntelHex(path, image.data, &image.startAddress, &image.endAddress);
+            t = nowNs() - t;
+            if(t < best)
+                best = t;
+        }
+
+        snprintf(name, sizeof(name), "parse_%ldk", sizes[i] / 1024);
+        addResult(name, (textSize / 1048576.0) / (best / 1e9), "MB/s", (double)best / (sizes[i] / 16), sizes[i] / 16);
+        unlink(path);
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void benchParseHex(void)
+{
+    FILE* in;
+    long i;
+    uint64_t t;
+    long count = quick ? 200000 : 2000000;
+    char* text = malloc(count * 2);
+
+    printf("parseHex\n");
+
+    for(i=0;i<count*2;i++)
+        text[i] = "0123456789ABCDEF"[i % 16];
+
+    if((in = fmemopen(text, count * 2, "r")) == NULL)
+    {
+        free(text);
+        return;
+    }
+
+    t = nowNs();
+    for(i=0;i<count;i++)
+        sink += parseHex(in, 2);
+    t = nowNs() - t;
+
+    fclose(in);
+    free(text);
+
+    addResult("parseHex_2digits", (count / 1e6) / (t / 1e9), "Mcalls/s", (double)t / count, count);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void benchFraming(void)
+{
+    int r;
+    int runs = quick ? 20 : 200;
+    long i;
+    uint64_t t, best = ~0ULL;
+    printf("framing\n");
+
+    /* Full 32K application image, no blank pages */
+    image_init(&image);
+    for(i=0;i<32768;i++)
+        image.data[i] = i * 7;
+    image.startAddress = 0;
+    image.endAddress = 32768;
+
+    for(r=0;r<runs;r++)
+    {
+        t = nowNs();
+        image_build_frames(&image);
+        t = nowNs() - t;
+        if(t < best)
+            best = t;
+    }
+    addResult("build_frames_32k", (32768 / 1048576.0) / (best / 1e9), "MB/s", (double)best / image.frameCount, image.frameCount);
+
+    t = nowNs();
+    for(r=0;r<runs;r++)
+        sink += crc16_xmodem(0, image.data, 32768);
+    t = nowNs() - t;
+    addResult("crc16_32k", (runs * 32768 / 1048576.0) / (t / 1e9), "MB/s", (double)t / (runs * 256), runs * 256);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Device stand-in on the pty master: answers every 'a' and every full page with a 'Y' */
+static volatile int echoRun;
+static void* echoThread(void* arg)
+{
+    int n, i;
+    int pending = 0;
+    uint8_t buf[256];
+    int master = *(int*)arg;
+
+    while(echoRun)
+    {
+        n = read(master, buf, sizeof(buf));
+        if(n <= 0)
+        {
+            usleep(50);
+            continue;
+        }
+        for(i=0;i<n;i++)
+        {
+            if(pending > 0)
+            {
+                if(--pending == 0)
+                    write(master, "Y", 1);
+            }
+            else if(buf[i] == 'a')
+            {
+                write(master, "Y", 1);
+            }
+            else if(buf[i] == 'b')
+            {
+                pending = PAGE_SIZE;
+            }
+        }
+    }
+
+    return NULL;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int cmpU64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void benchSerial(void)
+{
+    int i;
+    int fd;
+    int master;
+    char msg;
+    uint64_t t;
+    pthread_t thread;
+    uint8_t page[1 + PAGE_SIZE];
+    int count = quick ? 200 : 2000;
+    uint64_t* samples = malloc(count * sizeof(uint64_t));
+
+    printf("serial (pty loopback)\n");
+
+    if(((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0))
+    {
+        printf("  no pty available\n");
+        free(samples);
+        return;
+    }
+    fcntl(master, F_SETFL, O_NONBLOCK);
+
+    if((fd = serialport_init(ptsname(master), 115200, 'n')) < 0)
+    {
+        close(master);
+        free(samples);
+        return;
+    }
+
+    echoRun = 1;
+    pthread_create(&thread, NULL, echoThread, &master);
+
+    /* Single byte command and ACK, what every protocol step costs */
+    for(i=0;i<count;i++)
+    {
+        t = nowNs();
+        serialport_writebyte(fd, 'a');
+        readRawBytes(fd, &msg, 1, 1000);
+        samples[i] = nowNs() - t;
+    }
+    qsort(samples, count, sizeof(uint64_t), cmpU64);
+    addResult("ack_roundtrip_p50", samples[count / 2] / 1e3, "us", samples[count / 2], count);
+    addResult("ack_roundtrip_p99", samples[(count * 99) / 100] / 1e3, "us", samples[(count * 99) / 100], count);
+
+    /* Page sized writes, each one acknowledged */
+    page[0] = 'b';
+    memset(page + 1, 0x55, PAGE_SIZE);
+    count /= 4;
+    t = nowNs();
+    for(i=0;i<count;i++)
+    {
+        serialport_writebuf(fd, page, sizeof(page));
+        readRawBytes(fd, &msg, 1, 1000);
+    }
+    t = nowNs() - t;
+    addResult("page_roundtrip", (count * sizeof(page) / 1024.0) / (t / 1e9), "KB/s", (double)t / count, count);
+
+    echoRun = 0;
+    pthread_join(thread, NULL);
+    serialport_close(fd);
+    close(master);
+    free(samples);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int writeJson(const char* path)
+{
+    int i;
+    FILE* out;
+
+    if((out = fopen(path, "w")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(out, "{\n  \"results\": [\n");
+    for(i=0;i<resultCount;i++)
+    {
+        fprintf(out, "    {\"name\": \"%s\", \"value\": %.3f, \"unit\": \"%s\", \"ns_per_op\": %.1f, \"ops\": %ld}%s\n",
+            results[i].name, results[i].value, results[i].unit, results[i].perOp, results[i].ops,
+            (i + 1 < resultCount) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+
+    return fclose(out);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    int c;
+    const char* jsonPath = NULL;
+
+    while ((c = getopt(argc, argv, "j:q")) != -1)
+    {
+        switch (c)
+        {
+            case 'j':
+            {
+                jsonPath = optarg;
+                break;
+            }
+            case 'q':
+            {
+                quick = 1;
+                break;
+            }
+            default:
+            {
+                printf("Usage: %s [-j <file.json>] [-q]\n", argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    snprintf(tmpDir, sizeof(tmpDir), "/tmp/tealoader-bench-XXXXXX");
+    if(mkdtemp(tmpDir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    benchParse();
+    benchParseHex();
+    benchFraming();
+    benchSerial();
+
+    rmdir(tmpDir);
+
+    if((jsonPath != NULL) && (writeJson(jsonPath) < 0))
+        return 1;
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------------------------------
+/ Checksum and hash helpers shared by the host side tools.
+/------------------------------------------------------------------------------------------------*/
+#include "crc.h"
+/*-----------------------------------------------------------------------------------------------*/
+uint16_t crc16_xmodem(uint16_t crc, const uint8_t* buf, size_t len)
+{
+    int i;
+
+    while(len--)
+    {
+        crc ^= (uint16_t)(*buf++) << 8;
+        for(i=0;i<8;i++)
+        {
+            if(crc & 0x8000)
+                crc = (crc << 1) ^ 0x1021;
+            else
+                crc <<= 1;
+        }
+    }
+
+    return crc;
+}
+/*-----------------------------------------------------------------------------------------------*/
+uint64_t fnv1a64(uint64_t hash, const void* buf, size_t len)
+{
+    const uint8_t* p = buf;
+
+    while(len--)
+    {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,17 @@
+/*-------------------------------------------------------------------------------------------------
+/ Checksum and hash helpers shared by the host side tools.
+/------------------------------------------------------------------------------------------------*/
+#ifndef CRC_H
+#define CRC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* CRC-16/XMODEM, same as avr-libc's _crc_xmodem_update() on the device side. Start with 0. */
+uint16_t crc16_xmodem(uint16_t crc, const uint8_t* buf, size_t len);
+
+/* 64-bit FNV-1a. Start with FNV64_INIT. */
+#define FNV64_INIT 0xcbf29ce484222325ULL
+uint64_t fnv1a64(uint64_t hash, const void* buf, size_t len);
+
+#endif /* CRC_H */
@@ -0,0 +1,352 @@
+/*-------------------------------------------------------------------------------------------------
+/ Delta uploads: pages rebuilt on the device out of what its flash already holds.
+/------------------------------------------------------------------------------------------------*/
+#include <string.h>
+#include "delta.h"
+#include "crc.h"
+/*-----------------------------------------------------------------------------------------------*/
+/* 'e' + address + CRC */
+#define DELTA_HEADER 7
+
+/* A copy takes 3 bytes, shorter matches go out as literals */
+#define DELTA_MIN_COPY 4
+
+/* Candidates looked at per position, bounds the time spent on repetitive images */
+#define DELTA_CHAIN 128
+
+#define HASH_BITS 14
+#define HASH_SIZE (1 << HASH_BITS)
+/*-----------------------------------------------------------------------------------------------*/
+typedef struct
+{
+    int write;          /* the page changes */
+    int done;
+    int readers;        /* pages still to be written which copy from this one */
+    int copied;
+    int length;         /* of the ops, 0 if the page goes out as a 'w' frame */
+    uint8_t ops[2 * PAGE_SIZE];
+    uint8_t reads[IMAGE_PAGES / 8];
+} page_plan_t;
+/*-----------------------------------------------------------------------------------------------*/
+/* What the device holds as far as it is known, and a hash chain of its 3-byte sequences */
+static uint8_t old[IMAGE_SIZE];
+static uint8_t known[IMAGE_PAGES];
+static int head[HASH_SIZE];
+static int prev[IMAGE_SIZE];
+static page_plan_t plan[IMAGE_PAGES];
+static const tl_image* lastImage;
+/*-----------------------------------------------------------------------------------------------*/
+static unsigned int hash3(const uint8_t* p)
+{
+    return (((uint32_t)p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HASH_BITS);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Whether page may be copied from while encoding self. Restricted, only pages which are never
+   written and self itself are, which can't be part of a cycle. */
+static int usable(int page, int self, int restricted)
+{
+    return known[page] && (!restricted || !plan[page].write || (page == self));
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* 1 if copying len bytes from src makes self wait for another page */
+static int holdsUp(int src, int len, int self)
+{
+    int page;
+
+    for(page=src/PAGE_SIZE;page<=(src+len-1)/PAGE_SIZE;page++)
+    {
+        if(plan[page].write && (page != self))
+            return 1;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void buildIndex(int end)
+{
+    int i;
+    unsigned int h;
+
+    for(i=0;i<HASH_SIZE;i++)
+        head[i] = -1;
+
+    for(i=0;i+3<=end;i++)
+    {
+        if(!known[i / PAGE_SIZE])
+            continue;
+
+        h = hash3(old + i);
+        prev[i] = head[h];
+        head[h] = i;
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int matchLength(const uint8_t* now, int i, int src, int end, int self, int restricted)
+{
+    int n = 0;
+
+    while(((i + n) < PAGE_SIZE) && ((src + n) < end) && usable((src + n) / PAGE_SIZE, self, restricted) &&
+          (old[src + n] == now[i + n]))
+    {
+        n++;
+    }
+
+    return n;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static uint8_t* flushLiteral(uint8_t* p, const uint8_t* now, int start, int end)
+{
+    if(start < end)
+    {
+        *p++ = end - start - 1;
+        memcpy(p, now + start, end - start);
+        p += end - start;
+    }
+
+    return p;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Greedy, the longest match at each position. Leaves length at 0 if a 'w' frame is shorter. */
+static void encodePage(int self, const uint8_t* now, int end, int restricted)
+{
+    int i = 0;
+    int k;
+    int n;
+    int src;
+    int best;
+    int bestSrc = 0;
+    int literal = 0;
+    page_plan_t* pl = &plan[self];
+    uint8_t* p = pl->ops;
+
+    memset(pl->reads, 0, sizeof(pl->reads));
+    pl->copied = 0;
+
+    while(i < PAGE_SIZE)
+    {
+        best = 0;
+
+        for(src=((i + 3) <= PAGE_SIZE) ? head[hash3(now + i)] : -1, k=0;(src >= 0) && (k < DELTA_CHAIN);src=prev[src], k++)
+        {
+            n = matchLength(now, i, src, end, self, restricted);
+
+            /* On a tie, pages which don't change keep the write order free */
+            if((n > best) || ((n == best) && (n > 0) && holdsUp(bestSrc, best, self) && !holdsUp(src, n, self)))
+            {
+                best = n;
+                bestSrc = src;
+            }
+
+            if((best == (PAGE_SIZE - i)) && !holdsUp(bestSrc, best, self))
+                break;
+        }
+
+        if(best < DELTA_MIN_COPY)
+        {
+            i++;
+            continue;
+        }
+
+        p = flushLiteral(p, now, literal, i);
+        *p++ = 0x80 | (best - 1);
+        *p++ = (bestSrc >> 0) & 0xFF;
+        *p++ = (bestSrc >> 8) & 0xFF;
+
+        for(n=bestSrc/PAGE_SIZE;n<=(bestSrc+best-1)/PAGE_SIZE;n++)
+        {
+            if(plan[n].write && (n != self))
+                pl->reads[n / 8] |= 1 << (n % 8);
+        }
+
+        pl->copied += best;
+        i += best;
+        literal = i;
+    }
+
+    p = flushLiteral(p, now, literal, PAGE_SIZE);
+    pl->length = p - pl->ops;
+
+    if((DELTA_HEADER + pl->length) >= (1 + 4 + PAGE_SIZE))
+    {
+        memset(pl->reads, 0, sizeof(pl->reads));
+        pl->copied = 0;
+        pl->length = 0;
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Adds delta to the reader count of every page self copies from */
+static void countReads(int self, int pages, int delta)
+{
+    int page;
+
+    for(page=0;page<pages;page++)
+    {
+        if(plan[self].reads[page / 8] & (1 << (page % 8)))
+            plan[page].readers += delta;
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* A pending page on a cycle, for when every page left still has readers. Each of them has a
+   pending reader, so walking from reader to reader comes back round to a page passed before. A
+   page which only feeds a cycle is never picked, stripping it wouldn't free anything. */
+static int pageOnCycle(int pages)
+{
+    int page;
+    int reader;
+    uint8_t seen[IMAGE_PAGES];
+
+    memset(seen, 0, sizeof(seen));
+
+    for(page=0;page<pages;page++)
+    {
+        if(plan[page].write && !plan[page].done)
+            break;
+    }
+
+    while((page < pages) && !seen[page])
+    {
+        seen[page] = 1;
+
+        for(reader=0;reader<pages;reader++)
+        {
+            if(plan[reader].write && !plan[reader].done && (plan[reader].reads[page / 8] & (1 << (page % 8))))
+                break;
+        }
+
+        page = reader;
+    }
+
+    return page;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void encodeDelta(tl_frame* frame, const uint8_t* page, uint32_t offset, const page_plan_t* pl)
+{
+    uint8_t* p = frame->bytes;
+    uint16_t crc = crc16_xmodem(0, page, PAGE_SIZE);
+
+    *p++ = FRAME_DELTA;
+    *p++ = (offset >> 0) & 0xFF;
+    *p++ = (offset >> 8) & 0xFF;
+    *p++ = (offset >> 16) & 0xFF;
+    *p++ = (offset >> 24) & 0xFF;
+    *p++ = (crc >> 0) & 0xFF;
+    *p++ = (crc >> 8) & 0xFF;
+    memcpy(p, pl->ops, pl->length);
+    p += pl->length;
+
+    frame->offset = offset;
+    frame->length = p - frame->bytes;
+    frame->crc = crc;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int delta_page_count(const tl_image* base, const tl_image* img)
+{
+    int end = (img->endAddress > base->endAddress) ? img->endAddress : base->endAddress;
+
+    return (end + PAGE_SIZE - 1) / PAGE_SIZE;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void delta_build_frames(const tl_image* base, const uint16_t* deviceCrcs, tl_image* img,
+                        delta_stats_t* st)
+{
+    int page;
+    int left = 0;
+    int pages = delta_page_count(base, img);
+    int end = pages * PAGE_SIZE;
+    uint16_t crc;
+    uint8_t* was;
+    const uint8_t* now;
+
+    memset(st, 0, sizeof(*st));
+    memcpy(old, base->data, sizeof(old));
+    lastImage = img;
+    img->frameCount = 0;
+    img->frames = img->frameStore;
+
+    /* Pages the device turned out to hold already in their new form are as good as base */
+    for(page=0;page<pages;page++)
+    {
+        was = old + page * PAGE_SIZE;
+        now = img->data + page * PAGE_SIZE;
+        known[page] = 1;
+
+        if((deviceCrcs != NULL) && (deviceCrcs[page] != crc16_xmodem(0, was, PAGE_SIZE)))
+        {
+            crc = crc16_xmodem(0, now, PAGE_SIZE);
+            if(deviceCrcs[page] == crc)
+            {
+                memcpy(was, now, PAGE_SIZE);
+            }
+            else
+            {
+                known[page] = 0;
+                st->unknown++;
+            }
+        }
+
+        memset(&plan[page], 0, sizeof(plan[page]));
+        plan[page].write = !known[page] || (memcmp(was, now, PAGE_SIZE) != 0);
+        if(plan[page].write)
+            left++;
+        else
+            st->unchanged++;
+    }
+
+    buildIndex(end);
+
+    for(page=0;page<pages;page++)
+    {
+        if(plan[page].write)
+            encodePage(page, img->data + page * PAGE_SIZE, end, 0);
+    }
+
+    for(page=0;page<pages;page++)
+    {
+        if(plan[page].write)
+            countReads(page, pages, 1);
+    }
+
+    while(left > 0)
+    {
+        for(page=0;page<pages;page++)
+        {
+            if(plan[page].write && !plan[page].done && (plan[page].readers == 0))
+                break;
+        }
+
+        /* Every page left is still needed by another one, take one out of the cycle */
+        if(page == pages)
+        {
+            page = pageOnCycle(pages);
+
+            countReads(page, pages, -1);
+            encodePage(page, img->data + page * PAGE_SIZE, end, 1);
+            st->cycles++;
+            continue;
+        }
+
+        now = img->data + page * PAGE_SIZE;
+        if(plan[page].length > 0)
+        {
+            encodeDelta(&img->frameStore[img->frameCount++], now, page * PAGE_SIZE, &plan[page]);
+            st->rebuilt++;
+            st->rebuiltBytes += DELTA_HEADER + plan[page].length;
+            st->copiedBytes += plan[page].copied;
+        }
+        else
+        {
+            image_encode_frame(&img->frameStore[img->frameCount++], FRAME_WRITE, now, page * PAGE_SIZE);
+            st->rewritten++;
+        }
+
+        countReads(page, pages, -1);
+        plan[page].done = 1;
+        left--;
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+void delta_fallback_frame(const tl_frame* frame, tl_frame* out)
+{
+    image_encode_frame(out, FRAME_WRITE, lastImage->data + frame->offset, frame->offset);
+}
+/*-----------------------------------------------------------------------------------------------*/
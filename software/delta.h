@@ -0,0 +1,41 @@
+/*-------------------------------------------------------------------------------------------------
+/ Delta uploads: pages rebuilt on the device out of what its flash already holds.
+/
+/ Every page that changed goes out as an 'e' frame of copies from the old flash, anywhere in it, and
+/ literal bytes, so code which only moved costs a few bytes per page. The device checks the rebuilt
+/ page against the CRC in the frame before it programs anything. Copies read the flash as it is at
+/ that moment, so a page is written only once no page still to come copies from it. Where pages
+/ copy from each other in a cycle, one of them is encoded without copies from the others.
+/------------------------------------------------------------------------------------------------*/
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+#include "image.h"
+
+typedef struct
+{
+    int unchanged;
+    int unknown;        /* pages holding neither base nor img, never copied from */
+    int rebuilt;
+    int rebuiltBytes;   /* on the wire, for the rebuilt pages */
+    int copiedBytes;    /* of the rebuilt pages, taken from the flash */
+    int rewritten;
+    int cycles;
+} delta_stats_t;
+
+/* Pages from 0 up to the end of the larger image */
+int delta_page_count(const tl_image* base, const tl_image* img);
+
+/* Replaces the frames of img with the ones that turn the device's flash into img, in an order that
+   is safe to send as it is. base is what the device is believed to hold. deviceCrcs has the CRC of
+   every page the device really holds, as read with 'k'; pages matching neither base nor img are
+   written whole. With NULL, base is trusted, the device still refuses pages that don't add up. */
+void delta_build_frames(const tl_image* base, const uint16_t* deviceCrcs, tl_image* img,
+                        delta_stats_t* st);
+
+/* The 'w' frame for the page of a frame from the last delta_build_frames(), for a page the device
+   couldn't rebuild */
+void delta_fallback_frame(const tl_frame* frame, tl_frame* out);
+
+#endif /* DELTA_H */
@@ -0,0 +1,935 @@
+/*-------------------------------------------------------------------------------------------------
+/ Goodput of the loader over a noisy line.
+/
+/ Runs the host program against a stand-in of the bootloader on a pty, with a model of the serial
+/ line in between. The line carries bytes at LINK_BAUD, 10 bits each, and adds bit errors, lost
+/ bytes, latency and stalls in both directions. The stand-in answers every command the way
+/ firmware/main.c does and takes as long as the flash would to program. Its receiver holds two
+/ bytes, what arrives while the flash is busy beyond that is lost as an overrun. A watchdog reset
+/ puts it straight back into the bootloader, as the host's reset pulse would.
+/
+/ Every bit error rate given gets its own row: completed runs, aborted attempts, runs which ended
+/ with a wrong flash, time to complete and goodput, the image size over that time. With -a an
+/ aborted attempt is followed by another one on the same flash and cache, which is how a user
+/ would get the job done.
+/
+/ Usage: goodput [-e <ber,...>] [-d <rate>] [-S <rate:ms>] [-L <ms>] [-n <runs>] [-a <attempts>]
+/                [-V <version>] [-H <host>] [-t <s>] [-j <file.json>] [-v] -f <file.hex> [-- <host args>]
+/   -e: bit error rates to measure, per bit, default 0,1e-6,1e-5,1e-4
+/   -d: share of bytes lost on the line
+/   -S: share of bytes held up by a stall, and how long the line stalls then
+/   -L: latency added in each direction
+/   -n: runs per bit error rate, 5 by default
+/   -a: attempts per run, 1 by default
+/   -V: firmware version the stand-in reports, only its commands are understood
+/   -H: host program, ./main by default, run with -f, -p and -i and the host args
+/   -t: seconds an attempt may take before it counts as aborted, 60 by default
+/   -j: also write the results as JSON, to compare against a baseline
+/   -v: show the host's output
+/------------------------------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "image.h"
+#include "crc.h"
+#include "loader.h"
+#include "multidrop.h"
+/*-----------------------------------------------------------------------------------------------*/
+#define MAX_RATES 16
+#define QUEUE_SIZE 65536
+
+/* Datasheet figures of the Xmega32E5 for a page erase and a page write */
+#define ERASE_NS 4000000ULL
+#define WRITE_NS 4000000ULL
+
+/* The bootloader's watchdog period, 1K cycles of the 1kHz ULP oscillator */
+#define WDT_NS 1000000000ULL
+
+/* Bytes the USART keeps while nobody reads it, DATA and the shift register */
+#define RX_DEPTH 2
+
+#define DEVICE_TICK_HZ (32000000 / 64)
+
+#define NODE_SELECTED 0
+#define NODE_LISTEN 1
+#define NODE_IDLE 2
+/*-----------------------------------------------------------------------------------------------*/
+typedef struct
+{
+    uint64_t t;         /* nanoseconds, when the last bit is in */
+    uint8_t b;
+    uint8_t frameError;
+} wire_byte_t;
+
+typedef struct
+{
+    wire_byte_t bytes[QUEUE_SIZE];
+    unsigned int head;
+    unsigned int tail;
+    uint64_t lineFree;  /* when the line is done with the byte before */
+    uint32_t count;
+} line_t;
+
+/* Runtime counters as the 's' command sends them, little endian */
+typedef struct __attribute__((packed))
+{
+    uint32_t rxBytes;
+    uint16_t pages;
+    uint16_t spmOps;
+    uint32_t spmTicks;
+    uint16_t spmMaxTicks;
+    uint16_t overruns;
+    uint16_t frameErrors;
+    uint16_t dropped;
+    uint32_t tickHz;
+    uint16_t verifyErrors;
+} device_stats_t;
+
+typedef struct
+{
+    double ber;
+    int runs;
+    int completed;
+    int aborts;
+    int corrupt;
+    double seconds;     /* of the completed runs, all their attempts */
+    uint32_t hostBytes;
+    uint32_t deviceErrors;
+} rate_result_t;
+/*-----------------------------------------------------------------------------------------------*/
+static tl_image image;
+static uint8_t flash[APP_SECTION_SIZE];
+static uint8_t pageBuf[PAGE_SIZE];
+static uint8_t pageMap[APP_SECTION_SIZE / PAGE_SIZE / 8];
+static device_stats_t stats;
+static line_t toDevice;
+static line_t toHost;
+static rate_result_t results[MAX_RATES];
+static int rateCount = 0;
+
+/* Line and stand-in settings */
+static double ber = 0;
+static double dropRate = 0;
+static double stallRate = 0;
+static uint64_t stallNs = 0;
+static uint64_t latencyNs = 0;
+static int version = STREAM_FILL_VERSION;
+static uint64_t byteNs;
+static uint64_t rng;
+
+/* The running attempt */
+static int master = -1;
+static pid_t host = -1;
+static int hostGone;
+static int exited;
+static int watchdog;
+static int nodeMode;
+static uint64_t lastWdr;
+static uint64_t busyFrom;
+static uint64_t busyTo;
+static int busyBytes;
+static int busyHeld;
+static uint64_t deadline;
+static jmp_buf resetJmp;
+static jmp_buf endJmp;
+/*-----------------------------------------------------------------------------------------------*/
+/* xorshift64*, seeded per run so a rate sees the same noise every time */
+static double uniform(void)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+
+    return ((rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Puts a byte on the line at time t. Lost bytes take their time on the line all the same. */
+static void lineSend(line_t* line, uint8_t b, uint64_t t)
+{
+    int i;
+    int frameError = 0;
+    wire_byte_t* w;
+
+    if(line->lineFree > t)
+        t = line->lineFree;
+    if((stallRate > 0) && (uniform() < stallRate))
+        t += stallNs;
+    line->lineFree = t + byteNs;
+    line->count++;
+
+    if((dropRate > 0) && (uniform() < dropRate))
+        return;
+
+    /* Start bit, 8 data bits, stop bit */
+    for(i=0;(ber > 0)&&(i<10);i++)
+    {
+        if(uniform() >= ber)
+            continue;
+
+        if((i == 0) || (i == 9))
+            frameError = 1;
+        else
+            b ^= 1 << (i - 1);
+    }
+
+    if((line->tail - line->head) >= QUEUE_SIZE)
+        return;
+
+    w = &line->bytes[line->tail++ % QUEUE_SIZE];
+    w->t = line->lineFree + latencyNs;
+    w->b = b;
+    w->frameError = frameError;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Moves bytes between the pty and the line until, at the latest, until. Ends the attempt once the
+   host is gone and nothing of it is left in flight. */
+static void pump(uint64_t until)
+{
+    int n;
+    int i;
+    uint64_t now = nowNs();
+    uint64_t wake = until;
+    uint8_t buf[256];
+    struct timespec ts;
+    struct pollfd pfd = { master, POLLIN, 0 };
+    wire_byte_t* w;
+
+    while((toHost.head != toHost.tail) && ((w = &toHost.bytes[toHost.head % QUEUE_SIZE])->t <= now))
+    {
+        /* A full pty takes it on the next round */
+        if(!hostGone && (write(master, &w->b, 1) < 0) && (errno == EAGAIN))
+            break;
+        toHost.head++;
+    }
+
+    if((toHost.head != toHost.tail) && (toHost.bytes[toHost.head % QUEUE_SIZE].t < wake))
+        wake = toHost.bytes[toHost.head % QUEUE_SIZE].t;
+
+    /* Short sleeps, the host exits without a word */
+    if(wake > (now + 10000000))
+        wake = now + 10000000;
+    ts.tv_sec = (wake > now) ? (wake - now) / 1000000000 : 0;
+    ts.tv_nsec = (wake > now) ? (wake - now) % 1000000000 : 0;
+
+    if(ppoll(&pfd, 1, &ts, NULL) > 0)
+    {
+        n = read(master, buf, sizeof(buf));
+        now = nowNs();
+        for(i=0;i<n;i++)
+            lineSend(&toDevice, buf[i], now);
+    }
+
+    if(!hostGone && (waitpid(host, NULL, WNOHANG) == host))
+    {
+        hostGone = 1;
+        host = -1;
+    }
+
+    if(hostGone && (toDevice.head == toDevice.tail) && (poll(&pfd, 1, 0) <= 0))
+        longjmp(endJmp, 1);
+
+    if(nowNs() > deadline)
+        longjmp(endJmp, 2);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static uint8_t getch(void)
+{
+    wire_byte_t* w;
+    uint64_t until;
+
+    for(;;)
+    {
+        if(watchdog && (nowNs() > (lastWdr + WDT_NS)))
+            longjmp(resetJmp, 1);
+
+        if(toDevice.head != toDevice.tail)
+        {
+            w = &toDevice.bytes[toDevice.head % QUEUE_SIZE];
+            if(w->t <= nowNs())
+            {
+                toDevice.head++;
+
+                /* Arrived while the CPU waited for the flash. Newer firmware reads filler off
+                   meanwhile and keeps the first other byte, the receiver only holds a few more. */
+                if((w->t >= busyFrom) && (w->t < busyTo))
+                {
+                    if((version >= STREAM_FILL_VERSION) && !busyHeld)
+                    {
+                        busyHeld = (w->b != STREAM_FILL);
+                    }
+                    else if(++busyBytes > RX_DEPTH)
+                    {
+                        stats.overruns++;
+                        continue;
+                    }
+                }
+
+                if(w->frameError)
+                    stats.frameErrors++;
+                stats.rxBytes++;
+
+                return w->b;
+            }
+        }
+
+        until = (toDevice.head != toDevice.tail) ? toDevice.bytes[toDevice.head % QUEUE_SIZE].t : UINT64_MAX;
+        if(watchdog && (until > (lastWdr + WDT_NS)))
+            until = lastWdr + WDT_NS;
+        pump(until);
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void sendch(uint8_t b)
+{
+    if(nodeMode == NODE_SELECTED)
+        lineSend(&toHost, b, nowNs());
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* The CPU waits for the flash, bytes keep coming in */
+static void spm(uint64_t ns)
+{
+    uint32_t ticks = ns * DEVICE_TICK_HZ / 1000000000;
+
+    busyFrom = nowNs();
+    busyTo = busyFrom + ns;
+    busyBytes = 0;
+    busyHeld = 0;
+
+    while(nowNs() < busyTo)
+        pump(busyTo);
+
+    stats.spmOps++;
+    stats.spmTicks += ticks;
+    if(ticks > stats.spmMaxTicks)
+        stats.spmMaxTicks = ticks;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static uint32_t getAddress(void)
+{
+    uint32_t address;
+
+    address = getch();
+    address |= (uint32_t)getch() << 8;
+    address |= (uint32_t)getch() << 16;
+    address |= (uint32_t)getch() << 24;
+
+    return address;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Flash outside the application section reads as erased and doesn't take writes */
+static uint8_t readFlash(uint32_t address)
+{
+    return (address < sizeof(flash)) ? flash[address] : 0xFF;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static uint8_t programPage(uint32_t address, int eraseFirst)
+{
+    address &= ~(uint32_t)(PAGE_SIZE - 1);
+
+    spm(eraseFirst ? (ERASE_NS + WRITE_NS) : WRITE_NS);
+    stats.pages++;
+
+    if(address >= sizeof(flash))
+        return 'V';
+
+    memcpy(flash + address, pageBuf, PAGE_SIZE);
+    pageMap[address / PAGE_SIZE / 8] |= 1 << ((address / PAGE_SIZE) % 8);
+
+    return 'Y';
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void readDelta(int build)
+{
+    int i = 0;
+    int n;
+    uint8_t op;
+    uint8_t c;
+    uint16_t source = 0;
+
+    while(i < PAGE_SIZE)
+    {
+        op = getch();
+        n = (op & 0x7F) + 1;
+
+        if(op & 0x80)
+        {
+            source = getch();
+            source |= (uint16_t)getch() << 8;
+        }
+
+        while(n--)
+        {
+            c = (op & 0x80) ? readFlash(source++) : getch();
+            if(build && (i < PAGE_SIZE))
+                pageBuf[i] = c;
+            i++;
+        }
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void skipCommand(uint8_t cmd)
+{
+    int n = 0;
+
+    switch(cmd)
+    {
+        case 'b': n = PAGE_SIZE; break;
+        case 'c': n = 4; break;
+        case 'w': n = 4 + PAGE_SIZE; break;
+        case 'p': getAddress(); n = getch(); break;
+        case 'k': n = 5; break;
+        case 'u': n = 1; break;
+        case 'i': n = 3; break;
+        case 'e': getAddress(); getch(); getch(); readDelta(0); break;
+    }
+
+    while(n--)
+        getch();
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* The command loop of firmware/main.c, for the commands version knows */
+static void runDevice(void)
+{
+    uint8_t msg;
+    uint8_t n;
+    uint16_t crc;
+    uint32_t address;
+    uint32_t i;
+
+    /* Back here on a watchdog reset */
+    setjmp(resetJmp);
+    watchdog = 0;
+    nodeMode = NODE_SELECTED;
+    memset(pageMap, 0, sizeof(pageMap));
+
+    /* Anything but a ping sends it into the application until the watchdog bites */
+    if(getch() != 'a')
+    {
+        watchdog = 1;
+        lastWdr = nowNs();
+        for(;;)
+            getch();
+    }
+    sendch('Y');
+    watchdog = 1;
+    lastWdr = nowNs();
+
+    for(;;)
+    {
+        msg = getch();
+        lastWdr = nowNs();
+
+        if((version >= STREAM_FILL_VERSION) && (msg == STREAM_FILL))
+            continue;
+
+        if((nodeMode == NODE_IDLE) && (msg != 'n'))
+        {
+            skipCommand(msg);
+            continue;
+        }
+
+        switch(msg)
+        {
+            case 'a':
+            {
+                sendch('Y');
+                break;
+            }
+            case 'b':
+            {
+                sendch('Y');
+                for(i=0;i<PAGE_SIZE;i++)
+                    pageBuf[i] = getch();
+                break;
+            }
+            case 'c':
+            {
+                sendch('Y');
+                address = getAddress();
+                sendch(programPage(address, 1));
+                break;
+            }
+            case 'w':
+            {
+                if(version < WRITE_FRAME_VERSION)
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                /* The erase runs while the data comes in */
+                sendch('Y');
+                address = getAddress();
+                for(i=0;i<PAGE_SIZE;i++)
+                    pageBuf[i] = getch();
+                sendch(programPage(address, 0));
+                break;
+            }
+            case 'p':
+            {
+                if(version < PATCH_VERSION)
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                sendch('Y');
+                address = getAddress();
+                n = getch();
+                for(i=0;i<PAGE_SIZE;i++)
+                    pageBuf[i] = readFlash((address & ~(uint32_t)(PAGE_SIZE - 1)) + i);
+                for(i=0;i<n;i++)
+                    pageBuf[(address + i) & (PAGE_SIZE - 1)] = getch();
+                sendch(programPage(address, 1));
+                break;
+            }
+            case 'e':
+            {
+                if(version < DELTA_VERSION)
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                sendch('Y');
+                address = getAddress();
+                crc = getch();
+                crc |= (uint16_t)getch() << 8;
+                readDelta(1);
+
+                if(crc16_xmodem(0, pageBuf, PAGE_SIZE) != crc)
+                {
+                    stats.verifyErrors++;
+                    sendch('V');
+                    break;
+                }
+                sendch(programPage(address, 1));
+                break;
+            }
+            case 'd':
+            {
+                for(i=0;i<sizeof(flash);i+=PAGE_SIZE)
+                {
+                    spm(ERASE_NS);
+                    lastWdr = nowNs();
+                }
+                memset(flash, 0xFF, sizeof(flash));
+                memset(pageMap, 0, sizeof(pageMap));
+                sendch('Y');
+                break;
+            }
+            case 'v':
+            {
+                sendch(version);
+                break;
+            }
+            case 's':
+            {
+                if(version < DEVICE_STATS_VERSION)
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                stats.tickHz = DEVICE_TICK_HZ;
+                for(i=0;i<sizeof(stats);i++)
+                    sendch(((uint8_t*)&stats)[i]);
+                break;
+            }
+            case 'n':
+            {
+                if(version < MULTIDROP_VERSION)
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                /* The stand-in is node 0 */
+                msg = getch();
+                nodeMode = (msg == MULTIDROP_BROADCAST) ? NODE_LISTEN : (msg == 0) ? NODE_SELECTED : NODE_IDLE;
+                break;
+            }
+            case 'm':
+            {
+                if(version < MULTIDROP_VERSION)
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                for(i=0;i<sizeof(pageMap);i++)
+                    sendch(pageMap[i]);
+                break;
+            }
+            case 'k':
+            {
+                if(version < RESUME_VERSION)
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                address = getAddress();
+                for(n=getch();n>0;n--)
+                {
+                    for(i=0;i<PAGE_SIZE;i++)
+                        pageBuf[i] = readFlash(address + i);
+                    crc = crc16_xmodem(0, pageBuf, PAGE_SIZE);
+                    sendch(crc & 0xFF);
+                    sendch(crc >> 8);
+                    address += PAGE_SIZE;
+                }
+                break;
+            }
+            case 'i':
+            {
+                if(version < STAGE_VERSION)
+                {
+                    stats.dropped++;
+                    break;
+                }
+
+                sendch('Y');
+                n = getch();
+                crc = getch();
+                crc |= (uint16_t)getch() << 8;
+                if((n == 0) || (n > (STAGE_SIZE / PAGE_SIZE)) ||
+                   (crc16_xmodem(0, flash + STAGE_SIZE, n * PAGE_SIZE) != crc))
+                {
+                    sendch('V');
+                    break;
+                }
+                sendch('Y');
+
+                for(i=0;i<n;i++)
+                {
+                    memcpy(pageBuf, flash + STAGE_SIZE + i * PAGE_SIZE, PAGE_SIZE);
+                    programPage(i * PAGE_SIZE, 1);
+                    lastWdr = nowNs();
+                }
+                sendch('Y');
+                break;
+            }
+            case 'x':
+            {
+                exited = 1;
+                watchdog = 0;
+                for(;;)
+                    getch();
+                break;
+            }
+            /* Rate switches are turned down like a rate the clock can't hit, the pty has none */
+            default:
+            {
+                stats.dropped++;
+                break;
+            }
+        }
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int openPty(int* slave)
+{
+    int fd;
+    struct termios tio;
+
+    if(((fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0) || (grantpt(fd) < 0) || (unlockpt(fd) < 0))
+    {
+        perror("pty");
+        return -1;
+    }
+
+    /* Raw, and kept open so the master doesn't see a hangup while the host reopens the port */
+    *slave = open(ptsname(fd), O_RDWR | O_NOCTTY);
+    if((*slave < 0) || (tcgetattr(*slave, &tio) < 0))
+    {
+        perror(ptsname(fd));
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(*slave, TCSANOW, &tio);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static pid_t startHost(const char* hostPath, const char* hexPath, const char* cacheDir,
+                       char** hostArgs, int hostArgCount, int showOutput)
+{
+    pid_t pid;
+    int i;
+    int fd;
+    char* args[64];
+    int n = 0;
+
+    args[n++] = (char*)hostPath;
+    args[n++] = "-f";
+    args[n++] = (char*)hexPath;
+    args[n++] = "-p";
+    args[n++] = ptsname(master);
+    args[n++] = "-i";
+    for(i=0;(i<hostArgCount)&&(n<63);i++)
+        args[n++] = hostArgs[i];
+    args[n] = NULL;
+
+    if((pid = fork()) != 0)
+        return pid;
+
+    close(master);
+    setenv("TEALOADER_CACHE", cacheDir, 1);
+    if(!showOutput && ((fd = open("/dev/null", O_WRONLY)) >= 0))
+    {
+        dup2(fd, 1);
+        dup2(fd, 2);
+    }
+    execv(hostPath, args);
+    perror(hostPath);
+    _exit(127);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* 1 if the host got the whole image in and jumped to it, 0 if it broke off, -1 if it jumped to a
+   wrong flash */
+static int attempt(const char* hostPath, const char* hexPath, const char* cacheDir, char** hostArgs,
+                   int hostArgCount, int showOutput, int timeoutS, uint32_t* hostBytes)
+{
+    int slave;
+    int ended;
+
+    if((master = openPty(&slave)) < 0)
+        return 0;
+
+    memset(&toDevice, 0, sizeof(toDevice));
+    memset(&toHost, 0, sizeof(toHost));
+    busyFrom = busyTo = 0;
+    hostGone = 0;
+    exited = 0;
+    deadline = nowNs() + (uint64_t)timeoutS * 1000000000;
+
+    host = startHost(hostPath, hexPath, cacheDir, hostArgs, hostArgCount, showOutput);
+
+    if((ended = setjmp(endJmp)) == 0)
+        runDevice();
+
+    if(host > 0)
+    {
+        kill(host, SIGKILL);
+        waitpid(host, NULL, 0);
+        host = -1;
+    }
+    close(master);
+    close(slave);
+    *hostBytes += toDevice.count;
+
+    if((ended != 1) || !exited)
+        return 0;
+
+    return (memcmp(flash, image.data, image.endAddress) == 0) ? 1 : -1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void clearDir(const char* path)
+{
+    DIR* dir;
+    struct dirent* e;
+    char file[512];
+
+    if((dir = opendir(path)) == NULL)
+        return;
+
+    while((e = readdir(dir)) != NULL)
+    {
+        if(e->d_name[0] == '.')
+            continue;
+        snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int writeJson(const char* path)
+{
+    int i;
+    FILE* out;
+    const rate_result_t* r;
+
+    if((out = fopen(path, "w")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(out, "{\n  \"image_bytes\": %d, \"baud\": %d, \"drop_rate\": %g, \"stall_rate\": %g, \"stall_ms\": %.3f, \"latency_ms\": %.3f,\n",
+        image.endAddress, LINK_BAUD, dropRate, stallRate, stallNs / 1e6, latencyNs / 1e6);
+    fprintf(out, "  \"results\": [\n");
+    for(i=0;i<rateCount;i++)
+    {
+        r = &results[i];
+        fprintf(out, "    {\"ber\": %g, \"runs\": %d, \"completed\": %d, \"aborts\": %d, \"corrupt\": %d, "
+                     "\"seconds\": %.3f, \"goodput_Bps\": %.1f, \"host_bytes\": %u, \"device_errors\": %u}%s\n",
+            r->ber, r->runs, r->completed, r->aborts, r->corrupt,
+            r->completed ? (r->seconds / r->completed) : 0.0,
+            r->seconds > 0 ? (image.endAddress * r->completed / r->seconds) : 0.0,
+            r->hostBytes, r->deviceErrors, (i + 1 < rateCount) ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+
+    return fclose(out);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    int c;
+    int i;
+    int run;
+    int res;
+    int tries;
+    int runs = 5;
+    int attempts = 1;
+    int timeoutS = 60;
+    int showOutput = 0;
+    char* list;
+    char* item;
+    char* colon;
+    const char* hostPath = "./main";
+    const char* hexPath = NULL;
+    const char* jsonPath = NULL;
+    const char* usage = "Usage: %s [-e <ber,...>] [-d <rate>] [-S <rate:ms>] [-L <ms>] [-n <runs>] [-a <attempts>]\n"
+                        "       [-V <version>] [-H <host>] [-t <s>] [-j <file.json>] [-v] -f <file.hex> [-- <host args>]\n";
+    char tmpDir[64];
+    uint64_t t;
+    rate_result_t* r;
+
+    while((c = getopt(argc, argv, "e:d:S:L:n:a:V:H:t:j:vf:")) != -1)
+    {
+        switch(c)
+        {
+            case 'e':
+            {
+                list = strdup(optarg);
+                for(item=strtok(list, ",");(item != NULL) && (rateCount < MAX_RATES);item=strtok(NULL, ","))
+                    results[rateCount++].ber = atof(item);
+                break;
+            }
+            case 'd': dropRate = atof(optarg); break;
+            case 'S':
+            {
+                stallRate = atof(optarg);
+                if((colon = strchr(optarg, ':')) != NULL)
+                    stallNs = atof(colon + 1) * 1e6;
+                break;
+            }
+            case 'L': latencyNs = atof(optarg) * 1e6; break;
+            case 'n': runs = atoi(optarg); break;
+            case 'a': attempts = atoi(optarg); break;
+            case 'V': version = atoi(optarg); break;
+            case 'H': hostPath = optarg; break;
+            case 't': timeoutS = atoi(optarg); break;
+            case 'j': jsonPath = optarg; break;
+            case 'v': showOutput = 1; break;
+            case 'f': hexPath = optarg; break;
+            default:
+            {
+                printf(usage, argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    if((hexPath == NULL) || (runs < 1) || (attempts < 1))
+    {
+        printf(usage, argv[0]);
+        return 1;
+    }
+
+    if(rateCount == 0)
+    {
+        const double defaults[] = {0, 1e-6, 1e-5, 1e-4};
+
+        for(i=0;i<4;i++)
+            results[rateCount++].ber = defaults[i];
+    }
+
+    if(image_load_hex(&image, hexPath) == 0)
+        return 1;
+
+    if(image.endAddress > APP_SECTION_SIZE)
+    {
+        printf("[err]: %s doesn't fit the application section\n",hexPath);
+        return 1;
+    }
+
+    snprintf(tmpDir, sizeof(tmpDir), "/tmp/tealoader-goodput-XXXXXX");
+    if(mkdtemp(tmpDir) == NULL)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    byteNs = 10 * 1000000000ULL / LINK_BAUD;
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("> %s: %d bytes, %d baud, %d runs of up to %d attempts per rate\n",hexPath,image.endAddress,LINK_BAUD,runs,attempts);
+    printf("  %-10s %6s %9s %7s %8s %10s %12s %12s\n","ber","runs","completed","aborts","corrupt","time s","goodput B/s","device errs");
+
+    for(i=0;i<rateCount;i++)
+    {
+        r = &results[i];
+        ber = r->ber;
+
+        for(run=0;run<runs;run++)
+        {
+            /* Every run starts from a device which holds something else and a clean cache */
+            rng = 0x9E3779B97F4A7C15ULL * (run + 1) + i;
+            memset(flash, 0x55, sizeof(flash));
+            memset(&stats, 0, sizeof(stats));
+            clearDir(tmpDir);
+
+            t = nowNs();
+            for(tries=0;tries<attempts;tries++)
+            {
+                res = attempt(hostPath, hexPath, tmpDir, argv + optind, argc - optind, showOutput, timeoutS, &r->hostBytes);
+                if(res != 0)
+                    break;
+                r->aborts++;
+            }
+            t = nowNs() - t;
+
+            r->runs++;
+            r->deviceErrors += stats.overruns + stats.frameErrors + stats.dropped + stats.verifyErrors;
+            if(res > 0)
+            {
+                r->completed++;
+                r->seconds += t / 1e9;
+            }
+            else if(res < 0)
+            {
+                r->corrupt++;
+            }
+        }
+
+        printf("  %-10g %6d %9d %7d %8d %10.3f %12.1f %12u\n",r->ber,r->runs,r->completed,r->aborts,r->corrupt,
+            r->completed ? (r->seconds / r->completed) : 0.0,
+            (r->seconds > 0) ? (image.endAddress * r->completed / r->seconds) : 0.0,
+            r->deviceErrors);
+        fflush(stdout);
+    }
+
+    clearDir(tmpDir);
+    rmdir(tmpDir);
+
+    if((jsonPath != NULL) && (writeJson(jsonPath) < 0))
+        return 1;
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
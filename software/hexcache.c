@@ -0,0 +1,277 @@
+/*-------------------------------------------------------------------------------------------------
+/ On-disk cache of parsed and pre-framed images.
+/------------------------------------------------------------------------------------------------*/
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "hexcache.h"
+#include "crc.h"
+/*-----------------------------------------------------------------------------------------------*/
+#define CACHE_MAGIC "TLC1"
+#define CACHE_VERSION 2
+/*-----------------------------------------------------------------------------------------------*/
+#ifdef __APPLE__
+    #define st_mtim st_mtimespec
+#endif
+/*-----------------------------------------------------------------------------------------------*/
+/* Header is followed by frameCount tl_frame records. Host byte order; frameSize guards layout. */
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t frameSize;
+    uint32_t frameCount;
+    int32_t startAddress;
+    int32_t endAddress;
+    uint64_t mtimeNs;
+    uint64_t fileSize;
+    uint64_t contentHash;
+    uint8_t blankMap[IMAGE_PAGES / 8];
+} tl_cache_header;
+/*-----------------------------------------------------------------------------------------------*/
+static char defaultDir[PATH_MAX];
+/*-----------------------------------------------------------------------------------------------*/
+const char* hexcache_default_dir(void)
+{
+    const char* env;
+
+    if((env = getenv("TEALOADER_CACHE")) != NULL)
+        snprintf(defaultDir, sizeof(defaultDir), "%s", env);
+    else if((env = getenv("XDG_CACHE_HOME")) != NULL)
+        snprintf(defaultDir, sizeof(defaultDir), "%s/tealoader", env);
+    else if((env = getenv("HOME")) != NULL)
+        snprintf(defaultDir, sizeof(defaultDir), "%s/.cache/tealoader", env);
+    else
+        return NULL;
+
+    return defaultDir;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int hexcache_make_dirs(const char* dir)
+{
+    char tmp[PATH_MAX];
+    char* p;
+
+    snprintf(tmp, sizeof(tmp), "%s", dir);
+
+    for(p=tmp+1;*p;p++)
+    {
+        if(*p == '/')
+        {
+            *p = 0;
+            if((mkdir(tmp, 0755) < 0) && (errno != EEXIST))
+                return -1;
+            *p = '/';
+        }
+    }
+
+    if((mkdir(tmp, 0755) < 0) && (errno != EEXIST))
+        return -1;
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Cache files are named after the hash of the canonical hex file path */
+static int cachePath(const char* cacheDir, const char* hexfile, char* out, size_t len)
+{
+    char real[PATH_MAX];
+
+    if(realpath(hexfile, real) == NULL)
+        return -1;
+
+    snprintf(out, len, "%s/%016llx.tlc", cacheDir,
+        (unsigned long long)fnv1a64(FNV64_INIT, real, strlen(real)));
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int hashFile(const char* path, uint64_t* hash)
+{
+    int fd;
+    ssize_t n;
+    uint8_t buf[65536];
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    *hash = FNV64_INIT;
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+    {
+        *hash = fnv1a64(*hash, buf, n);
+    }
+
+    close(fd);
+    return (n < 0) ? -1 : 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int hexcache_key(const char* hexfile, tl_cache_key* key)
+{
+    struct stat st;
+
+    if(stat(hexfile, &st) < 0)
+        return -1;
+
+    key->mtimeNs = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    key->fileSize = st.st_size;
+
+    return hashFile(hexfile, &key->contentHash);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int hexcache_load(const char* cacheDir, const char* hexfile, tl_image* img)
+{
+    int i;
+    int fd;
+    void* map;
+    struct stat st;
+    tl_cache_key key;
+    const tl_frame* frame;
+    const tl_cache_header* hdr;
+    char path[PATH_MAX];
+
+    if((cacheDir == NULL) || (strcmp(hexfile, "-") == 0))
+        return 0;
+
+    if(cachePath(cacheDir, hexfile, path, sizeof(path)) < 0)
+        return 0;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return 0;
+
+    if((fstat(fd, &st) < 0) || (st.st_size < (off_t)sizeof(tl_cache_header)))
+    {
+        close(fd);
+        return 0;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(map == MAP_FAILED)
+        return 0;
+
+    hdr = map;
+
+    if((memcmp(hdr->magic, CACHE_MAGIC, 4) != 0) ||
+       (hdr->version != CACHE_VERSION) ||
+       (hdr->frameSize != sizeof(tl_frame)) ||
+       (hdr->frameCount > IMAGE_PAGES) ||
+       (st.st_size != (off_t)(sizeof(tl_cache_header) + hdr->frameCount * sizeof(tl_frame))))
+    {
+        goto miss;
+    }
+
+    if(hexcache_key(hexfile, &key) < 0)
+        goto miss;
+
+    if((key.mtimeNs != hdr->mtimeNs) ||
+       (key.fileSize != hdr->fileSize) ||
+       (key.contentHash != hdr->contentHash))
+    {
+        goto miss;
+    }
+
+    image_init(img);
+    img->startAddress = hdr->startAddress;
+    img->endAddress = hdr->endAddress;
+    memcpy(img->blankMap, hdr->blankMap, sizeof(img->blankMap));
+    img->frameCount = hdr->frameCount;
+    img->frames = (const tl_frame*)(hdr + 1);
+    if(img->frameCount > 0)
+        img->frameType = frame_type(&img->frames[0]);
+
+    /* Rebuild the sparse image from the frames, checking each one on the way */
+    for(i=0;i<img->frameCount;i++)
+    {
+        frame = &img->frames[i];
+
+        if((frame->length > FRAME_SIZE) ||
+           ((frame_type(frame) != FRAME_WRITE) && (frame_type(frame) != FRAME_LEGACY)) ||
+           (frame->offset + PAGE_SIZE > IMAGE_SIZE) ||
+           (crc16_xmodem(0, frame_data(frame), PAGE_SIZE) != frame->crc))
+        {
+            goto miss;
+        }
+
+        memcpy(img->data + frame->offset, frame_data(frame), PAGE_SIZE);
+    }
+
+    /* The mapping stays alive for as long as the frames are in use */
+    return 1;
+
+miss:
+    munmap(map, st.st_size);
+    image_init(img);
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void hexcache_detach(tl_image* img)
+{
+    const tl_cache_header* hdr;
+
+    if((img->frames == NULL) || (img->frames == img->frameStore))
+        return;
+
+    hdr = (const tl_cache_header*)img->frames - 1;
+
+    memcpy(img->frameStore, img->frames, img->frameCount * sizeof(tl_frame));
+    img->frames = img->frameStore;
+
+    munmap((void*)hdr, sizeof(tl_cache_header) + hdr->frameCount * sizeof(tl_frame));
+}
+/*-----------------------------------------------------------------------------------------------*/
+int hexcache_store(const char* cacheDir, const char* hexfile, const tl_cache_key* key,
+    const tl_image* img)
+{
+    FILE* out;
+    int ok;
+    tl_cache_header hdr;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+
+    if((cacheDir == NULL) || (strcmp(hexfile, "-") == 0))
+        return 0;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CACHE_MAGIC, 4);
+    hdr.version = CACHE_VERSION;
+    hdr.frameSize = sizeof(tl_frame);
+    hdr.frameCount = img->frameCount;
+    hdr.startAddress = img->startAddress;
+    hdr.endAddress = img->endAddress;
+    hdr.mtimeNs = key->mtimeNs;
+    hdr.fileSize = key->fileSize;
+    hdr.contentHash = key->contentHash;
+    memcpy(hdr.blankMap, img->blankMap, sizeof(hdr.blankMap));
+
+    if(hexcache_make_dirs(cacheDir) < 0)
+        return 0;
+
+    if(cachePath(cacheDir, hexfile, path, sizeof(path)) < 0)
+        return 0;
+
+    /* Write to a temporary file and rename, so readers never see a partial cache */
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    if((out = fopen(tmp, "wb")) == NULL)
+        return 0;
+
+    ok = (fwrite(&hdr, sizeof(hdr), 1, out) == 1);
+    if(img->frameCount > 0)
+        ok = ok && (fwrite(img->frames, sizeof(tl_frame), img->frameCount, out) == (size_t)img->frameCount);
+    ok = (fclose(out) == 0) && ok;
+
+    if(!ok || (rename(tmp, path) < 0))
+    {
+        unlink(tmp);
+        return 0;
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,43 @@
+/*-------------------------------------------------------------------------------------------------
+/ On-disk cache of parsed and pre-framed images.
+/
+/ A cache file holds the blank page map and the encoded transmit frames of one hex file. Frames
+/ carry the page data, so the sparse image is rebuilt from them. The file is mapped read-only and
+/ the frames are used in place.
+/------------------------------------------------------------------------------------------------*/
+#ifndef HEXCACHE_H
+#define HEXCACHE_H
+
+#include <stdint.h>
+#include "image.h"
+
+/* Identifies the contents of a hex file, its mtime, size and hash */
+typedef struct
+{
+    uint64_t mtimeNs;
+    uint64_t fileSize;
+    uint64_t contentHash;
+} tl_cache_key;
+
+/* Directory used when the caller doesn't give one. Returns NULL if nothing suitable is found. */
+const char* hexcache_default_dir(void);
+
+/* mkdir -p, also used for the other files kept next to the cache */
+int hexcache_make_dirs(const char* dir);
+
+/* Returns 1 and fills the image on a valid hit, 0 otherwise */
+int hexcache_load(const char* cacheDir, const char* hexfile, tl_image* img);
+
+/* Copies the frames of a cache hit into img->frameStore and drops the mapping. For long running
+   users which load many images, does nothing if the frames aren't mapped. */
+void hexcache_detach(tl_image* img);
+
+/* Takes the key of hexfile, before parsing it. A file rebuilt meanwhile then misses the cache
+   instead of hitting on what was parsed from the old one. Returns -1 if the file can't be read. */
+int hexcache_key(const char* hexfile, tl_cache_key* key);
+
+/* Returns 1 if the cache file was written, key is what hexcache_key() gave before img was parsed */
+int hexcache_store(const char* cacheDir, const char* hexfile, const tl_cache_key* key,
+    const tl_image* img);
+
+#endif /* HEXCACHE_H */
@@ -0,0 +1,199 @@
+/*-------------------------------------------------------------------------------------------------
+/ Intel HEX parsing and page framing for the teaLoader host software.
+/------------------------------------------------------------------------------------------------*/
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "image.h"
+#include "crc.h"
+#include "log.h"
+/*-----------------------------------------------------------------------------------------------*/
+int parseIntelHex(const char *hexfile, uint8_t* buffer, int *startAddr, int *endAddr) 
+{
+  return parseIntelHexRecords(hexfile, buffer, startAddr, endAddr, NULL, NULL);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int parseIntelHexRecords(const char *hexfile, uint8_t* buffer, int *startAddr, int *endAddr,
+                         hex_record_cb onRecord, void* ctx)
+{
+  int address, base, d, segment, i, lineLen, sum;
+  int ok = 1;
+  FILE *input;
+  
+  input = strcmp(hexfile, "-") == 0 ? stdin : fopen(hexfile, "r");
+  if (input == NULL) {
+    log_printf("> Error opening %s: %s\n", hexfile, strerror(errno));
+    return 0;
+  }
+  
+  while (parseUntilColon(input) == ':') {
+    sum = 0;
+    sum += lineLen = parseHex(input, 2);
+    base = address = parseHex(input, 4);
+    sum += address >> 8;
+    sum += address;
+    sum += segment = parseHex(input, 2);  /* segment value? */
+    if (segment != 0) {   /* ignore lines where this byte is not 0 */
+      continue;
+    }
+    if (address + lineLen > IMAGE_SIZE) {
+      log_printf("> Error: Record at 0x%x runs past the end of the image\n", base);
+      ok = 0;
+      break;
+    }
+    
+    for (i = 0; i < lineLen; i++) {
+      d = parseHex(input, 2);
+      buffer[address++] = d;
+      sum += d;
+    }
+    
+    sum += parseHex(input, 2);
+    if ((sum & 0xff) != 0) {
+      log_printf("> Error: Checksum error between address 0x%x and 0x%x\n", base, address);
+      ok = 0;
+      break;
+    }
+    
+    if(*startAddr > base) {
+      *startAddr = base;
+    }
+    if(*endAddr < address) {
+      *endAddr = address;
+    }
+
+    if (onRecord != NULL && onRecord(ctx, base, address) != 0) {
+      ok = 0;
+      break;
+    }
+  }
+  
+  /* tealoaderd lives on, every job has to give its file back */
+  if (input != stdin) {
+    fclose(input);
+  }
+  return ok;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int parseUntilColon(FILE *file_pointer) 
+{
+  int character;
+  
+  do {
+    character = getc(file_pointer);
+  } while(character != ':' && character != EOF);
+  
+  return character;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int parseHex(FILE *file_pointer, int num_digits) 
+{
+  int iter;
+  char temp[9];
+
+  for(iter = 0; iter < num_digits; iter++) {
+    temp[iter] = getc(file_pointer);
+  }
+  temp[iter] = 0;
+  
+  return strtol(temp, NULL, 16);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void image_init(tl_image* img)
+{
+    memset(img->data, 0xFF, sizeof(img->data));
+    memset(img->blankMap, 0, sizeof(img->blankMap));
+    img->frameType = FRAME_WRITE;
+    img->startAddress = 1;
+    img->endAddress = 0;
+    img->frameCount = 0;
+    img->frames = img->frameStore;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int image_load_hex(tl_image* img, const char* hexfile)
+{
+    image_init(img);
+
+    if(parseIntelHex(hexfile, img->data, &img->startAddress, &img->endAddress) == 0)
+    {
+        return 0;
+    }
+
+    image_build_frames(img);
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void image_encode_frame(tl_frame* frame, int type, const uint8_t* page, uint32_t offset)
+{
+    uint8_t* p = frame->bytes;
+
+    if(type == FRAME_WRITE)
+    {
+        /* Erase-while-receiving write command */
+        *p++ = 'w';
+        *p++ = (offset >> 0) & 0xFF;
+        *p++ = (offset >> 8) & 0xFF;
+        *p++ = (offset >> 16) & 0xFF;
+        *p++ = (offset >> 24) & 0xFF;
+        memcpy(p, page, PAGE_SIZE);
+        p += PAGE_SIZE;
+    }
+    else
+    {
+        /* Fill the page buffer command */
+        *p++ = 'b';
+        memcpy(p, page, PAGE_SIZE);
+        p += PAGE_SIZE;
+
+        /* Write the page command */
+        *p++ = 'c';
+        *p++ = (offset >> 0) & 0xFF;
+        *p++ = (offset >> 8) & 0xFF;
+        *p++ = (offset >> 16) & 0xFF;
+        *p++ = (offset >> 24) & 0xFF;
+    }
+
+    frame->offset = offset;
+    frame->length = p - frame->bytes;
+    frame->crc = crc16_xmodem(0, page, PAGE_SIZE);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void image_build_frames(tl_image* img)
+{
+    int page;
+    int offset;
+
+    memset(img->blankMap, 0, sizeof(img->blankMap));
+    img->frameCount = 0;
+    img->frames = img->frameStore;
+
+    for(offset=0;offset<img->endAddress;offset+=PAGE_SIZE)
+    {
+        page = offset / PAGE_SIZE;
+
+        /* The chip is erased before uploading, so there is no need to send blank pages */
+        if(image_page_blank(img, page))
+        {
+            img->blankMap[page / 8] |= 1 << (page % 8);
+            continue;
+        }
+
+        image_encode_frame(&img->frameStore[img->frameCount++], img->frameType, img->data + offset, offset);
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+int image_page_blank(const tl_image* img, int page)
+{
+    int i;
+    const uint8_t* p = img->data + (page * PAGE_SIZE);
+
+    for(i=0;i<PAGE_SIZE;i++)
+    {
+        if(p[i] != 0xFF)
+            return 0;
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
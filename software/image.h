@@ -0,0 +1,73 @@
+/*-------------------------------------------------------------------------------------------------
+/ Intel HEX parsing and page framing for the teaLoader host software.
+/------------------------------------------------------------------------------------------------*/
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define PAGE_SIZE 128
+#define IMAGE_SIZE 65536
+#define IMAGE_PAGES (IMAGE_SIZE / PAGE_SIZE)
+
+/* Frame types, named after their command byte.
+   FRAME_LEGACY: 'b' + page data + 'c' + 32-bit little endian page address. Three ACKs: after 'b',
+                 after 'c' and after programming.
+   FRAME_WRITE:  'w' + 32-bit little endian page address + page data. Two ACKs: after 'w' and after
+                 programming. The device erases the page while the data arrives, firmware v4+.
+   FRAME_PATCH:  'p' + 32-bit little endian byte address + length + bytes. Two ACKs, like 'w'. The
+                 device merges the bytes into the page it already has, firmware v5+.
+   FRAME_DELTA:  'e' + 32-bit little endian page address + CRC-16 of the page + ops until the page
+                 is full. 0x80|(n-1) + 16-bit flash address copies n bytes of the flash, n-1 + n bytes
+                 is a literal. Two ACKs, the second one is 'V' without programming anything if the
+                 page doesn't add up to the CRC, firmware v11+. */
+#define FRAME_LEGACY 'b'
+#define FRAME_WRITE 'w'
+#define FRAME_PATCH 'p'
+#define FRAME_DELTA 'e'
+#define FRAME_SIZE (1 + PAGE_SIZE + 1 + 4)
+
+/* frame_data() is only meaningful for full page frames */
+#define frame_type(frame) ((frame)->bytes[0])
+#define frame_data(frame) ((frame)->bytes + ((frame_type(frame) == FRAME_LEGACY) ? 1 : 5))
+#define frame_acks(frame) ((frame_type(frame) == FRAME_LEGACY) ? 3 : 2)
+
+/* Everything that goes on the wire for one page, ready to be written out */
+typedef struct
+{
+    uint32_t offset;
+    uint16_t crc;       /* crc16_xmodem() of the page data */
+    uint16_t length;
+    uint8_t bytes[FRAME_SIZE];
+} tl_frame;
+
+typedef struct
+{
+    uint8_t data[IMAGE_SIZE];
+    int frameType;
+    int startAddress;
+    int endAddress;
+    /* Bit set for pages inside [0,endAddress) which are all 0xFF and need not be sent */
+    uint8_t blankMap[IMAGE_PAGES / 8];
+    int frameCount;
+    const tl_frame* frames;
+    tl_frame frameStore[IMAGE_PAGES];
+} tl_image;
+
+int parseUntilColon(FILE *file_pointer);
+int parseHex(FILE *file_pointer, int num_digits);
+int parseIntelHex(const char *hexfile, uint8_t* buffer, int *startAddr, int *endAddr);
+
+/* Called after each checked data record covering [base,end). Non-zero return stops parsing. */
+typedef int (*hex_record_cb)(void* ctx, int base, int end);
+int parseIntelHexRecords(const char *hexfile, uint8_t* buffer, int *startAddr, int *endAddr,
+                         hex_record_cb onRecord, void* ctx);
+
+void image_init(tl_image* img);
+int image_load_hex(tl_image* img, const char* hexfile);
+void image_encode_frame(tl_frame* frame, int type, const uint8_t* page, uint32_t offset);
+void image_build_frames(tl_image* img);
+int image_page_blank(const tl_image* img, int page);
+
+#endif /* IMAGE_H */
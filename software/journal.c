@@ -0,0 +1,93 @@
+/*-------------------------------------------------------------------------------------------------
+/ Upload journal, one per serial port.
+/------------------------------------------------------------------------------------------------*/
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "crc.h"
+#include "hexcache.h"
+#include "journal.h"
+/*-----------------------------------------------------------------------------------------------*/
+/* Journals sit next to the image cache and are named after the hash of the canonical port path,
+   so /dev/serial/by-id links and the tty they point to share one */
+static int journalPath(const char* port, char* out, size_t len)
+{
+    char real[PATH_MAX];
+    const char* dir = hexcache_default_dir();
+
+    if(dir == NULL)
+        return -1;
+
+    if(realpath(port, real) == NULL)
+        snprintf(real, sizeof(real), "%s", port);
+
+    snprintf(out, len, "%s/%016llx.tlj", dir,
+        (unsigned long long)fnv1a64(FNV64_INIT, real, strlen(real)));
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void journal_init(journal_t* j, const tl_image* img)
+{
+    memset(j, 0, sizeof(*j));
+    memcpy(j->magic, JOURNAL_MAGIC, 4);
+    j->frameType = img->frameType;
+    j->imageHash = fnv1a64(FNV64_INIT, img->data, img->endAddress);
+    j->imageSize = img->endAddress;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int journal_match(const char* port, const journal_t* j, journal_t* found)
+{
+    FILE* in;
+    int ok;
+    char path[PATH_MAX];
+
+    if((journalPath(port, path, sizeof(path)) < 0) || ((in = fopen(path, "rb")) == NULL))
+        return 0;
+
+    ok = (fread(found, sizeof(*found), 1, in) == 1);
+    fclose(in);
+
+    return ok && (memcmp(found->magic, JOURNAL_MAGIC, 4) == 0) &&
+           (found->frameType == j->frameType) && (found->imageHash == j->imageHash) &&
+           (found->imageSize == j->imageSize);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int journal_save(const char* port, const journal_t* j)
+{
+    FILE* out;
+    int ok;
+    char path[PATH_MAX];
+    char tmp[PATH_MAX + 16];
+
+    if((journalPath(port, path, sizeof(path)) < 0) || (hexcache_make_dirs(hexcache_default_dir()) < 0))
+        return 0;
+
+    /* Same as the cache, a crash halfway must not leave a torn journal behind */
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    if((out = fopen(tmp, "wb")) == NULL)
+        return 0;
+
+    ok = (fwrite(j, sizeof(*j), 1, out) == 1);
+    ok = (fclose(out) == 0) && ok;
+
+    if(!ok || (rename(tmp, path) < 0))
+    {
+        unlink(tmp);
+        return 0;
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void journal_clear(const char* port)
+{
+    char path[PATH_MAX];
+
+    if(journalPath(port, path, sizeof(path)) == 0)
+        unlink(path);
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------------------------------
+/ Upload journal, one per serial port.
+/
+/ Written after the erase and whenever an upload breaks off, removed once it went through. A later
+/ run with the same image on the same port finds it and knows the device was erased for this image,
+/ so it can check the pages with CRCs and continue instead of starting over.
+/------------------------------------------------------------------------------------------------*/
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "image.h"
+
+#define JOURNAL_MAGIC "TLJ1"
+
+typedef struct
+{
+    char magic[4];
+    uint8_t frameType;
+    uint8_t reserved[3];
+    uint64_t imageHash;     /* fnv1a64() of the image data up to endAddress */
+    uint32_t imageSize;
+    uint32_t confirmed;     /* frames which were ACKed in order, a hint only */
+} journal_t;
+
+/* Fills j for img, confirmed starts at 0 */
+void journal_init(journal_t* j, const tl_image* img);
+
+/* Returns 1 if the port has a journal for the same image and frame type as j */
+int journal_match(const char* port, const journal_t* j, journal_t* found);
+
+/* Returns 1 if the journal was written */
+int journal_save(const char* port, const journal_t* j);
+
+void journal_clear(const char* port);
+
+#endif /* JOURNAL_H */
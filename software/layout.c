@@ -0,0 +1,633 @@
+/*-------------------------------------------------------------------------------------------------
+/ Shows which pages of the application change between two builds and what on them changed, and
+/ writes a linker script fragment which keeps chosen code on pages of its own.
+/
+/ Incremental and delta uploads cost about one frame per changed page, and a few bytes which grow
+/ early in the image move everything behind them. Given ELF files the report names the sections
+/ and symbols on every changed page and whether they grew, shrank, moved, appeared or went away.
+/ Intel HEX files work too, without the names.
+/
+/ The fragment belongs in the .text output section of the application's linker script, right after
+/ KEEP(*(.vectors)). Every section named with -s starts on a page of its own and is padded to the
+/ end of its last page. With -a the functions which are the same in both builds follow as one
+/ padded block, so changes elsewhere no longer move them. Input sections are named after their
+/ functions only when the application is built with -ffunction-sections.
+/
+/ Usage: layout [-s <section,...>] [-a] [-l <fragment.ld>] [-v] <old.hex|old.elf> <new.hex|new.elf>
+/   -s: input sections to page align, e.g. .text.uart_init
+/   -a: keep the functions which didn't change on pages of their own as well, needs ELF files
+/   -l: write the fragment to this file instead of printing it
+/   -v: list every symbol on a changed page, not only the ones which differ
+/------------------------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+/*-----------------------------------------------------------------------------------------------*/
+#define ELF_PT_LOAD 1
+#define ELF_SHT_SYMTAB 2
+#define ELF_SHT_NOBITS 8
+#define ELF_SHF_ALLOC 2
+#define ELF_STT_OBJECT 1
+#define ELF_STT_FUNC 2
+
+#define MAX_PINNED 256
+/*-----------------------------------------------------------------------------------------------*/
+/* A section or a symbol, at its place in the flash. For initialised data that's the load address,
+   not the one in RAM. */
+typedef struct
+{
+    const char* name;
+    uint32_t addr;
+    uint32_t size;
+    int section;        /* index into sections, for symbols */
+    int isFunc;
+} symbol_t;
+
+typedef struct
+{
+    const char* path;
+    int isElf;
+    uint8_t* file;
+    long fileSize;
+    int sectionCount;
+    symbol_t* sections;
+    int symbolCount;
+    symbol_t* symbols;
+    tl_image img;
+} build_t;
+/*-----------------------------------------------------------------------------------------------*/
+static build_t builds[2];
+static const char* pinned[MAX_PINNED];
+static int pinnedCount = 0;
+static int verbose = 0;
+/*-----------------------------------------------------------------------------------------------*/
+static uint32_t le16(const uint8_t* b)
+{
+    return b[0] | (b[1] << 8);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static uint32_t le32(const uint8_t* b)
+{
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int byAddress(const void* a, const void* b)
+{
+    const symbol_t* x = a;
+    const symbol_t* y = b;
+
+    if(x->addr != y->addr)
+        return (x->addr < y->addr) ? -1 : 1;
+
+    return strcmp(x->name, y->name);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* 1 if [off,off+len) lies inside the file */
+static int inFile(const build_t* b, uint32_t off, uint32_t len)
+{
+    return (off <= (uint32_t)b->fileSize) && (len <= ((uint32_t)b->fileSize - off));
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int loadElf(build_t* b)
+{
+    const uint8_t* f = b->file;
+    const uint8_t* ph;
+    const uint8_t* sh;
+    const uint8_t* sym;
+    const char* strings;
+    uint32_t phoff;
+    uint32_t shoff;
+    uint32_t phentsize;
+    uint32_t shentsize;
+    uint32_t phnum;
+    uint32_t shnum;
+    uint32_t shstrndx;
+    uint32_t i;
+    uint32_t k;
+    uint32_t off;
+    uint32_t size;
+    uint32_t addr;
+    long* lma;
+
+    if((b->fileSize < 52) || (f[4] != 1) || (f[5] != 1))
+    {
+        printf("[err]: %s is not a 32-bit little endian ELF file\n",b->path);
+        return -1;
+    }
+
+    phoff = le32(f + 28);
+    shoff = le32(f + 32);
+    phentsize = le16(f + 42);
+    phnum = le16(f + 44);
+    shentsize = le16(f + 46);
+    shnum = le16(f + 48);
+    shstrndx = le16(f + 50);
+
+    if((phentsize < 32) || (shentsize < 40) || !inFile(b, phoff, phnum * phentsize) ||
+       !inFile(b, shoff, shnum * shentsize) || (shstrndx >= shnum))
+    {
+        printf("[err]: %s has broken program or section headers\n",b->path);
+        return -1;
+    }
+
+    /* The flash contents, from the segments at their load addresses */
+    image_init(&b->img);
+    for(i=0;i<phnum;i++)
+    {
+        ph = f + phoff + i * phentsize;
+        off = le32(ph + 4);
+        addr = le32(ph + 12);
+        size = le32(ph + 16);
+
+        if((le32(ph) != ELF_PT_LOAD) || (size == 0))
+            continue;
+
+        if(!inFile(b, off, size) || (addr > IMAGE_SIZE) || (size > (IMAGE_SIZE - addr)))
+        {
+            printf("[err]: %s has a segment outside the flash at 0x%X\n",b->path,addr);
+            return -1;
+        }
+
+        memcpy(b->img.data + addr, f + off, size);
+        if(b->img.startAddress > (int)addr)
+            b->img.startAddress = addr;
+        if(b->img.endAddress < (int)(addr + size))
+            b->img.endAddress = addr + size;
+    }
+
+    /* Where every section which has flash contents ends up */
+    sh = f + shoff + shstrndx * shentsize;
+    if(!inFile(b, le32(sh + 16), le32(sh + 20)))
+        return -1;
+    strings = (const char*)f + le32(sh + 16);
+
+    lma = malloc(shnum * sizeof(long));
+    b->sections = calloc(shnum + 1, sizeof(symbol_t));
+    for(i=0;i<shnum;i++)
+    {
+        sh = f + shoff + i * shentsize;
+        off = le32(sh + 16);
+        size = le32(sh + 20);
+        lma[i] = -1;
+
+        if(!(le32(sh + 8) & ELF_SHF_ALLOC) || (le32(sh + 4) == ELF_SHT_NOBITS) || (size == 0))
+            continue;
+
+        for(k=0;k<phnum;k++)
+        {
+            ph = f + phoff + k * phentsize;
+            if((le32(ph) == ELF_PT_LOAD) && (off >= le32(ph + 4)) && ((off - le32(ph + 4)) < le32(ph + 16)))
+                lma[i] = le32(ph + 12) + off - le32(ph + 4);
+        }
+
+        if(lma[i] < 0)
+            continue;
+
+        b->sections[b->sectionCount].name = strings + le32(sh);
+        b->sections[b->sectionCount].addr = lma[i];
+        b->sections[b->sectionCount].size = size;
+        b->sectionCount++;
+    }
+
+    /* Functions and objects inside those sections */
+    for(i=0;i<shnum;i++)
+    {
+        sh = f + shoff + i * shentsize;
+        if(le32(sh + 4) != ELF_SHT_SYMTAB)
+            continue;
+
+        off = le32(sh + 16);
+        size = le32(sh + 20);
+        k = le32(sh + 24);
+        if(!inFile(b, off, size) || (k >= shnum) ||
+           !inFile(b, le32(f + shoff + k * shentsize + 16), le32(f + shoff + k * shentsize + 20)))
+        {
+            break;
+        }
+        strings = (const char*)f + le32(f + shoff + k * shentsize + 16);
+
+        b->symbols = calloc(size / 16 + 1, sizeof(symbol_t));
+        for(sym=f+off;sym+16<=f+off+size;sym+=16)
+        {
+            uint32_t type = sym[12] & 0x0F;
+            uint32_t index = le16(sym + 14);
+            symbol_t* s = &b->symbols[b->symbolCount];
+
+            if(((type != ELF_STT_FUNC) && (type != ELF_STT_OBJECT)) || (le32(sym + 8) == 0) ||
+               (index >= shnum) || (lma[index] < 0))
+            {
+                continue;
+            }
+
+            sh = f + shoff + index * shentsize;
+            s->name = strings + le32(sym);
+            s->addr = lma[index] + le32(sym + 4) - le32(sh + 12);
+            s->size = le32(sym + 8);
+            s->isFunc = (type == ELF_STT_FUNC);
+            b->symbolCount++;
+        }
+        break;
+    }
+
+    qsort(b->sections, b->sectionCount, sizeof(symbol_t), byAddress);
+    if(b->symbolCount > 0)
+        qsort(b->symbols, b->symbolCount, sizeof(symbol_t), byAddress);
+
+    for(i=0;i<(uint32_t)b->symbolCount;i++)
+    {
+        symbol_t* s = &b->symbols[i];
+
+        for(k=0;k<(uint32_t)b->sectionCount;k++)
+        {
+            if((s->addr >= b->sections[k].addr) && (s->addr < (b->sections[k].addr + b->sections[k].size)))
+                s->section = k;
+        }
+    }
+
+    free(lma);
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int loadBuild(build_t* b, const char* path)
+{
+    FILE* in;
+
+    b->path = path;
+    if((in = fopen(path, "rb")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    b->fileSize = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    b->file = malloc(b->fileSize > 0 ? b->fileSize : 1);
+    if((b->fileSize > 0) && (fread(b->file, 1, b->fileSize, in) != (size_t)b->fileSize))
+    {
+        perror(path);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+
+    if((b->fileSize >= 4) && (memcmp(b->file, "\x7F" "ELF", 4) == 0))
+    {
+        b->isElf = 1;
+        return loadElf(b);
+    }
+
+    if(image_load_hex(&b->img, path) == 0)
+    {
+        printf("[err]: %s is neither an ELF nor an Intel HEX file\n",path);
+        return -1;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static const symbol_t* findSymbol(const build_t* b, const char* name, int isFunc)
+{
+    int i;
+
+    for(i=0;i<b->symbolCount;i++)
+    {
+        if((b->symbols[i].isFunc == isFunc) && (strcmp(b->symbols[i].name, name) == 0))
+            return &b->symbols[i];
+    }
+
+    return NULL;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* 1 if a symbol of the new build has the same size and bytes in the old one, wherever it is */
+static int unchanged(const symbol_t* s, const symbol_t* was)
+{
+    return (was != NULL) && (was->size == s->size) &&
+           (memcmp(builds[0].img.data + was->addr, builds[1].img.data + s->addr, s->size) == 0);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* What happened to a symbol of the new build, NULL if nothing did */
+static const char* describe(const symbol_t* s, char* buf, int len)
+{
+    const symbol_t* was;
+
+    if(!builds[0].isElf)
+        return "";
+
+    if((was = findSymbol(&builds[0], s->name, s->isFunc)) == NULL)
+        return "new";
+
+    if(was->size != s->size)
+    {
+        snprintf(buf, len, "%s by %d", (s->size > was->size) ? "grew" : "shrank",
+                 abs((int)s->size - (int)was->size));
+        return buf;
+    }
+
+    if(was->addr != s->addr)
+    {
+        snprintf(buf, len, "moved by %+d%s", (int)s->addr - (int)was->addr, unchanged(s, was) ? "" : ", changed");
+        return buf;
+    }
+
+    return unchanged(s, was) ? NULL : "changed";
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int differs(uint32_t addr)
+{
+    return builds[0].img.data[addr] != builds[1].img.data[addr];
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* 1 if any byte of [start,end) differs between the builds */
+static int anyDiffers(uint32_t start, uint32_t end)
+{
+    for(;start<end;start++)
+    {
+        if(differs(start))
+            return 1;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Where the old build had the contents of a new page, -1 if nowhere */
+static int movedFrom(int page, int end)
+{
+    const uint8_t* now = builds[1].img.data + page * PAGE_SIZE;
+    int i;
+
+    for(i=0;i+PAGE_SIZE<=end;i++)
+    {
+        if(memcmp(builds[0].img.data + i, now, PAGE_SIZE) == 0)
+            return i;
+    }
+
+    return -1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void printPage(int page, int end)
+{
+    const build_t* b = &builds[1];
+    uint32_t start = page * PAGE_SIZE;
+    uint32_t stop = start + PAGE_SIZE;
+    uint32_t from;
+    uint32_t to;
+    int count = 0;
+    int was = movedFrom(page, end);
+    int i;
+    int k;
+    int shown;
+    uint32_t a;
+    char buf[64];
+    const char* what;
+
+    for(a=start;a<stop;a++)
+        count += differs(a);
+
+    if(was >= 0)
+        printf("> Page %d at 0x%04X: %d bytes differ, the old build had it at 0x%04X\n",page,start,count,was);
+    else
+        printf("> Page %d at 0x%04X: %d bytes differ\n",page,start,count);
+
+    for(i=0;i<b->sectionCount;i++)
+    {
+        from = (b->sections[i].addr > start) ? b->sections[i].addr : start;
+        to = ((b->sections[i].addr + b->sections[i].size) < stop) ? (b->sections[i].addr + b->sections[i].size) : stop;
+        if((from >= to) || !anyDiffers(from, to))
+            continue;
+
+        printf(">     %s:",b->sections[i].name);
+        shown = 0;
+        for(k=0;k<b->symbolCount;k++)
+        {
+            const symbol_t* s = &b->symbols[k];
+
+            if((s->section != i) || (s->addr >= to) || ((s->addr + s->size) <= from))
+                continue;
+
+            if(!verbose && !anyDiffers((s->addr > from) ? s->addr : from,
+                                       ((s->addr + s->size) < to) ? (s->addr + s->size) : to))
+            {
+                continue;
+            }
+
+            what = describe(s, buf, sizeof(buf));
+
+            if((what == NULL) || (what[0] == '\0'))
+                printf("%s %s",shown ? "," : "",s->name);
+            else
+                printf("%s %s (%s)",shown ? "," : "",s->name,what);
+            shown++;
+        }
+        printf("%s\n",shown ? "" : " no symbols");
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* What grew, shrank, appeared or went away, in the order of the new build */
+static void printChanges(void)
+{
+    const symbol_t* s;
+    const symbol_t* was;
+    int i;
+    int moved = 0;
+    int movedBytes = 0;
+    char buf[64];
+
+    for(i=0;i<builds[1].symbolCount;i++)
+    {
+        s = &builds[1].symbols[i];
+        was = findSymbol(&builds[0], s->name, s->isFunc);
+
+        if(was == NULL)
+        {
+            printf("> 0x%04X %s is new, %u bytes\n",s->addr,s->name,s->size);
+        }
+        else if(was->size != s->size)
+        {
+            printf("> 0x%04X %s %s\n",s->addr,s->name,describe(s, buf, sizeof(buf)));
+        }
+        else if((was->addr != s->addr) && unchanged(s, was))
+        {
+            moved++;
+            movedBytes += s->size;
+        }
+    }
+
+    for(i=0;i<builds[0].symbolCount;i++)
+    {
+        s = &builds[0].symbols[i];
+        if(findSymbol(&builds[1], s->name, s->isFunc) == NULL)
+            printf("> 0x%04X %s went away, %u bytes\n",s->addr,s->name,s->size);
+    }
+
+    if(moved > 0)
+        printf("> %d symbols moved without changing, %d bytes\n",moved,movedBytes);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Size of a .text.<function> section in the new build, 0 if it isn't known */
+static uint32_t sectionSize(const char* section)
+{
+    const symbol_t* s;
+
+    if(strncmp(section, ".text.", 6) != 0)
+        return 0;
+
+    s = findSymbol(&builds[1], section + 6, 1);
+
+    return (s != NULL) ? s->size : 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int isPinned(const char* section)
+{
+    int i;
+
+    for(i=0;i<pinnedCount;i++)
+    {
+        if(strcmp(pinned[i], section) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int writeFragment(const char* path, int keepUnchanged)
+{
+    FILE* out = stdout;
+    const symbol_t* s;
+    char section[256];
+    uint32_t size;
+    int pages = 0;
+    int padding = 0;
+    int block = 0;
+    int blockSize = 0;
+    int i;
+
+    if((path != NULL) && ((out = fopen(path, "w")) == NULL))
+    {
+        perror(path);
+        return -1;
+    }
+
+    fprintf(out, "    /* Written by layout from %s and %s. Keeps the code below on pages of its own,\n"
+                 "       in the .text output section right after KEEP(*(.vectors)). */\n",
+            builds[0].path, builds[1].path);
+
+    for(i=0;i<pinnedCount;i++)
+    {
+        size = sectionSize(pinned[i]);
+        fprintf(out, "    . = ALIGN(%d);\n    *(%s)\n",PAGE_SIZE,pinned[i]);
+        pages += (size + PAGE_SIZE - 1) / PAGE_SIZE;
+        padding += (PAGE_SIZE - size % PAGE_SIZE) % PAGE_SIZE;
+    }
+
+    /* Library and startup code doesn't come in sections named after its functions */
+    for(i=0;keepUnchanged&&(i<builds[1].symbolCount);i++)
+    {
+        s = &builds[1].symbols[i];
+        snprintf(section, sizeof(section), ".text.%s", s->name);
+
+        if(!s->isFunc || (strncmp(s->name, "__", 2) == 0) || isPinned(section) ||
+           !unchanged(s, findSymbol(&builds[0], s->name, 1)))
+        {
+            continue;
+        }
+
+        if(block == 0)
+            fprintf(out, "    . = ALIGN(%d);\n",PAGE_SIZE);
+        fprintf(out, "    *(%s)\n",section);
+        block++;
+        blockSize += s->size;
+    }
+
+    pages += (blockSize + PAGE_SIZE - 1) / PAGE_SIZE;
+    padding += (PAGE_SIZE - blockSize % PAGE_SIZE) % PAGE_SIZE;
+    fprintf(out, "    . = ALIGN(%d);\n",PAGE_SIZE);
+
+    if(out != stdout)
+        fclose(out);
+
+    printf("> Fragment: %d sections on pages of their own, %d unchanged functions in one block, "
+           "%d pages with %d bytes of padding\n",pinnedCount,block,pages,padding);
+    if(path != NULL)
+        printf("> Fragment written to %s\n",path);
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    int c;
+    int page;
+    int pages;
+    int end;
+    int changed = 0;
+    int keepUnchanged = 0;
+    char* list;
+    char* name;
+    const char* fragment = NULL;
+
+    while((c = getopt(argc, argv, "s:al:v")) != -1)
+    {
+        switch(c)
+        {
+            case 's':
+            {
+                list = strdup(optarg);
+                for(name=strtok(list, ",");(name != NULL) && (pinnedCount < MAX_PINNED);name=strtok(NULL, ","))
+                    pinned[pinnedCount++] = name;
+                break;
+            }
+            case 'a': keepUnchanged = 1; break;
+            case 'l': fragment = optarg; break;
+            case 'v': verbose = 1; break;
+            default:
+            {
+                printf("Usage: %s [-s <section,...>] [-a] [-l <fragment.ld>] [-v] <old.hex|old.elf> <new.hex|new.elf>\n",argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    if((optind + 2) != argc)
+    {
+        printf("Usage: %s [-s <section,...>] [-a] [-l <fragment.ld>] [-v] <old.hex|old.elf> <new.hex|new.elf>\n",argv[0]);
+        return 1;
+    }
+
+    if((loadBuild(&builds[0], argv[optind]) < 0) || (loadBuild(&builds[1], argv[optind + 1]) < 0))
+        return 1;
+
+    if(keepUnchanged && (!builds[0].isElf || !builds[1].isElf))
+    {
+        printf("[err]: -a needs both builds as ELF files\n");
+        return 1;
+    }
+
+    end = (builds[0].img.endAddress > builds[1].img.endAddress) ? builds[0].img.endAddress : builds[1].img.endAddress;
+    pages = (end + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    for(page=0;page<pages;page++)
+    {
+        if(!anyDiffers(page * PAGE_SIZE, (page + 1) * PAGE_SIZE))
+            continue;
+
+        printPage(page, end);
+        changed++;
+    }
+
+    printf("> %s: %d bytes, %s: %d bytes\n",builds[0].path,builds[0].img.endAddress,builds[1].path,builds[1].img.endAddress);
+    printf("> %d pages, %d changed, %d unchanged\n",pages,changed,pages - changed);
+
+    if(builds[0].isElf && builds[1].isElf)
+        printChanges();
+
+    if((pinnedCount > 0) || keepUnchanged || (fragment != NULL))
+        return (writeFragment(fragment, keepUnchanged) < 0) ? 1 : 0;
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,1150 @@
+/*-------------------------------------------------------------------------------------------------
+/ Bootloader session: connecting, resetting, talking to the device and uploading frames.
+/------------------------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include "serial_lib.h"
+#include "hexcache.h"
+#include "image.h"
+#include "patch.h"
+#include "delta.h"
+#include "crc.h"
+#include "loader.h"
+#include "log.h"
+#include "tune.h"
+/*-----------------------------------------------------------------------------------------------*/
+int verbose = 0;
+int useCache = 0;
+int flowControl = 0;
+int frameType = FRAME_WRITE;
+int pagesDone = 0;
+int pagesTotal = 0;
+int pagesConfirmed = 0;
+int baudRate = LINK_BAUD;
+int streamWindow = STREAM_WINDOW;
+int fwVersion = -1;
+hostStats_t hostStats;
+/*-----------------------------------------------------------------------------------------------*/
+/* Smoothed ACK round trip and its mean deviation, 0 until the first ACK came in */
+static int64_t srttUs = 0;
+static int64_t rttvarUs = 0;
+/* Filler bytes behind each streamed frame, 0 while the device throttles us with RTS/CTS */
+static int streamGap = 0;
+/*-----------------------------------------------------------------------------------------------*/
+/* Stop and wait upload, the next page goes out once the previous one is programmed. Behind a
+   serial server that would cost a network round trip per page, so frames are streamed there. */
+int uploadFrames(int fd, const tl_frame* frames, int count)
+{
+    int pageNumber;
+    const tl_frame* frame;
+
+    if(flowControl || (serialport_is_network(fd) && (count > 0) && (frame_type(&frames[0]) != FRAME_LEGACY)))
+    {
+        return streamFrames(fd, frames, count);
+    }
+
+    for(pageNumber=0;pageNumber<count;pageNumber++)
+    {        
+        frame = &frames[pageNumber];
+        trace_begin("page", frame->offset);
+
+        if(verbose)
+        {
+            log_printf("\n");
+            log_printf("[dbg]: Page number: %d\n",frame->offset / PAGE_SIZE);
+            log_printf("[dbg]: Page base address: %d\n",frame->offset);
+        }
+
+        showProgress();
+
+        if(verbose && (frame_type(frame) != FRAME_PATCH) && (frame_type(frame) != FRAME_DELTA))
+            dumpPage(frame_data(frame));
+
+        if(sendFrame(fd, frame) == 0)
+        {
+            return 0;
+        }
+
+        trace_end("page");
+        pagesDone++;
+        pagesConfirmed++;
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int sendFrame(int fd, const tl_frame* frame)
+{
+    int i;
+    int res;
+
+    if(frame_type(frame) != FRAME_LEGACY)
+    {
+        /* The device keeps up with a whole 'w', 'p' or 'e' frame, only programming needs to be waited for */
+        serialport_writebuf(fd,frame->bytes,frame->length);
+
+        for(i=0;i<frame_acks(frame);i++)
+        {
+            res = readACK(fd);
+            if (res > 0)
+            {
+                if(verbose)
+                    log_printf("[dbg]: ACK OK\n");
+            }
+            else if((res == ACK_VERIFY) && (i == frame_acks(frame) - 1))
+            {
+                if(frame_type(frame) == FRAME_DELTA)
+                    return sendFallback(fd, frame);
+
+                return reprogramPage(fd, frame->offset);
+            }
+            else
+            {
+                if(verbose)
+                    log_printf("[dbg]: ACK problem\n");
+                return 0;
+            }
+        }
+
+        return 1;
+    }
+
+    /* Fill the page buffer command */
+    serialport_writebyte(fd,frame->bytes[0]);
+
+    if (readACK(fd) > 0)
+    {
+        if(verbose)
+            log_printf("[dbg]: ACK OK\n");
+    }
+    else
+    {
+        if(verbose)
+            log_printf("[dbg]: ACK problem\n");
+        return 0;
+    }
+
+    serialport_writebuf(fd,frame_data(frame),PAGE_SIZE);
+
+    /* Write the page command */
+    serialport_writebyte(fd,frame->bytes[1 + PAGE_SIZE]);  
+
+    if (readACK(fd) > 0)
+    {
+        if(verbose)
+            log_printf("[dbg]: ACK OK\n");
+    }
+    else
+    {
+        if(verbose)
+           log_printf("[dbg]: ACK problem\n");
+        return 0;
+    }
+
+    /* Page address, little endian */
+    serialport_writebuf(fd,frame->bytes + 1 + PAGE_SIZE + 1,4);
+
+    res = readACK(fd);
+    if (res > 0)
+    {
+        if(verbose)
+            log_printf("[dbg]: ACK OK\n");
+    }
+    else if(res == ACK_VERIFY)
+    {
+        return reprogramPage(fd, frame->offset);
+    }
+    else
+    {
+        if(verbose)
+            log_printf("[dbg]: ACK problem\n");
+        return 0;
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* The page buffer of the device still holds a page which failed verification, whichever frame
+   brought it there. 'c' programs it again without sending the data once more. */
+int reprogramPage(int fd, uint32_t offset)
+{
+    int i;
+    int res;
+    uint8_t address[4];
+
+    address[0] = (offset >> 0) & 0xFF;
+    address[1] = (offset >> 8) & 0xFF;
+    address[2] = (offset >> 16) & 0xFF;
+    address[3] = (offset >> 24) & 0xFF;
+
+    for(i=0;i<VERIFY_RETRIES;i++)
+    {
+        log_printf("> Page %d didn't verify, programming it again\n",offset / PAGE_SIZE);
+        hostStats.verifyRetries++;
+
+        serialport_writebyte(fd,'c');
+        if(readACK(fd) < 0)
+        {
+            return 0;
+        }
+
+        serialport_writebuf(fd,address,4);
+        res = readACK(fd);
+        if(res > 0)
+        {
+            return 1;
+        }
+        else if(res != ACK_VERIFY)
+        {
+            return 0;
+        }
+    }
+
+    log_printf("[err]: Page %d still doesn't verify after %d attempts\n",offset / PAGE_SIZE,VERIFY_RETRIES);
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* A delta page the device couldn't rebuild, its flash wasn't what we thought or its sources have
+   been written over since. The whole page doesn't depend on either. */
+int sendFallback(int fd, const tl_frame* frame)
+{
+    tl_frame full;
+
+    log_printf("> Page %d didn't rebuild on the device, sending all of it\n",frame->offset / PAGE_SIZE);
+    hostStats.verifyRetries++;
+
+    delta_fallback_frame(frame, &full);
+    return sendFrame(fd, &full);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Only pages the device confirms to hold are copied from, the 'k' CRCs are cheap next to what a
+   wrong guess costs */
+static void buildDelta(int fd, const tl_image* base, tl_image* img)
+{
+    int page;
+    int pages = delta_page_count(base, img);
+    uint16_t crcs[IMAGE_PAGES];
+    const uint16_t* deviceCrcs = crcs;
+    delta_stats_t st;
+
+    trace_begin("crc", pages);
+    for(page=0;page<pages;page+=PAGE_CRC_CHUNK)
+    {
+        if(readPageCrcs(fd, page, (pages - page < PAGE_CRC_CHUNK) ? (pages - page) : PAGE_CRC_CHUNK, crcs + page) == 0)
+        {
+            log_printf("[err]: No page CRCs from the device, going by the old image alone\n");
+            deviceCrcs = NULL;
+            break;
+        }
+    }
+    trace_end("crc");
+
+    delta_build_frames(base, deviceCrcs, img, &st);
+
+    log_printf("> Delta upload: %d pages unchanged, %d rebuilt from flash (%d bytes, %d%c copied), %d rewritten\n",
+        st.unchanged, st.rebuilt, st.rebuiltBytes,
+        (st.rebuilt > 0) ? (100 * st.copiedBytes) / (st.rebuilt * PAGE_SIZE) : 0, '%', st.rewritten);
+
+    if(st.unknown > 0)
+        log_printf("> Delta upload: %d pages didn't hold the old image\n",st.unknown);
+    if(st.cycles > 0)
+        log_printf("> Delta upload: %d pages encoded without copies to break cycles\n",st.cycles);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void buildPatch(int fd, const tl_image* base, tl_image* img)
+{
+    patch_stats_t st;
+
+    if(fwVersion >= DELTA_VERSION)
+    {
+        buildDelta(fd, base, img);
+        return;
+    }
+
+    patch_build_frames(base, img, &st);
+
+    log_printf("> Incremental upload: %d pages unchanged, %d patched (%d bytes), %d rewritten, %d erased\n",
+        st.unchanged, st.patched, st.patchBytes, st.rewritten, st.erased);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void dumpPage(const uint8_t* data)
+{
+    int i;
+    int n = 0;
+    char line[LOG_LINE];
+
+    /* One log line per row, so a dump can't be interleaved with other output */
+    for(i=0;i<PAGE_SIZE;i++)
+    {
+        n += snprintf(line + n, sizeof(line) - n, "%s[%3d] %2X   ",(n == 0) ? "    " : "",i,data[i]);
+        if((i%8)==7)
+        {
+            log_printf("%s\n",line);
+            n = 0;
+        }
+    }
+    log_printf("\n");
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* With RTS/CTS the device throttles us while it is busy programming, so frames are written back
+   to back and ACKs are collected behind them. streamWindow bounds how far behind they can get.
+   Without it every frame is followed by STREAM_FILL bytes the bootloader skips, long enough to
+   cover programming the page. Older bootloaders drop them as unknown commands and overrun on
+   them while programming, printStats() accounts for that. The frames are timed by the line that
+   way, whenever the bytes get to the UART. */
+int streamFrames(int fd, const tl_frame* frames, int count)
+{
+    int i;
+    int n;
+    int res;
+    int sent = 0;
+    int pending = 0;
+    int acked = 0;
+    int ackLeft = (count > 0) ? frame_acks(&frames[0]) : 0;
+    int failedCount = 0;
+    static int failed[IMAGE_PAGES];
+    uint8_t filler[256];
+
+    streamGap = flowControl ? 0 : streamGapBytes();
+    memset(filler, STREAM_FILL, sizeof(filler));
+
+    while((sent < count) || (pending > 0))
+    {
+        if((sent < count) && (pending < (streamWindow * frame_acks(&frames[sent]))))
+        {
+            if(verbose)
+                log_printf("[dbg]: Streaming page %d\n",frames[sent].offset / PAGE_SIZE);
+            showProgress();
+
+            trace_begin("send", frames[sent].offset);
+            if(serialport_writebuf(fd, frames[sent].bytes, frames[sent].length) < 0)
+            {
+                log_printf("[err]: Write problem\n");
+                return 0;
+            }
+            for(i=0;i<streamGap;i+=n)
+            {
+                n = ((streamGap - i) < (int)sizeof(filler)) ? (streamGap - i) : (int)sizeof(filler);
+                if(serialport_writebuf(fd, filler, n) < 0)
+                {
+                    log_printf("[err]: Write problem\n");
+                    return 0;
+                }
+                hostStats.fillerBytes += n;
+            }
+            trace_end("send");
+            sent++;
+            pagesDone++;
+            pending += frame_acks(&frames[sent - 1]);
+            continue;
+        }
+
+        /* ACKs come in frame order, the last one of a frame is the verify result */
+        res = readACK(fd);
+        if((res == ACK_VERIFY) && (ackLeft == 1) && (failedCount < IMAGE_PAGES))
+        {
+            failed[failedCount++] = acked;
+        }
+        else if(res < 0)
+        {
+            if(verbose)
+                log_printf("[dbg]: ACK problem, %d ACKs missing\n",pending);
+            return 0;
+        }
+        pending--;
+
+        if(--ackLeft == 0)
+        {
+            pagesConfirmed++;
+            if(++acked < count)
+                ackLeft = frame_acks(&frames[acked]);
+        }
+    }
+
+    /* Later frames have overwritten the page buffer by now, so the whole frame goes again. A
+       patch builds on the page in flash, which is what failed, it can't be repaired this way. A
+       delta page goes out whole, its sources may be gone. */
+    for(i=0;i<failedCount;i++)
+    {
+        if(frame_type(&frames[failed[i]]) == FRAME_DELTA)
+        {
+            if(sendFallback(fd, &frames[failed[i]]) == 0)
+                return 0;
+            continue;
+        }
+
+        if(frame_type(&frames[failed[i]]) == FRAME_PATCH)
+        {
+            log_printf("[err]: Page %d didn't verify, run again without -o\n",frames[failed[i]].offset / PAGE_SIZE);
+            return 0;
+        }
+
+        log_printf("> Page %d didn't verify, sending it again\n",frames[failed[i]].offset / PAGE_SIZE);
+        hostStats.verifyRetries++;
+        if(sendFrame(fd, &frames[failed[i]]) == 0)
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int streamGapBytes(void)
+{
+    /* At 10 bits per byte, plus what the receive FIFO holds once programming is done */
+    return (PAGE_BUSY_MS + STREAM_GAP_MARGIN_MS) * baudRate / 10000 + 2;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void coverNetworkLatency(int fd)
+{
+    int window;
+    double rtt;
+    double slotMs;
+
+    if(!serialport_is_network(fd))
+        return;
+
+    rtt = measureAckRtt(fd, NET_RTT_PINGS);
+    if(rtt < 0)
+    {
+        log_printf("> Network port: no answer to the pings, %d frames in flight\n",streamWindow);
+        return;
+    }
+
+    /* A frame takes up the line for its own bytes and, without RTS/CTS, the filler behind it */
+    slotMs = (FRAME_SIZE + (flowControl ? 0 : streamGapBytes())) * 10 * 1000.0 / baudRate;
+    window = (int)(rtt / slotMs) + 2;
+    if(window > NET_MAX_WINDOW)
+        window = NET_MAX_WINDOW;
+    if(window > streamWindow)
+        streamWindow = window;
+
+    log_printf("> Network port: ACK round trip %.1f ms, %d frames in flight\n",rtt,streamWindow);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void showProgress(void)
+{
+    /* Total is unknown while the image is still being parsed */
+    if(pagesTotal == 0)
+    {
+        if(verbose)
+            log_progress("[dbg]: Uploading: page %d\n",pagesDone);
+        else
+            log_progress("> Uploading: page %d\r",pagesDone);
+    }
+    else
+    {
+        if(verbose)
+            log_progress("[dbg]: Uploading: %c%d\n",'%',((100 * pagesDone) / pagesTotal));
+        else
+            log_progress("> Uploading: %c%d\r",'%',((100 * pagesDone) / pagesTotal));
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+int loadImage(char* path, tl_image* img)
+{
+    const char* cacheDir = useCache ? hexcache_default_dir() : NULL;
+    tl_cache_key key;
+
+    if(hexcache_load(cacheDir, path, img))
+    {
+        if(verbose)
+            log_printf("[dbg]: Using cached image for %s\n",path);
+        return 1;
+    }
+
+    /* Keyed by the file as it was before parsing, a rebuild meanwhile must not be cached */
+    if((cacheDir != NULL) && ((strcmp(path, "-") == 0) || (hexcache_key(path, &key) < 0)))
+        cacheDir = NULL;
+
+    if(image_load_hex(img, path) == 0)
+    {
+        return 0;
+    }
+
+    if(cacheDir != NULL)
+    {
+        if(hexcache_store(cacheDir, path, &key, img) == 0)
+            log_printf("> Couldn't write the image cache in %s\n",cacheDir);
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int connectDevice(char* path)
+{
+    int fd = -1;    
+
+    fd = serialport_init(path,baudRate,'n');
+
+    if(fd < 0)
+    {
+        log_printf("[err]: Connection error.\n");
+        return -1;
+    }
+    else
+    {
+        
+        log_printf("> Conection OK\n");
+        return fd;
+    }       
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Pulses RTS and DTR, boards wired for auto reset come up in the bootloader. A serial server
+   passes the pulses on with RFC 2217, a raw TCP port can't. */
+int resetDevice(int fd)
+{
+    if(serialport_set_rts(fd,1) < 0)
+    {
+        log_printf("> The port has no modem lines, the board isn't reset\n");
+        return 0;
+    }
+    serialport_set_rts(fd,0); serialport_set_rts(fd,1);
+    serialport_set_dtr(fd,1); serialport_set_dtr(fd,0); serialport_set_dtr(fd,1);
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Sends cmd to the running application, which resets into the bootloader with the magic from
+   firmware/tealoader_app.h. The bootloader says 'Y' as soon as it is up, a ping makes sure it
+   wasn't the application talking. Returns 1 once the bootloader is listening. */
+int enterFromApp(int fd, const char* cmd)
+{
+    int n = 0;
+    char msg;
+    char buf[128];
+    int64_t left;
+    uint64_t deadline;
+
+    /* C style escapes, a shell won't pass a newline easily */
+    while((*cmd != 0) && (n < (int)sizeof(buf)))
+    {
+        if((cmd[0] == '\\') && (cmd[1] != 0))
+        {
+            cmd++;
+            buf[n++] = (*cmd == 'n') ? '\n' : (*cmd == 'r') ? '\r' : *cmd;
+        }
+        else
+        {
+            buf[n++] = *cmd;
+        }
+        cmd++;
+    }
+
+    trace_begin("app_entry", n);
+
+    serialport_discard(fd);
+    serialport_writebuf(fd, (uint8_t*)buf, n);
+
+    deadline = nowNs() + APP_ENTRY_TIMEOUT_MS * 1000000ULL;
+    while((left = ((int64_t)(deadline - nowNs())) / 1000000) > 0)
+    {
+        if(readRawBytes(fd, &msg, 1, left) < 0)
+            break;
+
+        /* Application output may hold a 'Y' too, only a bootloader answers the ping after it. Stale
+           ping answers are drained before the session starts */
+        if((msg == 'Y') && (measureAckRtt(fd, 1) >= 0))
+        {
+            while(readRawBytes(fd, &msg, 1, 20) >= 0)
+                ;
+            if(measureAckRtt(fd, 1) >= 0)
+            {
+                trace_end("app_entry");
+                return 1;
+            }
+        }
+    }
+
+    trace_end("app_entry");
+    log_printf("> The application didn't hand over, resetting the board\n");
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int eraseDevice(int fd)
+{
+    int err;
+
+    log_printf("> Erasing the memory ...\n");
+    trace_begin("erase", 0);
+    serialport_writebyte(fd,'d');
+    err = readACKWithin(fd, ERASE_TIMEOUT_MS);
+    trace_end("erase");
+    if (err > 0)
+    {
+        if(verbose)
+            log_printf("[dbg]: ACK OK\n");
+        return 1;
+    }
+    else
+    {
+        if(verbose)
+            log_printf("[dbg]: ACK problem\n");
+        return 0;
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+int ackTimeoutMs(void)
+{
+    int64_t rto;
+    int64_t floorMs;
+
+    if(srttUs == 0)
+        return ACK_RTO_INIT_MS;
+
+    /* At 10 bits per byte, a full window may be ahead of the ACK on the wire */
+    floorMs = ACK_RTO_MIN_MS + (int64_t)streamWindow * (FRAME_SIZE + streamGap) * 10 * 1000 / baudRate;
+    rto = (srttUs + 4 * rttvarUs) / 1000;
+
+    if(rto < floorMs)
+        rto = floorMs;
+    if(rto > ACK_RTO_MAX_MS)
+        rto = ACK_RTO_MAX_MS;
+
+    return rto;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int getVersion(fd)
+{
+    char msg;
+
+    serialport_writebyte(fd,'v');
+
+    /* Read the response */
+    if(readRawBytes(fd,&msg,1,10000) < 0)
+    {
+        /* Timeout or read problem */
+        return -1;
+    }
+
+    return msg;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Jacobson/Karels, a lost ACK doubles the deviation so the next wait backs off */
+static void updateRto(int res, uint64_t ns)
+{
+    int64_t err;
+    int64_t us = ns / 1000;
+
+    if(res == -1)
+    {
+        if(srttUs > 0)
+            rttvarUs = (rttvarUs > 0) ? (2 * rttvarUs) : (srttUs / 2);
+    }
+    else if(srttUs == 0)
+    {
+        srttUs = us;
+        rttvarUs = us / 2;
+    }
+    else
+    {
+        err = us - srttUs;
+        srttUs += err / 8;
+        rttvarUs += ((err < 0) ? -err : err) / 4 - rttvarUs / 4;
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Waits as long as the measured round trip says, the erase and other slow commands use
+   readACKWithin() so they don't skew the estimate */
+int readACK(int fd)
+{
+    int res;
+    uint64_t t = nowNs();
+
+    res = readACKWithin(fd, ackTimeoutMs());
+    updateRto(res, nowNs() - t);
+
+    return res;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int readACKWithin(int fd, int timeoutMs)
+{
+    int res;
+    char msg;
+    uint64_t t;
+
+    /* Read the response */
+    trace_begin("ack", 0);
+    t = nowNs();
+    res = readRawBytes(fd,&msg,1,timeoutMs);
+    t = nowNs() - t;
+    trace_end("ack");
+
+    hostStats.ackCount++;
+    hostStats.ackWaitNs += t;
+    if(t > hostStats.ackMaxNs)
+        hostStats.ackMaxNs = t;
+
+    if(res < 0)
+    {
+        /* Timeout or read problem */
+        return -1;
+    }
+
+    if(msg == 'Y')
+    {
+        /* Return OK */
+        return 1;
+    }
+    else if(msg == 'V')
+    {
+        /* Programmed, but didn't read back right */
+        return ACK_VERIFY;
+    }
+    else
+    {
+        /* Wrong response ... */
+        return -1;
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* An answer from behind a serial server takes a network round trip longer */
+static int pingTimeoutMs(int fd)
+{
+    return serialport_is_network(fd) ? NET_PING_TIMEOUT_MS : PING_TIMEOUT_MS;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int sendPing(int fd)
+{    
+    char msg;
+    uint8_t cnt = 10;
+    int res = -1;
+
+    trace_begin("ping", cnt);
+
+    /* The last of the pings decides, the first ones may go while the board is still resetting */
+    while(cnt--)
+    {
+        /* Send ping message */
+        serialport_writebyte(fd,'a');
+
+         /* Read the response */
+        if(readRawBytes(fd,&msg,1,pingTimeoutMs(fd)) < 0)
+        {
+            /* Timeout or read problem, an earlier 'Y' doesn't count */
+            res = -1;
+        }
+        else if(msg == 'Y')
+        {
+            /* Return OK */
+            res = 1;
+        }
+        else
+        {
+            /* Wrong response ... */
+            res = -1;
+        }
+    }
+
+    trace_end("ping");
+
+    return res;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Single ping, each command the bootloader receives restarts its watchdog */
+int keepAlive(int fd)
+{
+    char msg = 0;
+
+    serialport_writebyte(fd,'a');
+
+    if(readRawBytes(fd,&msg,1,pingTimeoutMs(fd)) < 0)
+    {
+        return 0;
+    }
+
+    return (msg == 'Y');
+}
+/*-----------------------------------------------------------------------------------------------*/
+int getDeviceStats(int fd, deviceStats_t* st)
+{
+    uint8_t b[DEVICE_STATS_SIZE + 2];
+    int size = (fwVersion >= VERIFY_VERSION) ? DEVICE_STATS_SIZE + 2 : DEVICE_STATS_SIZE;
+
+    serialport_writebyte(fd,'s');
+
+    if(readRawBytes(fd,(char*)b,size,1000) < 0)
+    {
+        /* Timeout or read problem */
+        return -1;
+    }
+
+    /* Little endian, packed */
+    st->rxBytes     = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+    st->pages       = b[4] | (b[5] << 8);
+    st->spmOps      = b[6] | (b[7] << 8);
+    st->spmTicks    = b[8] | (b[9] << 8) | (b[10] << 16) | ((uint32_t)b[11] << 24);
+    st->spmMaxTicks = b[12] | (b[13] << 8);
+    st->overruns    = b[14] | (b[15] << 8);
+    st->frameErrors = b[16] | (b[17] << 8);
+    st->dropped     = b[18] | (b[19] << 8);
+    st->tickHz      = b[20] | (b[21] << 8) | (b[22] << 16) | ((uint32_t)b[23] << 24);
+    st->verifyErrors = (size > DEVICE_STATS_SIZE) ? (b[24] | (b[25] << 8)) : 0;
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void printStats(int fd)
+{
+    deviceStats_t st;
+    double tickMs;
+    double seconds = hostStats.uploadNs / 1e9;
+
+    log_printf("> Host: %u bytes sent, %u bytes received, upload took %.3f s (%.1f bytes/s)\n",
+        serialport_stats.txBytes, serialport_stats.rxBytes, seconds,
+        (seconds > 0) ? serialport_stats.txBytes / seconds : 0.0);
+
+    if(hostStats.ackCount > 0)
+    {
+        log_printf("> Host: %u ACKs, average wait %.3f ms, max %.3f ms\n",
+            hostStats.ackCount, hostStats.ackWaitNs / 1e6 / hostStats.ackCount, hostStats.ackMaxNs / 1e6);
+    }
+
+    if(hostStats.verifyRetries > 0)
+    {
+        log_printf("> Host: %u pages sent again after failing verification\n",hostStats.verifyRetries);
+    }
+
+    if(hostStats.resumes > 0)
+    {
+        log_printf("> Host: upload picked up again %u times, ACK timeout now %d ms\n",hostStats.resumes,ackTimeoutMs());
+    }
+
+    if(fwVersion < DEVICE_STATS_VERSION)
+    {
+        log_printf("> Device: statistics need firmware version %d or newer\n",DEVICE_STATS_VERSION);
+        return;
+    }
+
+    if((getDeviceStats(fd, &st) < 0) || (st.tickHz == 0))
+    {
+        log_printf("> Device: couldn't read the statistics\n");
+        return;
+    }
+
+    tickMs = 1000.0 / st.tickHz;
+
+    /* Older bootloaders count the filler behind streamed frames. What they read is dropped, what
+       came in while a page was programmed overran the UART. Newer ones read it off meanwhile. */
+    if((hostStats.fillerBytes > 0) && (fwVersion < STREAM_FILL_VERSION))
+    {
+        st.dropped = (st.dropped > hostStats.fillerBytes) ? st.dropped - hostStats.fillerBytes : 0;
+        log_printf("> Device: %u filler bytes were streamed without flow control, they are left out of the dropped bytes\n",
+            hostStats.fillerBytes);
+        log_printf("> Device: overruns are expected this way, firmware version %d and newer doesn't overrun on filler\n",
+            STREAM_FILL_VERSION);
+    }
+
+    log_printf("> Device: %u bytes received, %u pages programmed, %u overruns, %u framing errors, %u dropped\n",
+        st.rxBytes, st.pages, st.overruns, st.frameErrors, st.dropped);
+
+    if(fwVersion >= VERIFY_VERSION)
+    {
+        log_printf("> Device: %u pages failed verification\n",st.verifyErrors);
+    }
+
+    if(st.spmOps > 0)
+    {
+        log_printf("> Device: SPM busy %.3f ms in %u operations, average %.3f ms, max %.3f ms\n",
+            st.spmTicks * tickMs, st.spmOps, (st.spmTicks * tickMs) / st.spmOps, st.spmMaxTicks * tickMs);
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/*-----------------------------------------------------------------------------------------------*/
+double measureAckRtt(int fd, int count)
+{
+    int i;
+    char msg;
+    uint64_t t0 = nowNs();
+
+    for(i=0;i<count;i++)
+    {
+        serialport_writebyte(fd,'a');
+
+        if((readRawBytes(fd,&msg,1,pingTimeoutMs(fd)) < 0) || (msg != 'Y'))
+        {
+            return -1.0;
+        }
+    }
+
+    return (nowNs() - t0) / 1e6 / count;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void tuneLatency(int fd)
+{
+    int applied;
+    double before;
+    double after;
+
+    before = measureAckRtt(fd, 20);
+    applied = serialport_set_lowlatency(fd);
+    after = measureAckRtt(fd, 20);
+
+    if(applied == 0)
+    {
+        log_printf("> Low latency: the driver has no settings for it, ACK round trip %.3f ms\n",before);
+        return;
+    }
+
+    if(serialport_latency_timer() > 0)
+        log_printf("> Low latency: latency_timer %d -> 1 ms\n",serialport_latency_timer());
+    else if(verbose && (applied & SERIAL_LOWLAT_TIMER))
+        log_printf("[dbg]: latency_timer was 1 ms already\n");
+
+    if(verbose && (applied & SERIAL_LOWLAT_ASYNC))
+        log_printf("[dbg]: ASYNC_LOW_LATENCY is set\n");
+
+    log_printf("> Low latency: ACK round trip %.3f ms -> %.3f ms\n",before,after);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int readPageCrcs(int fd, int page, int count, uint16_t* crcs)
+{
+    int i;
+    uint8_t cmd[6];
+    uint8_t buf[2 * 255];
+    uint32_t offset = page * PAGE_SIZE;
+
+    if((count <= 0) || (count > 255))
+        return 0;
+
+    cmd[0] = 'k';
+    cmd[1] = (offset >> 0) & 0xFF;
+    cmd[2] = (offset >> 8) & 0xFF;
+    cmd[3] = (offset >> 16) & 0xFF;
+    cmd[4] = (offset >> 24) & 0xFF;
+    cmd[5] = count;
+    serialport_writebuf(fd, cmd, sizeof(cmd));
+
+    /* The answer is two bytes a page, plus the device reading each page out of flash */
+    if(readRawBytes(fd, (char*)buf, 2 * count, ackTimeoutMs() + (2 * count * 10 * 1000) / baudRate + count) < 0)
+        return 0;
+
+    for(i=0;i<count;i++)
+        crcs[i] = buf[2 * i] | (buf[2 * i + 1] << 8);
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int resumePoint(int fd, const tl_image* img)
+{
+    int i;
+    int page;
+    int first = img->frameCount;
+    int pages = APP_SECTION_SIZE / PAGE_SIZE;
+    uint16_t crcs[APP_SECTION_SIZE / PAGE_SIZE];
+    uint8_t differs[APP_SECTION_SIZE / PAGE_SIZE];
+
+    trace_begin("crc", pages);
+    for(page=0;page<pages;page+=PAGE_CRC_CHUNK)
+    {
+        if(readPageCrcs(fd, page, PAGE_CRC_CHUNK, crcs + page) == 0)
+        {
+            trace_end("crc");
+            log_printf("[err]: No page CRCs from the device\n");
+            return -1;
+        }
+    }
+    trace_end("crc");
+
+    /* Pages outside the image read as 0xFF in img->data, just like erased flash */
+    for(page=0;page<pages;page++)
+        differs[page] = (crcs[page] != crc16_xmodem(0, img->data + page * PAGE_SIZE, PAGE_SIZE));
+
+    for(i=0;i<img->frameCount;i++)
+    {
+        page = img->frames[i].offset / PAGE_SIZE;
+        if(differs[page] && (first == img->frameCount))
+            first = i;
+        differs[page] = 0;
+    }
+
+    for(page=0;page<pages;page++)
+    {
+        if(differs[page])
+        {
+            if(verbose)
+                log_printf("[dbg]: Page %d holds something the image doesn't have\n",page);
+            return -1;
+        }
+    }
+
+    return first;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* A frame the device is still reading gets filled up with pings, a device whose watchdog ran out
+   meanwhile is in the application and gets reset */
+int resyncDevice(int fd)
+{
+    int ok;
+    int tuned;
+    char msg;
+    uint8_t fill[FRAME_SIZE];
+
+    trace_begin("resync", 0);
+
+    memset(fill, 'a', sizeof(fill));
+    serialport_discard(fd);
+    serialport_writebuf(fd, fill, sizeof(fill));
+    serialport_drain(fd);
+
+    /* Answers to the fill and to whatever was cut off */
+    while(readRawBytes(fd, &msg, 1, 50) >= 0)
+        ;
+
+    if(measureAckRtt(fd, 1) >= 0)
+    {
+        trace_end("resync");
+        return 1;
+    }
+
+    log_printf("> No answer, resetting the board\n");
+
+    /* The driver owns RTS while flow control is on */
+    if(flowControl)
+        serialport_set_flowcontrol(fd, 0);
+    serialport_discard(fd);
+    resetDevice(fd);
+
+    /* After the reset the bootloader is back at LINK_BAUD */
+    tuned = baudRate;
+    if(baudRate != LINK_BAUD)
+    {
+        serialport_set_baud(fd, LINK_BAUD);
+        baudRate = LINK_BAUD;
+    }
+
+    ok = (sendPing(fd) > 0);
+    if(ok && (tuned != LINK_BAUD))
+        tune_switch_baud(fd, tuned);
+    if(flowControl)
+        serialport_set_flowcontrol(fd, 1);
+
+    trace_end("resync");
+    return ok;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int uploadResumable(int fd, const tl_image* img, int start, const char* port, journal_t* j)
+{
+    int attempt;
+
+    for(attempt=0;;attempt++)
+    {
+        pagesDone = start;
+        pagesConfirmed = 0;
+
+        if(uploadFrames(fd, img->frames + start, img->frameCount - start))
+        {
+            return 1;
+        }
+
+        if(port != NULL)
+        {
+            j->confirmed = start + pagesConfirmed;
+            journal_save(port, j);
+        }
+
+        if(attempt == RESUME_ATTEMPTS)
+        {
+            break;
+        }
+
+        log_printf("\n> Upload broke off after %d of %d pages, reconnecting\n",start + pagesConfirmed,img->frameCount);
+        hostStats.resumes++;
+
+        if(resyncDevice(fd) == 0)
+        {
+            break;
+        }
+
+        start = resumePoint(fd, img);
+        if(start < 0)
+        {
+            log_printf("> Flash doesn't match what was sent, starting over\n");
+            if(eraseDevice(fd) == 0)
+            {
+                break;
+            }
+            start = 0;
+        }
+
+        log_printf("> Continuing at page %d of %d\n",start,img->frameCount);
+    }
+
+    log_printf("[err]: Upload failed%s\n",(port != NULL) ? ", the next run with this image continues it" : "");
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int installStaged(int fd, const tl_image* img)
+{
+    int res;
+    int pages = (img->endAddress + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint8_t cmd[4];
+    uint16_t crc = crc16_xmodem(0, img->data, pages * PAGE_SIZE);
+
+    cmd[0] = 'i';
+    cmd[1] = pages;
+    cmd[2] = (crc >> 0) & 0xFF;
+    cmd[3] = (crc >> 8) & 0xFF;
+
+    log_printf("> Installing the staged image, %d pages ...\n",pages);
+    trace_begin("install", pages);
+    serialport_writebuf(fd, cmd, sizeof(cmd));
+
+    if(readACK(fd) <= 0)
+    {
+        trace_end("install");
+        log_printf("[err]: No answer to the install command\n");
+        return 0;
+    }
+
+    /* The device runs the CRC over the staged pages first, about a ms per page */
+    res = readACKWithin(fd, ackTimeoutMs() + pages);
+    if(res <= 0)
+    {
+        trace_end("install");
+        if(res == ACK_VERIFY)
+            log_printf("[err]: The staging region doesn't hold this image, the application was left alone\n");
+        else
+            log_printf("[err]: No answer to the staged image check\n");
+        return 0;
+    }
+
+    /* From here on the application is being overwritten */
+    res = readACKWithin(fd, ERASE_TIMEOUT_MS);
+    trace_end("install");
+    if(res <= 0)
+    {
+        log_printf("[err]: The copy broke off, run the install again or upload the image\n");
+        return 0;
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+const char* loader_default_socket(void)
+{
+    static char path[108];
+    const char* env = getenv("TEALOADER_SOCKET");
+
+    if((env != NULL) && (env[0] != 0))
+    {
+        return env;
+    }
+
+    snprintf(path, sizeof(path), "/tmp/tealoaderd-%u.sock", (unsigned)getuid());
+    return path;
+}
+/*-----------------------------------------------------------------------------------------------*/
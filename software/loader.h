@@ -0,0 +1,165 @@
+/*-------------------------------------------------------------------------------------------------
+/ Bootloader session: connecting, resetting, talking to the device and uploading frames. Shared by
+/ the command line tool and tealoaderd.
+/------------------------------------------------------------------------------------------------*/
+#ifndef LOADER_H
+#define LOADER_H
+
+#include <stdint.h>
+#include "image.h"
+#include "journal.h"
+
+/* Device side counters, as returned by the 's' command */
+typedef struct
+{
+    uint32_t rxBytes;
+    uint16_t pages;
+    uint16_t spmOps;
+    uint32_t spmTicks;
+    uint16_t spmMaxTicks;
+    uint16_t overruns;
+    uint16_t frameErrors;
+    uint16_t dropped;
+    uint32_t tickHz;
+    uint16_t verifyErrors;
+} deviceStats_t;
+#define DEVICE_STATS_SIZE 24
+#define DEVICE_STATS_VERSION 3
+#define WRITE_FRAME_VERSION 4
+#define PATCH_VERSION 5
+#define VERIFY_VERSION 6
+#define RESUME_VERSION 8
+#define STAGE_VERSION 10
+#define DELTA_VERSION 11
+#define STREAM_FILL_VERSION 12
+
+/* readACK() result for a 'V', the page didn't read back as it was sent. Any firmware may NAK
+   with it, older ones just never do. */
+#define ACK_VERIFY (-2)
+#define VERIFY_RETRIES 3
+
+/* Application section of the Xmega32E5, the bootloader sits right after it */
+#define APP_SECTION_SIZE 32768
+
+/* Staging region of a default bootloader build, the upper half of the application section. 'i'
+   copies an image the application wrote there down to address 0. */
+#define STAGE_SIZE (APP_SECTION_SIZE / 2)
+
+/* How long enterFromApp() waits for the bootloader to come up */
+#define APP_ENTRY_TIMEOUT_MS 1000
+
+/* Every session starts at this rate, tune.c may switch to a faster one. Has to match the BAUD the
+   bootloader was built with, make LINK_BAUD=... */
+#ifndef LINK_BAUD
+#define LINK_BAUD 115200
+#endif
+
+/* Frames in flight when streaming with hardware flow control, unless tuned otherwise */
+#define STREAM_WINDOW 4
+
+/* Ping answers are quick, a serial server adds a network round trip on top */
+#define PING_TIMEOUT_MS 100
+#define NET_PING_TIMEOUT_MS 1000
+
+/* The bootloader watchdog runs for about a second, the idle pings come well within that */
+#define KEEPALIVE_MS 250
+
+/* Behind a serial server the window grows until the frames in flight cover the ACK round trip,
+   measured with NET_RTT_PINGS pings. Without RTS/CTS each frame is followed by filler for the
+   time the device programs a page, erase and write at worst. */
+#define NET_RTT_PINGS 10
+#define NET_MAX_WINDOW 32
+#define PAGE_BUSY_MS 8
+#define STREAM_GAP_MARGIN_MS 2
+/* The filler byte. Older bootloaders count it as dropped, and as overruns while they program. */
+#define STREAM_FILL 0x00
+
+/* ACK timeouts follow the measured round trip the way TCP sets its retransmit timeout, on top of
+   the time a window of frames takes on the wire. The erase runs for a fixed, long time. */
+#define ACK_RTO_INIT_MS 1000
+#define ACK_RTO_MIN_MS 100
+#define ACK_RTO_MAX_MS 5000
+#define ERASE_TIMEOUT_MS 10000
+
+/* How often a broken upload is picked up again before giving up, and pages per 'k' request */
+#define RESUME_ATTEMPTS 3
+#define PAGE_CRC_CHUNK 64
+
+/* Host side counters, printed next to the device ones with -s */
+typedef struct
+{
+    uint32_t ackCount;
+    uint64_t ackWaitNs;
+    uint64_t ackMaxNs;
+    uint64_t uploadNs;
+    uint32_t verifyRetries;
+    uint32_t resumes;
+    uint32_t fillerBytes;
+} hostStats_t;
+
+extern int verbose;
+extern int useCache;
+extern int flowControl;
+extern int frameType;
+extern int pagesDone;
+extern int pagesTotal;
+extern int pagesConfirmed;
+extern int baudRate;
+extern int streamWindow;
+extern int fwVersion;
+extern hostStats_t hostStats;
+
+int readACK(int fd);
+int readACKWithin(int fd, int timeoutMs);
+int ackTimeoutMs(void);
+int getVersion(int fd);
+int sendPing(int fd);
+/* Single ping for a bootloader left waiting, 1 if it answered */
+int keepAlive(int fd);
+int connectDevice(char* path);
+int resetDevice(int fd);
+int enterFromApp(int fd, const char* cmd);
+int eraseDevice(int fd);
+int loadImage(char* path, tl_image* img);
+int uploadFrames(int fd, const tl_frame* frames, int count);
+int streamFrames(int fd, const tl_frame* frames, int count);
+/* Filler bytes streamFrames() puts behind a frame when there is no flow control */
+int streamGapBytes(void);
+/* Sizes streamWindow for the ACK round trip of a port behind a serial server */
+void coverNetworkLatency(int fd);
+int sendFrame(int fd, const tl_frame* frame);
+int reprogramPage(int fd, uint32_t offset);
+void dumpPage(const uint8_t* data);
+/* Frames that turn base, which the device is believed to hold, into img. Delta frames where the
+   firmware has them, checked against the device's page CRCs, 'p' patches otherwise. */
+void buildPatch(int fd, const tl_image* base, tl_image* img);
+/* The whole page for a delta frame the device couldn't rebuild */
+int sendFallback(int fd, const tl_frame* frame);
+void showProgress(void);
+int getDeviceStats(int fd, deviceStats_t* st);
+void printStats(int fd);
+uint64_t nowNs(void);
+
+/* Average round trip of count pings in ms, negative if one of them went unanswered */
+double measureAckRtt(int fd, int count);
+/* Turns on serialport_set_lowlatency() and prints the ACK round trip before and after */
+void tuneLatency(int fd);
+
+/* 'k', CRC-16/XMODEM of count pages from page on */
+int readPageCrcs(int fd, int page, int count, uint16_t* crcs);
+/* Index of the first frame of img the device doesn't hold yet, img->frameCount if it holds them
+   all. -1 if a page outside the frames isn't what img has there, only an erase helps then. */
+int resumePoint(int fd, const tl_image* img);
+/* Gets the device taking commands again after an upload broke off */
+int resyncDevice(int fd);
+/* uploadFrames() from frame start on, picking up where it stopped when an ACK goes missing. With
+   a port, j is saved for it when the upload breaks off. */
+int uploadResumable(int fd, const tl_image* img, int start, const char* port, journal_t* j);
+
+/* 'i', installs the image the application staged once the device confirmed it is img */
+int installStaged(int fd, const tl_image* img);
+
+/* tealoaderd listens here unless told otherwise, $TEALOADER_SOCKET or /tmp/tealoaderd-<uid>.sock */
+const char* loader_default_socket(void);
+
+#endif /* LOADER_H */
@@ -0,0 +1,179 @@
+/*-------------------------------------------------------------------------------------------------
+/ Console output off the upload path.
+/------------------------------------------------------------------------------------------------*/
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+/*-----------------------------------------------------------------------------------------------*/
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p,v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* How long the writer sleeps when the ring is empty */
+#define LOG_IDLE_US 2000
+/*-----------------------------------------------------------------------------------------------*/
+typedef struct
+{
+    int ready;
+    int len;
+    char text[LOG_LINE];
+} log_slot_t;
+/*-----------------------------------------------------------------------------------------------*/
+/* Writers reserve slots at head, the writer thread prints them from tail. printed counts the lines
+   which have reached stdout's file descriptor. */
+static log_slot_t ring[LOG_SLOTS];
+static unsigned int head;
+static unsigned int tail;
+static unsigned int printed;
+static int running;
+static int stopping;
+static pthread_t thread;
+static uint64_t lastProgress;
+/*-----------------------------------------------------------------------------------------------*/
+static uint64_t nowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void* writerThread(void* arg)
+{
+    int n;
+    log_slot_t* slot;
+
+    (void)arg;
+
+    while(1)
+    {
+        n = 0;
+        slot = &ring[tail % LOG_SLOTS];
+        while(load_acquire(&slot->ready))
+        {
+            fwrite(slot->text, 1, slot->len, stdout);
+            store_release(&slot->ready, 0);
+            store_release(&tail, tail + 1);
+            slot = &ring[tail % LOG_SLOTS];
+            n++;
+        }
+
+        if(n > 0)
+        {
+            fflush(stdout);
+            store_release(&printed, tail);
+            continue;
+        }
+
+        /* Only leave once everything reserved before the stop is out */
+        if(load_acquire(&stopping) && (load_acquire(&head) == tail))
+            break;
+
+        usleep(LOG_IDLE_US);
+    }
+
+    return NULL;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int log_start(void)
+{
+    if(running)
+        return 1;
+
+    head = 0;
+    tail = 0;
+    printed = 0;
+    stopping = 0;
+
+    if(pthread_create(&thread, NULL, writerThread, NULL) != 0)
+    {
+        printf("[err]: Couldn't start the log thread, printing directly\n");
+        return 0;
+    }
+
+    store_release(&running, 1);
+    atexit(log_stop);
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void logLine(const char* fmt, va_list ap)
+{
+    int len;
+    unsigned int pos;
+    log_slot_t* slot;
+
+    if(!load_acquire(&running))
+    {
+        vprintf(fmt, ap);
+        return;
+    }
+
+    pos = __atomic_fetch_add(&head, 1, __ATOMIC_ACQ_REL);
+
+    /* Wait for room, the terminal is slower than what the upload prints */
+    while((pos - load_acquire(&tail)) >= LOG_SLOTS)
+        usleep(100);
+
+    slot = &ring[pos % LOG_SLOTS];
+    len = vsnprintf(slot->text, LOG_LINE, fmt, ap);
+    if(len < 0)
+        len = 0;
+    slot->len = (len < LOG_LINE) ? len : (LOG_LINE - 1);
+    store_release(&slot->ready, 1);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void log_printf(const char* fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    logLine(fmt, ap);
+    va_end(ap);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void log_progress(const char* fmt, ...)
+{
+    va_list ap;
+    uint64_t now = nowMs();
+
+    if((now - lastProgress) < LOG_PROGRESS_MS)
+        return;
+    lastProgress = now;
+
+    va_start(ap, fmt);
+    logLine(fmt, ap);
+    va_end(ap);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void log_flush(void)
+{
+    unsigned int target;
+
+    if(!load_acquire(&running))
+    {
+        fflush(stdout);
+        return;
+    }
+
+    target = load_acquire(&head);
+    while((int)(target - load_acquire(&printed)) > 0)
+        usleep(100);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void log_stop(void)
+{
+    if(!load_acquire(&running))
+        return;
+
+    store_release(&stopping, 1);
+    pthread_join(thread, NULL);
+    store_release(&running, 0);
+    fflush(stdout);
+}
+/*-----------------------------------------------------------------------------------------------*/
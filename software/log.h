@@ -0,0 +1,31 @@
+/*-------------------------------------------------------------------------------------------------
+/ Console output off the upload path.
+/
+/ Messages are formatted into a ring of fixed size lines, a background thread writes them to stdout
+/ and flushes after each batch. Writers only wait when the ring is full.
+/------------------------------------------------------------------------------------------------*/
+#ifndef LOG_H
+#define LOG_H
+
+/* Lines in the ring, power of two, and the longest line kept */
+#define LOG_SLOTS 1024
+#define LOG_LINE 256
+
+/* Progress lines closer together than this are dropped */
+#define LOG_PROGRESS_MS 100
+
+/* Starts the writer thread, until then messages are printed straight away */
+int log_start(void);
+
+void log_printf(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Same as log_printf(), but throttled to one line per LOG_PROGRESS_MS */
+void log_progress(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/* Waits until everything logged so far is out, e.g. before stdout is redirected */
+void log_flush(void);
+
+/* Flushes and joins the writer thread, log_start() registers it with atexit() */
+void log_stop(void);
+
+#endif /* LOG_H */
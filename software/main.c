@@ -15,44 +15,70 @@
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include "serial_lib.h"
+#include "hexcache.h"
+#include "image.h"
+#include "pipeline.h"
+#include "patch.h"
+#include "loader.h"
+#include "crc.h"
+#include "multidrop.h"
+#include "tune.h"
+#include "log.h"
 /*-----------------------------------------------------------------------------------------------*/
 const float version = 0.3;
 /*-----------------------------------------------------------------------------------------------*/
-int verbose = 0;
 int immediateExit = 0;
-uint8_t dataBuffer[65536];
+int showStats = 0;
+int pipelined = 0;
+char* tracePath = NULL;
+tl_image image;
+tl_image baseImage;
+char* basePath = NULL;
+int incremental = 0;
+char* socketPath = NULL;
+int holdDevice = 0;
+int lowLatency = 0;
+char* capturePath = NULL;
+int nodes[MULTIDROP_MAX_NODES];
+int nodeCount = 0;
+char* appCommand = NULL;
+int handedOver = 0;
+int calibrate = 0;
+int forcedBaud = 0;
+int installOnly = 0;
 /*-----------------------------------------------------------------------------------------------*/
-#define PAGE_SIZE 128
+/* Events kept by the wire tracer, the oldest ones are dropped beyond this */
+#define TRACE_EVENTS 262144
 /*-----------------------------------------------------------------------------------------------*/
-const char filePath[256]; 
-const char portPath[256];
+char filePath[256]; 
+char portPath[256];
 /*-----------------------------------------------------------------------------------------------*/
-int readACK(int fd);
-int getVersion(int fd);
-int sendPing(int fd);
-int connectDevice(char* path);
-int setDTR(int fd, int level);
-int setRTS(int fd, int level);
-int parseUntilColon(FILE *file_pointer);
-int parseHex(FILE *file_pointer, int num_digits);
-int parseIntelHex(char *hexfile, uint8_t* buffer, int *startAddr, int *endAddr);
+int uploadPipelined(int fd, char* path, tl_image* img);
+void exportTrace(void);
+void closeCapture(void);
+void recordImage(const tl_image* img);
+int runClient(const char* sockPath, char* path, int hold);
 /*-----------------------------------------------------------------------------------------------*/
 int main(int argc, char *argv[]) 
 {    
-    int i;
     int c;
     int fd;
-    int offset;
-    uint8_t t8;    
     int err = 0;
-    int pageNumber;
     int gotFile = 0;
     int gotPort = 0; 
-    int endAddress = 0;
-    int startAddress = 1;
-
-    while ((c = getopt(argc, argv, "f:p:vi")) != -1)
+    int resumable = 0;
+    int start = -1;
+    uint64_t t0;
+    journal_t journal;
+    journal_t found;
+    tune_link_t link;
+
+    while ((c = getopt(argc, argv, "f:p:vicsrPt:o:d:klR:n:a:Tb:I")) != -1)
     {
         switch (c) 
         {
@@ -78,10 +104,95 @@ int main(int argc, char *argv[])
                 immediateExit = 1;
                 break;
             }
+            case 'c':
+            {
+                useCache = 1;
+                break;
+            }
+            case 's':
+            {
+                showStats = 1;
+                break;
+            }
+            case 'r':
+            {
+                flowControl = 1;
+                break;
+            }
+            case 'P':
+            {
+                pipelined = 1;
+                break;
+            }
+            case 't':
+            {
+                tracePath = optarg;
+                break;
+            }
+            case 'o':
+            {
+                basePath = optarg;
+                break;
+            }
+            case 'd':
+            {
+                socketPath = optarg;
+                break;
+            }
+            case 'k':
+            {
+                holdDevice = 1;
+                break;
+            }
+            case 'l':
+            {
+                lowLatency = 1;
+                break;
+            }
+            case 'R':
+            {
+                capturePath = optarg;
+                break;
+            }
+            case 'a':
+            {
+                appCommand = optarg;
+                break;
+            }
+            case 'T':
+            {
+                calibrate = 1;
+                break;
+            }
+            case 'I':
+            {
+                installOnly = 1;
+                break;
+            }
+            case 'b':
+            {
+                forcedBaud = atoi(optarg);
+                if(tune_baud_index(forcedBaud) < 0)
+                {
+                    err = 1;
+                    log_printf(" [%s]: The bootloader can't do this baud rate!\n",optarg);
+                }
+                break;
+            }
+            case 'n':
+            {
+                nodeCount = multidrop_parse_nodes(optarg, nodes, MULTIDROP_MAX_NODES);
+                if(nodeCount <= 0)
+                {
+                    err = 1;
+                    log_printf(" [%s]: Bad node list!\n",optarg);
+                }
+                break;
+            }
             default:
             {
                 err = 1;
-                printf(" [%c]: Unrecognized option!\n",c);
+                log_printf(" [%c]: Unrecognized option!\n",c);
                 break;
             }
         }   
@@ -89,192 +200,388 @@ int main(int argc, char *argv[])
     
     if(verbose)
     {
-        printf("-----------------------------------------------------------------------\n");
-        printf(" - teaLoader - Atmel XMega32E5 serial bootloader\n");    
-        printf("               Copyright (c) 2014 - <ihsan@kehribar.me>\n");
-        printf("               Released under Coffeware License\n");
-        printf("               https://github.com/kehribar/tealoader\n");
-        printf("               Software version: %2.1f\n",version);    
-        printf("-----------------------------------------------------------------------\n");
+        log_printf("-----------------------------------------------------------------------\n");
+        log_printf(" - teaLoader - Atmel XMega32E5 serial bootloader\n");    
+        log_printf("               Copyright (c) 2014 - <ihsan@kehribar.me>\n");
+        log_printf("               Released under Coffeware License\n");
+        log_printf("               https://github.com/kehribar/tealoader\n");
+        log_printf("               Software version: %2.1f\n",version);    
+        log_printf("-----------------------------------------------------------------------\n");
     }
 
-    if((err==1) || (gotFile==0) || (gotPort==0))
+    if((err==1) || (gotFile==0) || ((gotPort==0) && (socketPath==NULL)))
     {
-        printf("Argument parsing error!\n");                
-        printf("Usage: %s [-f <fileName>] [-p <portPath>] [-v] [-i]\n",argv[0]);
-        printf("       -v: verbose output\n");
-        printf("       -i: immediate exit\n");                    
+        log_printf("Argument parsing error!\n");                
+        log_printf("Usage: %s [-f <fileName>] [-p <portPath>] [-v] [-i] [-c] [-s] [-r] [-P] [-t <trace.json>] [-o <old.hex>] [-d <socket>] [-k] [-l] [-R <capture.tlr>] [-n <node,...>] [-a <command>] [-T] [-b <baud>] [-I]\n",argv[0]);
+        log_printf("       -v: verbose output\n");
+        log_printf("       -i: immediate exit\n");                    
+        log_printf("       -c: cache parsed images (in $TEALOADER_CACHE or ~/.cache/tealoader)\n");
+        log_printf("       -s: print link and flash statistics\n");
+        log_printf("       -r: RTS/CTS flow control, needs a FLOW_CONTROL=1 bootloader\n");
+        log_printf("       -P: upload while the file is still being parsed, e.g. with -f -\n");
+        log_printf("       -t: write a Chrome/Perfetto trace of the serial traffic\n");
+        log_printf("       -o: image the device holds now, only the differences are sent\n");
+        log_printf("       -d: hand the job to tealoaderd on this socket, - for the default one\n");
+        log_printf("       -k: with -d, keep the device in the bootloader afterwards\n");
+        log_printf("       -l: lower the USB serial latency timer while connected\n");
+        log_printf("       -R: record the session for the replay tool\n");
+        log_printf("       -n: broadcast to these RS-485 nodes, needs RS485=1 bootloaders\n");
+        log_printf("       -a: ask the application to start the bootloader with this command, \\n and \\r are\n");
+        log_printf("           understood. RTS/DTR reset is used when it doesn't answer.\n");
+        log_printf("       -T: measure the link at every rate the bootloader knows and keep the fastest\n");
+        log_printf("           reliable one for this adapter, later runs use it by themselves\n");
+        log_printf("       -b: use this baud rate, 115200 230400 460800 921600 500000 1000000 2000000\n");
+        log_printf("       -I: install the image the application staged in the upper half of the flash,\n");
+        log_printf("           -f names the same image. Nothing is uploaded, best combined with -a.\n");
         
         if(!immediateExit)
         {
-            printf("> Press enter key to exit ...\n");
+            log_printf("> Press enter key to exit ...\n");
+            log_flush();
             getchar();
         }        
         return 0;
     }
 
-    fd = connectDevice(portPath);
+    /* The daemon owns the port, we only tell it what to flash */
+    if(socketPath != NULL)
+    {
+        err = runClient((strcmp(socketPath, "-") == 0) ? loader_default_socket() : socketPath, filePath, holdDevice);
 
-    if(fd < 0)
-    {    
-        return 0;
+        if(!immediateExit)
+        {
+            log_printf("> Press enter key to exit ...\n");
+            log_flush();
+            getchar();
+        }
+        return err ? 0 : 1;
     }
 
-    /* Flush the serial port */
-    serialport_flush(fd);
-
-    /* Auto reset the board */
-    setRTS(fd,1); setRTS(fd,0); setRTS(fd,1);
-    setDTR(fd,1); setDTR(fd,0); setDTR(fd,1);
+    /* Terminal output would otherwise hold up the upload, mostly with -v */
+    log_start();
 
-    if(sendPing(fd) > 0)
+    /* Written out on every exit path, failed sessions are the interesting ones */
+    if(tracePath != NULL)
     {
-        printf("> Ping OK\n");
+        if(trace_init(TRACE_EVENTS) < 0)
+        {
+            log_printf("[err]: Couldn't allocate the trace buffer\n");
+            return 0;
+        }
+        atexit(exportTrace);
     }
-    else
+
+    if(capturePath != NULL)
     {
-        if(verbose)
-            printf("[err]: Ping problem\n");
-        return 0;
+        if(capture_open(capturePath) < 0)
+        {
+            return 0;
+        }
+        atexit(closeCapture);
     }
 
-    printf("> Firmware version: %d\n",getVersion(fd));    
+    /* In pipelined mode the image is parsed during the upload and checked on the way */
+    if(!pipelined)
+    {
+        if(loadImage(filePath, &image) == 0)
+        {
+            return 0;
+        }
 
-    memset(dataBuffer, 0xFF, sizeof(dataBuffer));
+        if(image.startAddress != 0)
+        {
+            log_printf("> You should change the startAddress = 0 assumption\n");
+            return 0;
+        }
+
+        if(image.endAddress > APP_SECTION_SIZE)
+        {
+            log_printf("Program size is too big!\n");
+            return 0;
+        }
 
-    if(parseIntelHex(filePath, dataBuffer, &startAddress, &endAddress) == 0)
+        if((basePath != NULL) && (loadImage(basePath, &baseImage) == 0))
+        {
+            return 0;
+        }
+
+        recordImage(&image);
+    }
+    else if(basePath != NULL)
+    {
+        log_printf("> -o is ignored in pipelined mode\n");
+        basePath = NULL;
+    }
+
+    if((nodeCount > 0) && (pipelined || (basePath != NULL)))
+    {
+        log_printf("> -n can't be combined with -P or -o\n");
+        return 0;
+    }
+
+    /* Calibration writes test pages, the device no longer holds the -o image afterwards */
+    if((calibrate || forcedBaud) && ((nodeCount > 0) || (calibrate && (basePath != NULL))))
     {
+        log_printf("> -T and -b can't be combined with -n, -T not with -o\n");
         return 0;
     }
 
-    if(startAddress != 0)
+    /* The device already holds the image, only its CRC goes out */
+    if(installOnly)
     {
-        printf("> You should change the startAddress = 0 assumption\n");
+        if(pipelined || (basePath != NULL) || (nodeCount > 0) || calibrate)
+        {
+            log_printf("> -I can't be combined with -P, -o, -n or -T\n");
+            return 0;
+        }
+
+        if(image.endAddress > STAGE_SIZE)
+        {
+            log_printf("> The image doesn't fit below the staging region\n");
+            return 0;
+        }
+    }
+
+    trace_begin("connect", 0);
+    fd = connectDevice(portPath);
+
+    if(fd < 0)
+    {    
         return 0;
     }
 
-    if(endAddress > (32768))
+    if((appCommand != NULL) && enterFromApp(fd, appCommand))
     {
-        printf("Program size is too big!\n");
+        handedOver = 1;
+        log_printf("> Application handed over to the bootloader\n");
+    }
+    else
+    {
+        /* Flush the serial port */
+        serialport_flush(fd);
+
+        /* Auto reset the board */
+        resetDevice(fd);
+    }
+    trace_end("connect");
+
+    /* Every node gets the same 'w' frames, they are told apart by their page maps afterwards */
+    if(nodeCount > 0)
+    {
+        if(image.frameType != FRAME_WRITE)
+        {
+            image.frameType = FRAME_WRITE;
+            image_build_frames(&image);
+        }
+
+        t0 = nowNs();
+        err = multidrop_flash(fd, &image, nodes, nodeCount);
+        hostStats.uploadNs = nowNs() - t0;
+
+        log_printf("> %d of %d nodes flashed\n",err,nodeCount);
+        if(showStats)
+            log_printf("> Host: %u bytes sent, upload took %.3f s\n",serialport_stats.txBytes,hostStats.uploadNs / 1e9);
+
+        log_printf("> Jumping to the user application\n");
+        serialport_writebyte(fd,'x');
+        serialport_drain(fd);
+        serialport_close(fd);
+
+        if(!immediateExit)
+        {
+            log_printf("> Press enter key to exit ...\n");
+            log_flush();
+            getchar();
+        }
         return 0;
     }
 
-    printf("> Erasing the memory ...\n");
-    serialport_writebyte(fd,'d');
-    if (readACK(fd) > 0)
+    if(handedOver || (sendPing(fd) > 0))
     {
-        if(verbose)
-            printf("[dbg]: ACK OK\n");
+        log_printf("> Ping OK\n");
     }
     else
     {
         if(verbose)
-            printf("[dbg]: ACK problem\n");
+            log_printf("[err]: Ping problem\n");
         return 0;
     }
 
-    i = 0;    
-    offset = 0;
-    pageNumber = 0;
+    fwVersion = getVersion(fd);
+    log_printf("> Firmware version: %d\n",fwVersion);    
 
-    if(!verbose)
-        setvbuf(stdout, NULL, _IONBF, 0);
+    if(lowLatency)
+    {
+        tuneLatency(fd);
+    }
 
-    while(offset<endAddress)
-    {        
-        if(verbose)
+    /* Measured or saved settings for this adapter, everything below runs at them */
+    if(fwVersion >= TUNE_VERSION)
+    {
+        if(calibrate && tune_calibrate(fd, &link))
         {
-            printf("\n");
-            printf("[dbg]: Page number: %d\n",pageNumber);
-            printf("[dbg]: Page base address: %d\n",offset);
+            tune_save(portPath, &link);
         }
-        
-        /* Fill the page buffer command */
-        serialport_writebyte(fd,'b');
 
-        if(verbose)
-            printf("[dbg]: Uploading: %c%d\n",'%',((100 * offset) / endAddress));
+        if(!forcedBaud)
+        {
+            tune_apply(fd, portPath);
+        }
+        else if(tune_switch_baud(fd, forcedBaud))
+        {
+            log_printf("> Link: %d baud\n",forcedBaud);
+        }
         else
-            printf("> Uploading: %c%d\r",'%',((100 * offset) / endAddress));
+        {
+            log_printf("> Link: %d baud didn't work, staying at %d\n",forcedBaud,baudRate);
+        }
+    }
+    else if(calibrate || forcedBaud)
+    {
+        log_printf("> Link tuning needs firmware version %d, staying at %d baud\n",TUNE_VERSION,baudRate);
+    }
 
-        if (readACK(fd) > 0)
+    if(installOnly)
+    {
+        if(fwVersion < STAGE_VERSION)
         {
-            if(verbose)
-                printf("[dbg]: ACK OK\n");
+            log_printf("> Staged updates need firmware version %d\n",STAGE_VERSION);
+            return 0;
         }
-        else
+
+        t0 = nowNs();
+        if(installStaged(fd, &image) == 0)
         {
-            if(verbose)
-                printf("[dbg]: ACK problem\n");
             return 0;
         }
-         
-        if(verbose)      
-            printf("    ");
-        for(i=0;i<PAGE_SIZE;i++)
-        {   
-            if(verbose)                     
-            {
-                printf("[%3d] %2X   ",i,dataBuffer[i+offset]);     
-                if((i%8)==7)
-                {
-                    printf("\n    ");
-                }
-            }                   
-            serialport_writebyte(fd,dataBuffer[i+offset]);
+        hostStats.uploadNs = nowNs() - t0;
+        log_printf("> Installed in %.3f s\n",hostStats.uploadNs / 1e9);
+
+        if(showStats)
+            printStats(fd);
+
+        log_printf("> Jumping to the user application\n");
+        serialport_writebyte(fd,'x');
+        serialport_close(fd);
+
+        if(!immediateExit)
+        {
+            log_printf("> Press enter key to exit ...\n");
+            log_flush();
+            getchar();
         }
-        if(verbose)    
-            printf("\n");
+        return 0;
+    }
 
-        /* Write the page command */
-        serialport_writebyte(fd,'c');  
+    /* Older bootloaders only know 'b' and 'c' */
+    if(fwVersion < WRITE_FRAME_VERSION)
+    {
+        frameType = FRAME_LEGACY;
+        if(!pipelined && (image.frameType != frameType))
+        {
+            image.frameType = frameType;
+            image_build_frames(&image);
+        }
+    }
 
-        if (readACK(fd) > 0)
+    if(basePath != NULL)
+    {
+        if(fwVersion >= PATCH_VERSION)
         {
-            if(verbose)
-                printf("[dbg]: ACK OK\n");
+            incremental = 1;
+            buildPatch(fd, &baseImage, &image);
         }
         else
         {
-            if(verbose)
-               printf("[dbg]: ACK problem\n");
-            return 0;
+            log_printf("> Incremental upload needs firmware version %d, sending everything\n",PATCH_VERSION);
         }
+    }
 
-        t8 = (offset >> 0) & 0xFF;
-        serialport_writebyte(fd,t8);
-
-        t8 = (offset >> 8) & 0xFF;
-        serialport_writebyte(fd,t8);
-
-        t8 = (offset >> 16) & 0xFF;
-        serialport_writebyte(fd,t8);
+    coverNetworkLatency(fd);
 
-        t8 = (offset >> 24) & 0xFF;
-        serialport_writebyte(fd,t8);
+    /* Turned on after the reset pulses, the driver owns the RTS line from here on */
+    if(flowControl && (serialport_set_flowcontrol(fd, 1) < 0))
+    {
+        log_printf("[err]: Couldn't enable RTS/CTS flow control\n");
+        return 0;
+    }
 
-        if (readACK(fd) > 0)
+    /* A run with the same image on the same port which broke off after the erase can go on where
+       it stopped, once the page CRCs confirm the device still holds what was sent */
+    if(!pipelined && !incremental && (fwVersion >= RESUME_VERSION))
+    {
+        resumable = 1;
+        journal_init(&journal, &image);
+        if(journal_match(portPath, &journal, &found) && ((start = resumePoint(fd, &image)) >= 0))
         {
-            if(verbose)
-                printf("[dbg]: ACK OK\n");
+            log_printf("> Resuming an interrupted upload, %d of %d pages were confirmed, the device holds %d\n",
+                found.confirmed, image.frameCount, start);
         }
         else
         {
-            if(verbose)
-                printf("[dbg]: ACK problem\n");
+            start = -1;
+        }
+    }
+
+    /* Incremental frames bring every changed page to its final state by themselves */
+    if(!incremental && (start < 0))
+    {
+        if(eraseDevice(fd) == 0)
+        {
             return 0;
         }
+        start = 0;
 
-        offset += PAGE_SIZE;
-        pageNumber++;
+        if(resumable)
+            journal_save(portPath, &journal);
     }
 
+    t0 = nowNs();
+    trace_begin("upload", 0);
+
+    if(pipelined)
+    {
+        if(uploadPipelined(fd, filePath, &image) == 0)
+        {
+            return 0;
+        }
+
+        recordImage(&image);
+    }
+    else
+    {
+        /* Blank pages are left out of the frame list, the erase above already took care of them */
+        pagesTotal = image.frameCount;
+        if(resumable)
+        {
+            if(uploadResumable(fd, &image, start, portPath, &journal) == 0)
+            {
+                return 0;
+            }
+            journal_clear(portPath);
+        }
+        else if(uploadFrames(fd, image.frames, image.frameCount) == 0)
+        {
+            return 0;
+        }
+    }
+
+    hostStats.uploadNs = nowNs() - t0;
+    trace_end("upload");
+
      if(verbose)
-            printf("[dbg]: Uploading: %c%d\n",'%',100);
+            log_printf("[dbg]: Uploading: %c%d\n",'%',100);
         else
-            printf("> Uploading: %c%d\n",'%',100);
+            log_printf("> Uploading: %c%d\n",'%',100);
+
+    if(showStats)
+    {
+        trace_begin("stats", 0);
+        printStats(fd);
+        trace_end("stats");
+    }
         
-    printf("> Jumping to the user application\n");
+    log_printf("> Jumping to the user application\n");
 
     /* Jump to the user app */
     serialport_writebyte(fd,'x');
@@ -283,210 +590,135 @@ int main(int argc, char *argv[])
 
     if(!immediateExit)
     {
-        printf("> Press enter key to exit ...\n");
+        log_printf("> Press enter key to exit ...\n");
+        log_flush();
         getchar();
     }        
 
     return 0;
 }
 /*-----------------------------------------------------------------------------------------------*/
-int parseIntelHex(char *hexfile, uint8_t* buffer, int *startAddr, int *endAddr) 
-{
-  int address, base, d, segment, i, lineLen, sum;
-  FILE *input;
-  
-  input = strcmp(hexfile, "-") == 0 ? stdin : fopen(hexfile, "r");
-  if (input == NULL) {
-    printf("> Error opening %s: %s\n", hexfile, strerror(errno));
-    return 0;
-  }
-  
-  while (parseUntilColon(input) == ':') {
-    sum = 0;
-    sum += lineLen = parseHex(input, 2);
-    base = address = parseHex(input, 4);
-    sum += address >> 8;
-    sum += address;
-    sum += segment = parseHex(input, 2);  /* segment value? */
-    if (segment != 0) {   /* ignore lines where this byte is not 0 */
-      continue;
-    }
-    
-    for (i = 0; i < lineLen; i++) {
-      d = parseHex(input, 2);
-      buffer[address++] = d;
-      sum += d;
-    }
-    
-    sum += parseHex(input, 2);
-    if ((sum & 0xff) != 0) {
-      printf("> Error: Checksum error between address 0x%x and 0x%x\n", base, address);
-      return 0;
-    }
-    
-    if(*startAddr > base) {
-      *startAddr = base;
-    }
-    if(*endAddr < address) {
-      *endAddr = address;
-    }
-  }
-  
-  fclose(input);
-  return 1;
-}
-/*-----------------------------------------------------------------------------------------------*/
-int parseUntilColon(FILE *file_pointer) 
+/* Sends pages as the parser thread hands them over. While it waits for the hex file, stdin say,
+   pings keep the bootloader's watchdog from resetting into a half written application. */
+int uploadPipelined(int fd, char* path, tl_image* img)
 {
-  int character;
-  
-  do {
-    character = getc(file_pointer);
-  } while(character != ':' && character != EOF);
-  
-  return character;
-}
-/*-----------------------------------------------------------------------------------------------*/
-int parseHex(FILE *file_pointer, int num_digits) 
-{
-  int iter;
-  char temp[9];
-
-  for(iter = 0; iter < num_digits; iter++) {
-    temp[iter] = getc(file_pointer);
-  }
-  temp[iter] = 0;
-  
-  return strtol(temp, NULL, 16);
-}
-/*-----------------------------------------------------------------------------------------------*/
-/* Taken from: http://www.linuxquestions.org/questions/programming-9/manually-controlling-rts-cts-326590/#post1658463 */
-int setRTS(int fd, int level)
-{
-    int status;
+    int n;
+    uint64_t idleSince;
+    const tl_frame* frames;
 
-    if (ioctl(fd, TIOCMGET, &status) == -1) {
-        perror("setRTS(): TIOCMGET");
+    if(pipeline_start(path, img, frameType, APP_SECTION_SIZE) == 0)
+    {
         return 0;
     }
-    if (level)
-        status |= TIOCM_RTS;
-    else
-        status &= ~TIOCM_RTS;
-    if (ioctl(fd, TIOCMSET, &status) == -1) {
-        perror("setRTS(): TIOCMSET");
-        return 0;
+
+    idleSince = nowNs();
+
+    while((n = pipeline_peek(&frames)) != PIPELINE_DONE)
+    {
+        if(n == 0)
+        {
+            if((nowNs() - idleSince) >= KEEPALIVE_MS * 1000000ULL)
+            {
+                if(keepAlive(fd) == 0)
+                {
+                    log_printf("[err]: Device stopped answering while waiting for %s\n",path);
+                    pipeline_abort();
+                    pipeline_finish();
+                    return 0;
+                }
+                idleSince = nowNs();
+            }
+            usleep(100);
+            continue;
+        }
+
+        if(uploadFrames(fd, frames, n) == 0)
+        {
+            pipeline_abort();
+            pipeline_finish();
+            return 0;
+        }
+
+        pipeline_release(n);
+        idleSince = nowNs();
     }
-    return 1;
+
+    return pipeline_finish();
 }
 /*-----------------------------------------------------------------------------------------------*/
-int setDTR(int fd, int level)
+void exportTrace(void)
 {
-    int status;
-
-    if (ioctl(fd, TIOCMGET, &status) == -1) {
-        perror("setDTR(): TIOCMGET");
-        return 0;
-    }
-    if (level)
-        status |= TIOCM_DTR;
-    else
-        status &= ~TIOCM_DTR;
-    if (ioctl(fd, TIOCMSET, &status) == -1) {
-        perror("setDTR(): TIOCMSET");
-        return 0;
-    }
-    return 1;
+    if(trace_export(tracePath) == 0)
+        log_printf("> Trace written to %s\n",tracePath);
 }
 /*-----------------------------------------------------------------------------------------------*/
-int connectDevice(char* path)
+void closeCapture(void)
 {
-    int fd = -1;    
-
-    fd = serialport_init(path,115200,'n');
-
-    if(fd < 0)
-    {
-        printf("[err]: Connection error.\n");
-        return -1;
-    }
-    else
-    {
-        
-        printf("> Conection OK\n");
-        return fd;
-    }       
+    if(capture_close() == 0)
+        log_printf("> Session recorded to %s\n",capturePath);
 }
 /*-----------------------------------------------------------------------------------------------*/
-int getVersion(fd)
+void recordImage(const tl_image* img)
 {
-    char msg;
-
-    serialport_writebyte(fd,'v');
-
-    /* Read the response */
-    if(readRawBytes(fd,&msg,1,10000) < 0)
-    {
-        /* Timeout or read problem */
-        return -1;
-    }
-
-    return msg;
+    if(capturePath != NULL)
+        capture_image(fnv1a64(FNV64_INIT, img->data, img->endAddress), img->endAddress);
 }
 /*-----------------------------------------------------------------------------------------------*/
-int readACK(fd)
+/* Sends "FLASH <absolute path> run|hold" to tealoaderd and relays its output, the last line it
+   sends is "@OK" or "@FAIL" */
+int runClient(const char* sockPath, char* path, int hold)
 {
-    char msg;
+    int fd;
+    int ok = 0;
+    FILE* in;
+    char line[PATH_MAX + 16];
+    char absPath[PATH_MAX];
+    struct sockaddr_un addr;
 
-    /* Read the response */
-    if(readRawBytes(fd,&msg,1,10000) < 0)
+    if(realpath(path, absPath) == NULL)
     {
-        /* Timeout or read problem */
-        return -1;
+        log_printf("[err]: Couldn't open %s\n",path);
+        return 0;
     }
 
-    if(msg == 'Y')
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", sockPath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if((fd < 0) || (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0))
     {
-        /* Return OK */
-        return 1;
+        log_printf("[err]: Couldn't reach tealoaderd at %s\n",sockPath);
+        if(fd >= 0)
+            close(fd);
+        return 0;
     }
-    else
+
+    snprintf(line, sizeof(line), "FLASH %s %s\n", absPath, hold ? "hold" : "run");
+    if(write(fd, line, strlen(line)) != (ssize_t)strlen(line))
     {
-        /* Wrong response ... */
-        return -1;
+        log_printf("[err]: Couldn't send the job to tealoaderd\n");
+        close(fd);
+        return 0;
     }
-}
-/*-----------------------------------------------------------------------------------------------*/
-int sendPing(int fd)
-{    
-    char msg;
-    uint8_t cnt = 10;
-    uint8_t res = -1;
 
-    while((cnt--) || (res < 0))
+    in = fdopen(fd, "r");
+    while(fgets(line, sizeof(line), in) != NULL)
     {
-        /* Send ping message */
-        serialport_writebyte(fd,'a');
-
-         /* Read the response */
-        if(readRawBytes(fd,&msg,1,100) < 0)
+        if(strncmp(line, "@OK", 3) == 0)
         {
-            /* Timeout or read problem */
-            res = -1;
+            ok = 1;
+            break;
         }
-
-        if(msg == 'Y')
-        {
-            /* Return OK */
-            res = 1;
-        }
-        else
+        else if(strncmp(line, "@FAIL", 5) == 0)
         {
-            /* Wrong response ... */
-            res = -1;
+            break;
         }
+        fputs(line, stdout);
+        fflush(stdout);
     }
+    fclose(in);
 
-    return res;
+    return ok;
 }
 /*-----------------------------------------------------------------------------------------------*/
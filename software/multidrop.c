@@ -0,0 +1,234 @@
+/*-------------------------------------------------------------------------------------------------
+/ Broadcast flashing of several bootloaders sharing one RS-485 bus.
+/------------------------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "serial_lib.h"
+#include "loader.h"
+#include "multidrop.h"
+#include "log.h"
+/*-----------------------------------------------------------------------------------------------*/
+/* Nobody ACKs a broadcast, so the pauses cover the slowest node. A chip erase is 256 page erases,
+   a 'w' frame has its erase done by the time the data is in and only the write is left. */
+#define ERASE_WAIT_MS 1500
+#define PAGE_WAIT_US 6000
+/* A bootloader fresh out of reset starts the application unless its first byte is 'a'. Nodes come
+   up listening, so nobody answers these. Some go out while the nodes are still resetting. */
+#define WAKE_PINGS 5
+#define WAKE_GAP_MS 10
+/*-----------------------------------------------------------------------------------------------*/
+int multidrop_parse_nodes(const char* list, int* nodes, int max)
+{
+    int count = 0;
+    long node;
+    char* end;
+
+    while(*list)
+    {
+        node = strtol(list, &end, 0);
+        if((end == list) || (node < 0) || (node >= MULTIDROP_BROADCAST) || (count >= max))
+            return -1;
+
+        nodes[count++] = node;
+
+        list = end;
+        if(*list == ',')
+            list++;
+        else if(*list != 0)
+            return -1;
+    }
+
+    return count;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int multidrop_select(int fd, int node)
+{
+    uint8_t cmd[2];
+
+    cmd[0] = 'n';
+    cmd[1] = node;
+
+    return serialport_writebuf(fd, cmd, 2);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int multidrop_join(int fd)
+{
+    serialport_writebyte(fd,'j');
+
+    return readACK(fd);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int multidrop_page_map(int fd, uint8_t* map)
+{
+    serialport_writebyte(fd,'m');
+
+    return readRawBytes(fd, (char*)map, MULTIDROP_MAP_SIZE, 1000);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void wakeNodes(int fd)
+{
+    int i;
+
+    for(i=0;i<WAKE_PINGS;i++)
+    {
+        serialport_writebyte(fd,'a');
+        serialport_drain(fd);
+        usleep(WAKE_GAP_MS * 1000);
+    }
+
+    /* A bootloader built without RS485 answers anyway */
+    serialport_discard(fd);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int multidrop_flash(int fd, const tl_image* img, const int* nodes, int count)
+{
+    int i;
+    int j;
+    int page;
+    int missed;
+    int failed;
+    int version;
+    int good = 0;
+    int alive = 0;
+    int shared = 1;
+    int present[MULTIDROP_MAX_NODES];
+    uint8_t map[MULTIDROP_MAP_SIZE];
+    const tl_frame* frame;
+
+    wakeNodes(fd);
+
+    /* Roll call, one node at a time */
+    for(i=0;i<count;i++)
+    {
+        present[i] = 0;
+        multidrop_select(fd, nodes[i]);
+
+        if(sendPing(fd) <= 0)
+        {
+            log_printf("> Node %d: no answer\n",nodes[i]);
+            continue;
+        }
+
+        version = getVersion(fd);
+        if(version < MULTIDROP_VERSION)
+        {
+            log_printf("> Node %d: firmware version %d can't take broadcasts, needs %d\n",nodes[i],version,MULTIDROP_VERSION);
+            continue;
+        }
+
+        /* Older firmware takes every broadcast, nodes left off the list or missing from the
+           roll call would have their applications erased along with ours */
+        if(version < MULTIDROP_JOIN_VERSION)
+        {
+            shared = 0;
+        }
+        else if(multidrop_join(fd) <= 0)
+        {
+            log_printf("> Node %d: didn't join the broadcast\n",nodes[i]);
+            continue;
+        }
+
+        log_printf("> Node %d: firmware version %d\n",nodes[i],version);
+        present[i] = 1;
+        alive++;
+    }
+
+    if(alive == 0)
+    {
+        return 0;
+    }
+
+    fwVersion = MULTIDROP_VERSION;
+
+    if(shared)
+    {
+        /* The nodes which joined listen, nobody answers */
+        multidrop_select(fd, MULTIDROP_BROADCAST);
+
+        log_printf("> Erasing %d nodes ...\n",alive);
+        trace_begin("erase", 0);
+        serialport_writebyte(fd,'d');
+        serialport_drain(fd);
+        usleep(ERASE_WAIT_MS * 1000);
+        trace_end("erase");
+
+        pagesDone = 0;
+        pagesTotal = img->frameCount;
+
+        trace_begin("broadcast", img->frameCount);
+        for(j=0;j<img->frameCount;j++)
+        {
+            showProgress();
+
+            if(serialport_writebuf(fd, img->frames[j].bytes, img->frames[j].length) < 0)
+            {
+                log_printf("[err]: Write problem\n");
+                return 0;
+            }
+            serialport_drain(fd);
+            usleep(PAGE_WAIT_US);
+
+            pagesDone++;
+        }
+        trace_end("broadcast");
+        log_printf("\n");
+    }
+    else
+    {
+        log_printf("> Firmware before version %d can't keep other nodes out of a broadcast, flashing one node at a time\n",
+            MULTIDROP_JOIN_VERSION);
+    }
+
+    /* Each node tells what it has, only the gaps are filled */
+    for(i=0;i<count;i++)
+    {
+        if(!present[i])
+            continue;
+
+        multidrop_select(fd, nodes[i]);
+
+        if(!shared && (eraseDevice(fd) == 0))
+        {
+            log_printf("> Node %d: erase failed\n",nodes[i]);
+            continue;
+        }
+
+        if(multidrop_page_map(fd, map) < 0)
+        {
+            log_printf("> Node %d: no page map, lost after the broadcast\n",nodes[i]);
+            continue;
+        }
+
+        missed = 0;
+        failed = 0;
+        for(j=0;(j<img->frameCount)&&!failed;j++)
+        {
+            frame = &img->frames[j];
+            page = frame->offset / PAGE_SIZE;
+
+            if(map[page / 8] & (1 << (page % 8)))
+                continue;
+
+            missed++;
+            if(sendFrame(fd, frame) == 0)
+                failed = 1;
+        }
+
+        if(failed)
+        {
+            log_printf("> Node %d: missed %d of %d pages, resending page %d failed\n",
+                nodes[i],missed,img->frameCount,frame->offset / PAGE_SIZE);
+            continue;
+        }
+
+        log_printf("> Node %d: missed %d of %d pages, done\n",nodes[i],missed,img->frameCount);
+        good++;
+    }
+
+    multidrop_select(fd, MULTIDROP_BROADCAST);
+
+    return good;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,37 @@
+/*-------------------------------------------------------------------------------------------------
+/ Broadcast flashing of several bootloaders sharing one RS-485 bus.
+/
+/ Pages go out once to all nodes, without ACKs. Each node is then asked in turn for its map of the
+/ pages which verified, and only the ones it missed are sent to it again, one at a time with ACKs.
+/ Only the listed nodes join the broadcast, the others on the bus keep their applications.
+/------------------------------------------------------------------------------------------------*/
+#ifndef MULTIDROP_H
+#define MULTIDROP_H
+
+#include "image.h"
+
+#define MULTIDROP_VERSION 7
+#define MULTIDROP_JOIN_VERSION 13
+#define MULTIDROP_MAX_NODES 32
+#define MULTIDROP_BROADCAST 0xFF
+#define MULTIDROP_MAP_SIZE 32
+
+/* Parses "1,2,7" into nodes, returns the count or -1 on a bad list */
+int multidrop_parse_nodes(const char* list, int* nodes, int max);
+
+/* 'n', the selected node answers from now on. MULTIDROP_BROADCAST makes all nodes act silently. */
+int multidrop_select(int fd, int node);
+
+/* 'j', the selected node takes part in broadcasts. Nodes which never got it read past them. */
+int multidrop_join(int fd);
+
+/* 'm', one bit per application page which verified since the last erase */
+int multidrop_page_map(int fd, uint8_t* map);
+
+/* Keeps the freshly reset nodes in their bootloaders, erases, broadcasts img and patches up every
+   node. Nodes whose firmware can't join a broadcast get erased and flashed one at a time instead.
+   Returns the number of nodes that ended up with the whole image. img must be framed with
+   FRAME_WRITE. */
+int multidrop_flash(int fd, const tl_image* img, const int* nodes, int count);
+
+#endif /* MULTIDROP_H */
@@ -0,0 +1,86 @@
+/*-------------------------------------------------------------------------------------------------
+/ Incremental uploads against an image which is known to be on the device already.
+/------------------------------------------------------------------------------------------------*/
+#include <string.h>
+#include "patch.h"
+#include "crc.h"
+/*-----------------------------------------------------------------------------------------------*/
+/* 'p' + address + length */
+#define PATCH_HEADER 6
+/*-----------------------------------------------------------------------------------------------*/
+static void encodePatch(tl_frame* frame, const uint8_t* page, uint32_t offset, int start, int len)
+{
+    uint8_t* p = frame->bytes;
+    uint32_t address = offset + start;
+
+    *p++ = 'p';
+    *p++ = (address >> 0) & 0xFF;
+    *p++ = (address >> 8) & 0xFF;
+    *p++ = (address >> 16) & 0xFF;
+    *p++ = (address >> 24) & 0xFF;
+    *p++ = len;
+    memcpy(p, page + start, len);
+    p += len;
+
+    frame->offset = offset;
+    frame->length = p - frame->bytes;
+    frame->crc = crc16_xmodem(0, page, PAGE_SIZE);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void patch_build_frames(const tl_image* base, tl_image* img, patch_stats_t* st)
+{
+    int i;
+    int page;
+    int first;
+    int last;
+    int offset;
+    int end = (img->endAddress > base->endAddress) ? img->endAddress : base->endAddress;
+    const uint8_t* now;
+    const uint8_t* old;
+
+    memset(st, 0, sizeof(*st));
+    img->frameCount = 0;
+    img->frames = img->frameStore;
+
+    for(offset=0;offset<end;offset+=PAGE_SIZE)
+    {
+        page = offset / PAGE_SIZE;
+        now = img->data + offset;
+        old = base->data + offset;
+
+        first = -1;
+        last = -1;
+        for(i=0;i<PAGE_SIZE;i++)
+        {
+            if(now[i] != old[i])
+            {
+                if(first < 0)
+                    first = i;
+                last = i;
+            }
+        }
+
+        if(first < 0)
+        {
+            st->unchanged++;
+            continue;
+        }
+
+        /* A single span per page, every patch costs a full page erase-write on the device */
+        if((PATCH_HEADER + (last - first + 1)) < (1 + 4 + PAGE_SIZE))
+        {
+            encodePatch(&img->frameStore[img->frameCount++], now, offset, first, last - first + 1);
+            st->patched++;
+            st->patchBytes += last - first + 1;
+        }
+        else
+        {
+            image_encode_frame(&img->frameStore[img->frameCount++], FRAME_WRITE, now, offset);
+            if(image_page_blank(img, page))
+                st->erased++;
+            else
+                st->rewritten++;
+        }
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,23 @@
+/*-------------------------------------------------------------------------------------------------
+/ Incremental uploads against an image which is known to be on the device already.
+/------------------------------------------------------------------------------------------------*/
+#ifndef PATCH_H
+#define PATCH_H
+
+#include "image.h"
+
+typedef struct
+{
+    int unchanged;
+    int patched;
+    int patchBytes;
+    int rewritten;
+    int erased;
+} patch_stats_t;
+
+/* Replaces the frames of img with the ones that turn base into img: nothing for equal pages, a
+   'p' patch when the changed bytes are few, a full 'w' frame otherwise. Pages that become blank
+   are written with 0xFF, as there is no chip erase before an incremental upload. */
+void patch_build_frames(const tl_image* base, tl_image* img, patch_stats_t* st);
+
+#endif /* PATCH_H */
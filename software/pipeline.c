@@ -0,0 +1,209 @@
+/*-------------------------------------------------------------------------------------------------
+/ Overlapped parsing and uploading.
+/------------------------------------------------------------------------------------------------*/
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include "pipeline.h"
+#include "log.h"
+/*-----------------------------------------------------------------------------------------------*/
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p,v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+/*-----------------------------------------------------------------------------------------------*/
+/* head is only written by the parser, tail only by the uploader */
+static tl_frame ring[PIPELINE_DEPTH];
+static unsigned int head;
+static unsigned int tail;
+static int done;
+static int aborted;
+static int result;
+static pthread_t thread;
+/*-----------------------------------------------------------------------------------------------*/
+/* Parser side state */
+static tl_image* image;
+static const char* path;
+static int limit;
+static int nextPage;
+static uint8_t dirty[IMAGE_PAGES / 8];
+/*-----------------------------------------------------------------------------------------------*/
+static int publish(int page)
+{
+    unsigned int h = head;
+
+    /* Wait for room */
+    while((h - load_acquire(&tail)) >= PIPELINE_DEPTH)
+    {
+        if(load_acquire(&aborted))
+            return -1;
+        usleep(100);
+    }
+
+    image_encode_frame(&ring[h % PIPELINE_DEPTH], image->frameType, image->data + (page * PAGE_SIZE), page * PAGE_SIZE);
+    store_release(&head, h + 1);
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int isDirty(int page)
+{
+    return dirty[page / 8] & (1 << (page % 8));
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Sends the pages that were changed after being published, except for [first,last] which the
+   current record is still filling */
+static int flushDirty(int first, int last)
+{
+    int page;
+
+    for(page=0;page<nextPage;page++)
+    {
+        if(isDirty(page) && ((page < first) || (page > last)))
+        {
+            dirty[page / 8] &= ~(1 << (page % 8));
+            if(publish(page) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int onRecord(void* ctx, int base, int end)
+{
+    int page;
+    int first;
+    int last;
+
+    (void)ctx;
+
+    if(end == base)
+        return 0;
+
+    if(end > limit)
+    {
+        log_printf("Program size is too big!\n");
+        return -1;
+    }
+
+    first = base / PAGE_SIZE;
+    last = (end - 1) / PAGE_SIZE;
+
+    /* Out of order record into pages which are already gone, they will be sent again. The device
+       does an erase-write for every page so this is harmless. */
+    for(page=first;(page<=last)&&(page<nextPage);page++)
+    {
+        dirty[page / 8] |= 1 << (page % 8);
+    }
+
+    if(flushDirty(first, last) < 0)
+        return -1;
+
+    /* Records come in address order, so everything below this one is complete */
+    for(;nextPage<first;nextPage++)
+    {
+        if(!image_page_blank(image, nextPage) && (publish(nextPage) < 0))
+            return -1;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void* parserThread(void* arg)
+{
+    int ok;
+    int lastPage;
+
+    (void)arg;
+
+    ok = parseIntelHexRecords(path, image->data, &image->startAddress, &image->endAddress, onRecord, NULL);
+
+    if(ok && (image->startAddress != 0))
+    {
+        log_printf("> You should change the startAddress = 0 assumption\n");
+        ok = 0;
+    }
+
+    if(ok)
+    {
+        ok = (flushDirty(IMAGE_PAGES, IMAGE_PAGES) == 0);
+
+        lastPage = (image->endAddress + PAGE_SIZE - 1) / PAGE_SIZE;
+        for(;ok&&(nextPage<lastPage);nextPage++)
+        {
+            if(!image_page_blank(image, nextPage) && (publish(nextPage) < 0))
+                ok = 0;
+        }
+    }
+
+    /* Leave a regular image behind for whoever needs it after the upload */
+    if(ok)
+        image_build_frames(image);
+
+    result = ok;
+    store_release(&done, 1);
+
+    return NULL;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int pipeline_start(const char* hexfile, tl_image* img, int frameType, int maxAddress)
+{
+    head = 0;
+    tail = 0;
+    done = 0;
+    aborted = 0;
+    result = 0;
+    nextPage = 0;
+    memset(dirty, 0, sizeof(dirty));
+
+    image = img;
+    path = hexfile;
+    limit = maxAddress;
+    image_init(img);
+    img->frameType = frameType;
+
+    if(pthread_create(&thread, NULL, parserThread, NULL) != 0)
+    {
+        log_printf("[err]: Couldn't start the parser thread\n");
+        return 0;
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int pipeline_peek(const tl_frame** frames)
+{
+    unsigned int h;
+    unsigned int n;
+    unsigned int t = tail;
+
+    /* done first, so a frame published just before it can't be missed */
+    int finished = load_acquire(&done);
+
+    h = load_acquire(&head);
+    if(h == t)
+        return finished ? PIPELINE_DONE : 0;
+
+    n = h - t;
+    if(n > PIPELINE_DEPTH - (t % PIPELINE_DEPTH))
+        n = PIPELINE_DEPTH - (t % PIPELINE_DEPTH);
+
+    *frames = &ring[t % PIPELINE_DEPTH];
+    return n;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void pipeline_release(int count)
+{
+    store_release(&tail, tail + count);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void pipeline_abort(void)
+{
+    store_release(&aborted, 1);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int pipeline_finish(void)
+{
+    pthread_join(thread, NULL);
+    return result;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,30 @@
+/*-------------------------------------------------------------------------------------------------
+/ Overlapped parsing and uploading.
+/
+/ A parser thread reads the hex file and publishes each page as a frame as soon as the records have
+/ moved past it. Frames go through a lock-free single producer / single consumer ring, the upload
+/ side takes them out in batches.
+/------------------------------------------------------------------------------------------------*/
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "image.h"
+
+/* Frames in the ring, power of two */
+#define PIPELINE_DEPTH 64
+#define PIPELINE_DONE (-1)
+
+/* Frames are encoded as frameType. Records beyond maxAddress stop the pipeline. */
+int pipeline_start(const char* hexfile, tl_image* img, int frameType, int maxAddress);
+
+/* Number of contiguous frames ready at *frames, 0 if none yet, PIPELINE_DONE at the end */
+int pipeline_peek(const tl_frame** frames);
+void pipeline_release(int count);
+
+/* Stops the parser early, for when the upload side fails */
+void pipeline_abort(void);
+
+/* Joins the parser thread. Returns 1 if the whole file was parsed fine. */
+int pipeline_finish(void);
+
+#endif /* PIPELINE_H */
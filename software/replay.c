@@ -0,0 +1,415 @@
+/*-------------------------------------------------------------------------------------------------
+/ Plays the device side of a recorded session (main -R) against the host over a pty.
+/
+/ Host bytes are expected in the recorded order, device bytes go out with the recorded delay after
+/ the record before them, or straight away with -F. At the end the recorded and the replayed
+/ session are compared: total time, time spent on the device side and on the host side.
+/
+/ Usage: replay [-F] [-i] [-v] <capture.tlr>
+/   -F: full speed, don't reproduce the device timing
+/   -i: only print a summary of the capture
+/   -v: print every record
+/------------------------------------------------------------------------------------------------*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "serial_lib.h"
+/*-----------------------------------------------------------------------------------------------*/
+/* How long the host may stay quiet in the middle of a session, the erase ACK takes a while */
+#define HOST_TIMEOUT_MS 15000
+/*-----------------------------------------------------------------------------------------------*/
+typedef struct
+{
+    uint8_t type;
+    uint64_t t;          /* microseconds from the start of the capture */
+    uint32_t len;
+    const uint8_t* data;
+} record_t;
+/*-----------------------------------------------------------------------------------------------*/
+static uint8_t* capture = NULL;
+static record_t* records = NULL;
+static int recordCount = 0;
+static uint64_t startNs = 0;
+static int fullSpeed = 0;
+static int verbose = 0;
+/*-----------------------------------------------------------------------------------------------*/
+static uint64_t nowUs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static uint32_t le32(const uint8_t* b)
+{
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int varint(const uint8_t** p, const uint8_t* end, uint32_t* v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while(*p < end)
+    {
+        *v |= (uint32_t)(**p & 0x7F) << shift;
+        if((*(*p)++ & 0x80) == 0)
+            return 0;
+        shift += 7;
+        if(shift > 28)
+            return -1;
+    }
+
+    return -1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int loadCapture(const char* path)
+{
+    FILE* in;
+    long size;
+    int i;
+    uint32_t dt;
+    uint64_t t = 0;
+    const uint8_t* p;
+    const uint8_t* end;
+
+    if((in = fopen(path, "rb")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    capture = malloc(size > 0 ? size : 1);
+    if((size < 13) || (fread(capture, 1, size, in) != (size_t)size) ||
+       (memcmp(capture, CAPTURE_MAGIC, 4) != 0) || (capture[4] != CAPTURE_VERSION))
+    {
+        printf("[err]: %s is not a version %d capture\n",path,CAPTURE_VERSION);
+        fclose(in);
+        return -1;
+    }
+    fclose(in);
+
+    for(i=0;i<8;i++)
+        startNs |= (uint64_t)capture[5 + i] << (8 * i);
+
+    /* Every record takes at least three bytes */
+    records = malloc(((size - 13) / 3 + 1) * sizeof(record_t));
+
+    p = capture + 13;
+    end = capture + size;
+    while(p < end)
+    {
+        record_t* r = &records[recordCount];
+
+        r->type = *p++;
+        if((varint(&p, end, &dt) < 0) || (varint(&p, end, &r->len) < 0) || (r->len > (uint32_t)(end - p)))
+        {
+            /* A session which was cut short, keep what is complete */
+            printf("> Capture is truncated after %d records\n",recordCount);
+            break;
+        }
+        t += dt;
+        r->t = t;
+        r->data = p;
+        p += r->len;
+        recordCount++;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void printRecord(const record_t* r)
+{
+    uint32_t i;
+
+    switch(r->type)
+    {
+        case CAPTURE_PORT:
+        {
+            if(r->len >= 7)
+                printf("%10.3f ms  port %.*s, %u baud, parity %c, flow control %s, low latency bits %d\n",
+                    r->t / 1e3, (int)(r->len - 7), (const char*)r->data + 7, le32(r->data),
+                    r->data[4], r->data[5] ? "on" : "off", r->data[6]);
+            break;
+        }
+        case CAPTURE_IMAGE:
+        {
+            if(r->len >= 12)
+                printf("%10.3f ms  image %u bytes, hash %08X%08X\n",
+                    r->t / 1e3, le32(r->data + 8), le32(r->data + 4), le32(r->data));
+            break;
+        }
+        case CAPTURE_TX:
+        case CAPTURE_RX:
+        {
+            printf("%10.3f ms  %s %4u:",r->t / 1e3,(r->type == CAPTURE_TX) ? "host  " : "device",r->len);
+            for(i=0;(i<r->len)&&(i<16);i++)
+                printf(" %02X",r->data[i]);
+            printf("%s\n",(r->len > 16) ? " .." : "");
+            break;
+        }
+        default:
+        {
+            printf("%10.3f ms  unknown record '%c', %u bytes\n",r->t / 1e3,r->type,r->len);
+            break;
+        }
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Device time is from a host record to the device record after it, host time the other way round */
+static void printSummary(void)
+{
+    int i;
+    int acks = 0;
+    int prevType = 0;
+    uint64_t prevT = 0;
+    uint64_t txBytes = 0;
+    uint64_t rxBytes = 0;
+    uint64_t deviceUs = 0;
+    uint64_t ackUs = 0;
+    uint64_t ackMaxUs = 0;
+    time_t start = startNs / 1000000000ULL;
+
+    printf("> Recorded %s",ctime(&start));
+
+    for(i=0;i<recordCount;i++)
+    {
+        const record_t* r = &records[i];
+
+        if((r->type == CAPTURE_PORT) || (r->type == CAPTURE_IMAGE))
+            printRecord(r);
+
+        if(r->type == CAPTURE_TX)
+            txBytes += r->len;
+
+        if(r->type == CAPTURE_RX)
+        {
+            rxBytes += r->len;
+            if(prevType == CAPTURE_TX)
+            {
+                deviceUs += r->t - prevT;
+                if((r->len == 1) && (r->data[0] == 'Y'))
+                {
+                    acks++;
+                    ackUs += r->t - prevT;
+                    if(r->t - prevT > ackMaxUs)
+                        ackMaxUs = r->t - prevT;
+                }
+            }
+        }
+
+        if((r->type == CAPTURE_TX) || (r->type == CAPTURE_RX))
+        {
+            prevType = r->type;
+            prevT = r->t;
+        }
+    }
+
+    printf("> %d records, host sent %llu bytes, device sent %llu bytes in %.3f s\n",
+        recordCount, (unsigned long long)txBytes, (unsigned long long)rxBytes,
+        recordCount ? records[recordCount - 1].t / 1e6 : 0.0);
+    printf("> Waiting for the device: %.3f s\n",deviceUs / 1e6);
+    if(acks > 0)
+        printf("> %d ACKs right after a host write, average %.3f ms, max %.3f ms\n",
+            acks, ackUs / 1e3 / acks, ackMaxUs / 1e3);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int openPty(void)
+{
+    int master;
+    int slave;
+    struct termios tio;
+
+    if(((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0) || (grantpt(master) < 0) || (unlockpt(master) < 0))
+    {
+        perror("pty");
+        return -1;
+    }
+
+    /* Raw, and kept open so the master doesn't see a hangup while the host reopens the port */
+    slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if((slave < 0) || (tcgetattr(slave, &tio) < 0))
+    {
+        perror(ptsname(master));
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    return master;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Reads len bytes from the host, returns the number of them which differ from want */
+static int readHost(int fd, const uint8_t* want, uint32_t len, int timeoutMs)
+{
+    int i;
+    int n;
+    int diff = 0;
+    uint32_t got = 0;
+    uint8_t buf[256];
+    struct pollfd pfd = { fd, POLLIN, 0 };
+
+    while(got < len)
+    {
+        if(poll(&pfd, 1, timeoutMs) <= 0)
+            return -1;
+
+        n = read(fd, buf, ((len - got) < sizeof(buf)) ? (len - got) : sizeof(buf));
+        if(n < 0)
+        {
+            if((errno == EAGAIN) || (errno == EINTR))
+                continue;
+            return -1;
+        }
+
+        for(i=0;i<n;i++)
+        {
+            if(buf[i] != want[got + i])
+                diff++;
+        }
+        got += n;
+    }
+
+    return diff;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int replay(int fd)
+{
+    int i;
+    int res;
+    int diff = 0;
+    int prevType = 0;
+    uint64_t t0 = 0;
+    uint64_t done = 0;
+    uint64_t target;
+    uint64_t now;
+    uint64_t hostUs = 0;
+    uint64_t recHostUs = 0;
+    uint64_t prevT = 0;
+    uint64_t recT0 = 0;
+
+    for(i=0;i<recordCount;i++)
+    {
+        const record_t* r = &records[i];
+
+        if(verbose)
+            printRecord(r);
+
+        if(r->type == CAPTURE_TX)
+        {
+            /* The first write starts the clock, before it the host is still being started */
+            res = readHost(fd, r->data, r->len, (t0 == 0) ? -1 : HOST_TIMEOUT_MS);
+            if(res < 0)
+            {
+                printf("[err]: Host went quiet at record %d of %d\n",i,recordCount);
+                return -1;
+            }
+            if((res > 0) && (diff == 0))
+                printf("> Host differs from the capture from record %d on, was it started with the same options?\n",i);
+            diff += res;
+
+            now = nowUs();
+            if(t0 == 0)
+            {
+                t0 = now;
+                recT0 = r->t;
+            }
+            else if(prevType == CAPTURE_RX)
+            {
+                hostUs += now - done;
+                recHostUs += r->t - prevT;
+            }
+            done = now;
+        }
+        else if(r->type == CAPTURE_RX)
+        {
+            if(!fullSpeed && (t0 != 0))
+            {
+                target = done + (r->t - prevT);
+                now = nowUs();
+                if(target > now)
+                    usleep(target - now);
+            }
+
+            if(write(fd, r->data, r->len) != (ssize_t)r->len)
+            {
+                printf("[err]: Write problem at record %d\n",i);
+                return -1;
+            }
+            done = nowUs();
+        }
+        else
+        {
+            continue;
+        }
+
+        prevType = r->type;
+        prevT = r->t;
+    }
+
+    printf("> Replayed %d records in %.3f s, recorded %.3f s\n",
+        recordCount, (done - t0) / 1e6, (prevT - recT0) / 1e6);
+    printf("> Host side: %.3f s now, %.3f s when recorded\n",hostUs / 1e6,recHostUs / 1e6);
+    if(diff > 0)
+        printf("> Host sent %d bytes which differ from the capture\n",diff);
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    int c;
+    int fd;
+    int infoOnly = 0;
+
+    while((c = getopt(argc, argv, "Fiv")) != -1)
+    {
+        switch(c)
+        {
+            case 'F': fullSpeed = 1; break;
+            case 'i': infoOnly = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+            {
+                printf("Usage: %s [-F] [-i] [-v] <capture.tlr>\n",argv[0]);
+                return 1;
+            }
+        }
+    }
+
+    if(optind >= argc)
+    {
+        printf("Usage: %s [-F] [-i] [-v] <capture.tlr>\n",argv[0]);
+        return 1;
+    }
+
+    if(loadCapture(argv[optind]) < 0)
+        return 1;
+
+    printSummary();
+
+    if(infoOnly)
+        return 0;
+
+    if((fd = openPty()) < 0)
+        return 1;
+
+    printf("> Device side on %s, start the host with -p %s\n",ptsname(fd),ptsname(fd));
+    fflush(stdout);
+
+    return (replay(fd) < 0) ? 1 : 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
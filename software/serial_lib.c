@@ -4,9 +4,163 @@
 /
 /
 /------------------------------------------------------------------------------------------------*/
+#include <stdlib.h>
+#include <limits.h>
+#include <time.h>
+#include <poll.h>
+#ifdef __linux__
+    #include <linux/serial.h>
+#endif
 #include "serial_lib.h"
+#include "serial_net.h"
 /*-----------------------------------------------------------------------------------------------*/
-int serialport_init(const char* serialport, int baud,char parity)
+serialport_stats_t serialport_stats;
+/*-----------------------------------------------------------------------------------------------*/
+#define SERIAL_MAX_PORTS 8
+/*-----------------------------------------------------------------------------------------------*/
+static const serial_transport_t serial_termios_transport;
+/*-----------------------------------------------------------------------------------------------*/
+static const serial_transport_t* const transports[] =
+{
+    &serial_tcp_transport,
+    &serial_rfc2217_transport,
+};
+/*-----------------------------------------------------------------------------------------------*/
+/* Ports opened by serialport_init(), a free slot has no transport */
+static serial_port_t ports[SERIAL_MAX_PORTS];
+/*-----------------------------------------------------------------------------------------------*/
+/* Driver settings changed by serialport_set_lowlatency(), -1 for the ones left alone */
+static struct
+{
+    int fd;
+    int serialFlags;
+    int latencyTimer;
+    char latencyPath[128];
+} latencySaved = { -1, -1, -1, "" };
+/*-----------------------------------------------------------------------------------------------*/
+#define TRACE_TX 0
+#define TRACE_RX 1
+#define TRACE_BEGIN 2
+#define TRACE_END 3
+#define TRACE_DATA_MAX 8
+/*-----------------------------------------------------------------------------------------------*/
+typedef struct
+{
+    uint64_t ts;
+    uint64_t dur;
+    const char* name;
+    int32_t arg;
+    uint16_t len;
+    uint8_t type;
+    uint8_t data[TRACE_DATA_MAX];
+} trace_event_t;
+/*-----------------------------------------------------------------------------------------------*/
+static trace_event_t* traceBuf = NULL;
+static uint32_t traceCap = 0;
+static uint32_t traceHead = 0;
+static uint32_t traceCount = 0;
+/*-----------------------------------------------------------------------------------------------*/
+static FILE* captureFile = NULL;
+static uint64_t captureLast = 0;
+/*-----------------------------------------------------------------------------------------------*/
+/* Port settings as last seen, repeated in every CAPTURE_PORT record */
+static struct
+{
+    uint32_t baud;
+    uint8_t parity;
+    uint8_t flowControl;
+    uint8_t lowLatency;
+    char path[64];
+} capturePort;
+/*-----------------------------------------------------------------------------------------------*/
+static void capture_port(void);
+/*-----------------------------------------------------------------------------------------------*/
+/* fds which didn't come from serialport_init() are taken for terminals */
+static serial_port_t* port_of(int fd)
+{
+    int i;
+    static serial_port_t other;
+
+    for(i=0;i<SERIAL_MAX_PORTS;i++)
+    {
+        if((ports[i].transport != NULL) && (ports[i].fd == fd))
+            return &ports[i];
+    }
+
+    other.fd = fd;
+    other.transport = &serial_termios_transport;
+    return &other;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static trace_event_t* trace_next(uint8_t type)
+{
+    trace_event_t* ev = &traceBuf[traceHead];
+
+    traceHead = (traceHead + 1) % traceCap;
+    if(traceCount < traceCap)
+        traceCount++;
+
+    ev->type = type;
+    return ev;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void trace_io(uint8_t type, uint64_t start, const uint8_t* buf, int len)
+{
+    trace_event_t* ev;
+
+    if(captureFile != NULL)
+        capture_record((type == TRACE_TX) ? CAPTURE_TX : CAPTURE_RX, buf, len);
+
+    if(traceBuf == NULL)
+        return;
+
+    ev = trace_next(type);
+    ev->ts = start;
+    ev->dur = trace_now() - start;
+    ev->name = NULL;
+    ev->len = len;
+    memcpy(ev->data, buf, (len < TRACE_DATA_MAX) ? len : TRACE_DATA_MAX);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static speed_t baudConstant(int baud)
+{
+    speed_t brate = baud; // let you override switch below if needed
+    switch(baud) {
+    case 4800:   brate=B4800;   break;
+    case 9600:   brate=B9600;   break;
+#ifdef B14400
+    case 14400:  brate=B14400;  break;
+#endif
+    case 19200:  brate=B19200;  break;
+#ifdef B28800
+    case 28800:  brate=B28800;  break;
+#endif
+    case 38400:  brate=B38400;  break;
+    case 57600:  brate=B57600;  break;
+    case 115200: brate=B115200; break;
+#ifdef B230400
+    case 230400: brate=B230400; break;
+#endif
+#ifdef B460800
+    case 460800: brate=B460800; break;
+#endif
+#ifdef B500000
+    case 500000: brate=B500000; break;
+#endif
+#ifdef B921600
+    case 921600: brate=B921600; break;
+#endif
+#ifdef B1000000
+    case 1000000: brate=B1000000; break;
+#endif
+#ifdef B2000000
+    case 2000000: brate=B2000000; break;
+#endif
+    }
+    return brate;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int termios_open(serial_port_t* port, const char* serialport, int baud, char parity)
 {
     struct termios toptions;
     int fd;
@@ -27,21 +181,7 @@ int serialport_init(const char* serialport, int baud,char parity)
         perror("Couldn't get term attributes");
         return -1;
     }
-    speed_t brate = baud; // let you override switch below if needed
-    switch(baud) {
-    case 4800:   brate=B4800;   break;
-    case 9600:   brate=B9600;   break;
-#ifdef B14400
-    case 14400:  brate=B14400;  break;
-#endif
-    case 19200:  brate=B19200;  break;
-#ifdef B28800
-    case 28800:  brate=B28800;  break;
-#endif
-    case 38400:  brate=B38400;  break;
-    case 57600:  brate=B57600;  break;
-    case 115200: brate=B115200; break;
-    }
+    speed_t brate = baudConstant(baud);
     cfsetispeed(&toptions, brate);
     cfsetospeed(&toptions, brate);
 
@@ -70,7 +210,7 @@ int serialport_init(const char* serialport, int baud,char parity)
     toptions.c_cflag &= ~CSTOPB;
     toptions.c_cflag &= ~CSIZE;
     toptions.c_cflag |= CS8;
-    // no flow control
+    // no flow control, see serialport_set_flowcontrol()
     toptions.c_cflag &= ~CRTSCTS;
 
     //toptions.c_cflag &= ~HUPCL; // disable hang-up-on-close to avoid reset
@@ -92,30 +232,402 @@ int serialport_init(const char* serialport, int baud,char parity)
         return -1;
     }
 
+    return port->fd = fd;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_init(const char* serialport, int baud,char parity)
+{
+    int i;
+    int fd;
+    serial_port_t* port = NULL;
+    const serial_transport_t* transport = &serial_termios_transport;
+
+    for(i=0;i<(int)(sizeof(transports)/sizeof(transports[0]));i++)
+    {
+        if(strncmp(serialport, transports[i]->scheme, strlen(transports[i]->scheme)) == 0)
+        {
+            transport = transports[i];
+            break;
+        }
+    }
+
+    for(i=0;(i<SERIAL_MAX_PORTS)&&(port==NULL);i++)
+    {
+        if(ports[i].transport == NULL)
+            port = &ports[i];
+    }
+    if(port == NULL)
+    {
+        fprintf(stderr, "Too many open ports\n");
+        return -1;
+    }
+
+    memset(port, 0, sizeof(*port));
+    fd = transport->open(port, serialport + (transport->scheme ? strlen(transport->scheme) : 0), baud, parity);
+    if(fd < 0)
+        return -1;
+    port->fd = fd;
+    port->transport = transport;
+
+    capturePort.baud = baud;
+    capturePort.parity = parity;
+    capturePort.flowControl = 0;
+    capturePort.lowLatency = 0;
+    snprintf(capturePort.path, sizeof(capturePort.path), "%s", serialport);
+    capture_port();
+
     return fd;
 }
 /*-----------------------------------------------------------------------------------------------*/
+static int termios_set_flowcontrol(serial_port_t* port, int enable)
+{
+    struct termios toptions;
+    int fd = port->fd;
+
+    if (tcgetattr(fd, &toptions) < 0) {
+        perror("Couldn't get term attributes");
+        return -1;
+    }
+
+    if (enable)
+        toptions.c_cflag |= CRTSCTS;
+    else
+        toptions.c_cflag &= ~CRTSCTS;
+
+    if (tcsetattr(fd, TCSANOW, &toptions) < 0) {
+        perror("Couldn't set term attributes");
+        return -1;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_set_flowcontrol(int fd, int enable)
+{
+    serial_port_t* port = port_of(fd);
+
+    if (port->transport->set_flowcontrol(port, enable) < 0)
+        return -1;
+
+    capturePort.flowControl = enable;
+    capture_port();
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int termios_set_baud(serial_port_t* port, int baud)
+{
+    struct termios toptions;
+    int fd = port->fd;
+
+    if (tcgetattr(fd, &toptions) < 0) {
+        perror("Couldn't get term attributes");
+        return -1;
+    }
+
+    cfsetispeed(&toptions, baudConstant(baud));
+    cfsetospeed(&toptions, baudConstant(baud));
+
+    /* Whatever is still queued goes out at the old rate */
+    if (tcsetattr(fd, TCSADRAIN, &toptions) < 0) {
+        perror("Couldn't set term attributes");
+        return -1;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_set_baud(int fd, int baud)
+{
+    serial_port_t* port = port_of(fd);
+
+    if (port->transport->set_baud(port, baud) < 0)
+        return -1;
+
+    capturePort.baud = baud;
+    capture_port();
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_usb_serial(const char* serialport, char* out, int len)
+{
+#ifdef __linux__
+    int i;
+    FILE* f;
+    char* name;
+    char real[PATH_MAX];
+    char dev[PATH_MAX];
+    char attr[PATH_MAX + 16];
+
+    if (realpath(serialport, real) == NULL)
+        return 0;
+
+    name = strrchr(real, '/');
+    snprintf(attr, sizeof(attr), "/sys/class/tty/%.64s/device", name ? name + 1 : real);
+    if (realpath(attr, dev) == NULL)
+        return 0;
+
+    /* The tty hangs off a USB interface, the serial number is on the device above it */
+    for (i = 0; i < 4; i++) {
+        snprintf(attr, sizeof(attr), "%s/serial", dev);
+        if ((f = fopen(attr, "r")) != NULL) {
+            if (fgets(out, len, f) != NULL) {
+                fclose(f);
+                out[strcspn(out, "\r\n")] = 0;
+                return out[0] != 0;
+            }
+            fclose(f);
+        }
+
+        if ((name = strrchr(dev, '/')) == NULL || name == dev)
+            break;
+        *name = 0;
+    }
+#endif
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Taken from: http://www.linuxquestions.org/questions/programming-9/manually-controlling-rts-cts-326590/#post1658463 */
+static int termios_set_line(serial_port_t* port, int line, int level)
+{
+    int status;
+    const int bit = (line == SERIAL_DTR) ? TIOCM_DTR : TIOCM_RTS;
+
+    if (ioctl(port->fd, TIOCMGET, &status) == -1) {
+        perror("TIOCMGET");
+        return -1;
+    }
+    if (level)
+        status |= bit;
+    else
+        status &= ~bit;
+    if (ioctl(port->fd, TIOCMSET, &status) == -1) {
+        perror("TIOCMSET");
+        return -1;
+    }
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int termios_read(serial_port_t* port, uint8_t* buf, int len)
+{
+    return read(port->fd, buf, len);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int termios_write(serial_port_t* port, const uint8_t* buf, int len)
+{
+    return write(port->fd, buf, len);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int termios_discard(serial_port_t* port)
+{
+    return tcflush(port->fd, TCIOFLUSH);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int termios_drain(serial_port_t* port)
+{
+    return tcdrain(port->fd);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static const serial_transport_t serial_termios_transport =
+{
+    NULL,
+    termios_open,
+    termios_read,
+    termios_write,
+    termios_set_baud,
+    termios_set_flowcontrol,
+    termios_set_line,
+    termios_discard,
+    termios_drain,
+};
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_is_network(int fd)
+{
+    return port_of(fd)->transport != &serial_termios_transport;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_set_dtr(int fd, int level)
+{
+    serial_port_t* port = port_of(fd);
+
+    return port->transport->set_line(port, SERIAL_DTR, level);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_set_rts(int fd, int level)
+{
+    serial_port_t* port = port_of(fd);
+
+    return port->transport->set_line(port, SERIAL_RTS, level);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_discard(int fd)
+{
+    serial_port_t* port = port_of(fd);
+
+    return port->transport->discard(port);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_drain(int fd)
+{
+    serial_port_t* port = port_of(fd);
+
+    return port->transport->drain(port);
+}
+/*-----------------------------------------------------------------------------------------------*/
 int serialport_close( int fd )
 {
+    serial_port_t* port = port_of(fd);
+
+    if(fd == latencySaved.fd)
+        serialport_restore_latency();
+
+    port->transport = NULL;
+
     return close( fd );
 }
 /*-----------------------------------------------------------------------------------------------*/
+/* USB serial adapters hold received bytes back for up to their latency timer, 16 ms on FTDI parts,
+   before sending them to the host. Every single byte ACK pays for that. */
+int serialport_set_lowlatency(int fd)
+{
+    int applied = 0;
+#ifdef __linux__
+    int n;
+    int old;
+    static int atexitDone = 0;
+    FILE* f;
+    char* tty;
+    char* name;
+    struct serial_struct ss;
+
+    serialport_restore_latency();
+    latencySaved.fd = fd;
+
+    /* Error paths tend to exit without closing the port */
+    if (!atexitDone) {
+        atexit(serialport_restore_latency);
+        atexitDone = 1;
+    }
+
+    if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+        old = ss.flags;
+        ss.flags |= ASYNC_LOW_LATENCY;
+        if ((old & ASYNC_LOW_LATENCY) || (ioctl(fd, TIOCSSERIAL, &ss) == 0)) {
+            if (!(old & ASYNC_LOW_LATENCY))
+                latencySaved.serialFlags = old;
+            applied |= SERIAL_LOWLAT_ASYNC;
+        }
+    }
+
+    tty = ttyname(fd);
+    if (tty == NULL)
+        goto done;
+
+    name = strrchr(tty, '/');
+    snprintf(latencySaved.latencyPath, sizeof(latencySaved.latencyPath),
+        "/sys/bus/usb-serial/devices/%s/latency_timer", name ? name + 1 : tty);
+
+    if ((f = fopen(latencySaved.latencyPath, "r")) == NULL)
+        goto done;
+    if (fscanf(f, "%d", &old) != 1)
+        old = -1;
+    fclose(f);
+
+    if (old == 1) {
+        applied |= SERIAL_LOWLAT_TIMER;
+    }
+    else if ((old > 1) && ((f = fopen(latencySaved.latencyPath, "w")) != NULL)) {
+        n = fprintf(f, "1\n");
+        if ((fclose(f) == 0) && (n > 0)) {
+            latencySaved.latencyTimer = old;
+            applied |= SERIAL_LOWLAT_TIMER;
+        }
+    }
+
+done:
+    capturePort.lowLatency = applied;
+    capture_port();
+#endif
+    return applied;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void serialport_restore_latency(void)
+{
+#ifdef __linux__
+    FILE* f;
+    struct serial_struct ss;
+
+    if ((latencySaved.serialFlags >= 0) && (ioctl(latencySaved.fd, TIOCGSERIAL, &ss) == 0)) {
+        ss.flags = latencySaved.serialFlags;
+        ioctl(latencySaved.fd, TIOCSSERIAL, &ss);
+    }
+
+    if ((latencySaved.latencyTimer >= 0) && ((f = fopen(latencySaved.latencyPath, "w")) != NULL)) {
+        fprintf(f, "%d\n", latencySaved.latencyTimer);
+        fclose(f);
+    }
+#endif
+    latencySaved.fd = -1;
+    latencySaved.serialFlags = -1;
+    latencySaved.latencyTimer = -1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_latency_timer(void)
+{
+    return latencySaved.latencyTimer;
+}
+/*-----------------------------------------------------------------------------------------------*/
 int serialport_writebyte( int fd, uint8_t b)
 {
-    int n = write(fd,&b,1);
+    serial_port_t* port = port_of(fd);
+    uint64_t t = traceBuf ? trace_now() : 0;
+    int n = port->transport->write(port,&b,1);
     if( n!=1)
         return -1;
+    serialport_stats.txBytes++;
+    trace_io(TRACE_TX, t, &b, 1);
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int serialport_writebuf(int fd, const uint8_t* buf, int len)
+{
+    int n;
+    uint64_t t;
+    serial_port_t* port = port_of(fd);
+
+    /* The port is non-blocking, so wait for room in the driver buffer when it is full */
+    while(len > 0)
+    {
+        t = traceBuf ? trace_now() : 0;
+        n = port->transport->write(port, buf, len);
+        if(n < 0)
+        {
+            if((errno != EAGAIN) && (errno != EINTR))
+                return -1;
+            usleep(100);
+            continue;
+        }
+        trace_io(TRACE_TX, t, buf, n);
+        buf += n;
+        len -= n;
+        serialport_stats.txBytes += n;
+    }
     return 0;
 }
 /*-----------------------------------------------------------------------------------------------*/
 int serialport_write(int fd, const char* str)
 {
     int len = strlen(str);
-    int n = write(fd, str, len);
+    serial_port_t* port = port_of(fd);
+    uint64_t t = traceBuf ? trace_now() : 0;
+    int n = port->transport->write(port, (const uint8_t*)str, len);
     if( n!=len ) {
         // perror("serialport_write: couldn't write whole string\n");
         return -1;
     }
+    serialport_stats.txBytes += n;
+    trace_io(TRACE_TX, t, (const uint8_t*)str, n);
     return 0;
 }
 /*-----------------------------------------------------------------------------------------------*/
@@ -123,8 +635,9 @@ int serialport_read_until(int fd, char* buf, char until, int buf_max, int timeou
 {
     char b[1];  // read expects an array, so we give it a 1-byte array
     int i=0;
+    serial_port_t* port = port_of(fd);
     do { 
-        int n = read(fd, b, 1);  // read a char at a time
+        int n = port->transport->read(port, (uint8_t*)b, 1);  // read a char at a time
         if( n==-1) return -1;    // couldn't read
         if( n==0 ) {
             usleep( 1 * 1000 );  // wait 1 msec try again
@@ -134,6 +647,8 @@ int serialport_read_until(int fd, char* buf, char until, int buf_max, int timeou
 
         buf[i] = b[0]; 
         i++;
+        serialport_stats.rxBytes++;
+        trace_io(TRACE_RX, trace_now(), (uint8_t*)b, 1);
     } while( b[0] != until && i < buf_max && timeout>0 );
 
     buf[i] = 0;  // null terminate the string
@@ -143,7 +658,7 @@ int serialport_read_until(int fd, char* buf, char until, int buf_max, int timeou
 int serialport_flush(int fd)
 {
     sleep(1); //required to make flush work, for some reason
-    return tcflush(fd, TCIOFLUSH);
+    return serialport_discard(fd);
 }
 /*-----------------------------------------------------------------------------------------------*/
 int readRawBytes(int fd,char* buffer,int desiredCount,int timeout)
@@ -151,27 +666,41 @@ int readRawBytes(int fd,char* buffer,int desiredCount,int timeout)
     int n;
     int i=0;    
     char b[1];
+    struct pollfd pfd;
+    struct timespec now;
+    int64_t deadline;
+    serial_port_t* port = port_of(fd);
+
+    /* Sleep in poll() rather than in 1 ms steps, an ACK is picked up as soon as it arrives */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + timeout;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
 
     while((i<desiredCount)&&(timeout>0))
     {
-        n = read(fd, b, 1);
-        if(n==-1) 
+        n = port->transport->read(port, (uint8_t*)b, 1);
+        if((n==-1) && (errno!=EAGAIN) && (errno!=EINTR))
         {   
             /* read problem */
             printf("read problem\n");
             return -1;
         }
-        else if(n==0) 
+        else if(n<=0) 
         {
             /* wait a little ... */
-            usleep(1000);
-            timeout--;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout = deadline - ((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+            if(timeout > 0)
+                poll(&pfd, 1, timeout);
             // printf("t");
         }
         else
         {       
          	// printf("%2X-",(uint8_t)b[0]);            
             buffer[i++] = b[0];
+            serialport_stats.rxBytes++;
+            trace_io(TRACE_RX, trace_now(), (uint8_t*)b, 1);
         }
     }
     if(!(timeout>0))
@@ -184,3 +713,226 @@ int readRawBytes(int fd,char* buffer,int desiredCount,int timeout)
     }
 }
 /*-----------------------------------------------------------------------------------------------*/
+int trace_init(int capacity)
+{
+    free(traceBuf);
+    traceBuf = NULL;
+    traceCap = 0;
+    traceHead = 0;
+    traceCount = 0;
+
+    if(capacity <= 0)
+        return 0;
+
+    if((traceBuf = calloc(capacity, sizeof(trace_event_t))) == NULL)
+        return -1;
+
+    traceCap = capacity;
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void trace_begin(const char* name, int32_t arg)
+{
+    trace_event_t* ev;
+
+    if(traceBuf == NULL)
+        return;
+
+    ev = trace_next(TRACE_BEGIN);
+    ev->ts = trace_now();
+    ev->name = name;
+    ev->arg = arg;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void trace_end(const char* name)
+{
+    trace_event_t* ev;
+
+    if(traceBuf == NULL)
+        return;
+
+    ev = trace_next(TRACE_END);
+    ev->ts = trace_now();
+    ev->name = name;
+}
+/*-----------------------------------------------------------------------------------------------*/
+uint64_t trace_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Chrome trace event format, loads in chrome://tracing and ui.perfetto.dev. Spans are on thread
+   1, TX on thread 2 and RX on thread 3. Timestamps are microseconds from the oldest event. */
+int trace_export(const char* path)
+{
+    int j;
+    FILE* out;
+    uint32_t i;
+    uint64_t base;
+    const trace_event_t* ev;
+    const uint32_t first = (traceHead + traceCap - traceCount) % (traceCap ? traceCap : 1);
+
+    if(traceBuf == NULL)
+        return -1;
+
+    if((out = fopen(path, "w")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    base = traceCount ? traceBuf[first].ts : 0;
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"protocol\"}},\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"tx\"}},\n");
+    fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":3,\"args\":{\"name\":\"rx\"}}");
+
+    for(i=0;i<traceCount;i++)
+    {
+        ev = &traceBuf[(first + i) % traceCap];
+
+        switch(ev->type)
+        {
+            case TRACE_BEGIN:
+            {
+                fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"B\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"args\":{\"arg\":%d}}",
+                    ev->name, (ev->ts - base) / 1e3, ev->arg);
+                break;
+            }
+            case TRACE_END:
+            {
+                fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"E\",\"pid\":1,\"tid\":1,\"ts\":%.3f}",
+                    ev->name, (ev->ts - base) / 1e3);
+                break;
+            }
+            default:
+            {
+                fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"len\":%u,\"data\":\"",
+                    (ev->type == TRACE_TX) ? "tx" : "rx", (ev->type == TRACE_TX) ? 2 : 3,
+                    (ev->ts - base) / 1e3, ev->dur / 1e3, ev->len);
+                for(j=0;(j<ev->len)&&(j<TRACE_DATA_MAX);j++)
+                {
+                    fprintf(out, "%02X", ev->data[j]);
+                }
+                fprintf(out, "%s\"}}", (ev->len > TRACE_DATA_MAX) ? ".." : "");
+                break;
+            }
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+
+    return fclose(out);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int capture_open(const char* path)
+{
+    int i;
+    uint8_t hdr[13];
+    uint64_t start;
+    struct timespec ts;
+
+    capture_close();
+
+    if((captureFile = fopen(path, "wb")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    /* Records are small and frequent, they go out in big chunks */
+    setvbuf(captureFile, NULL, _IOFBF, 65536);
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    start = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    memcpy(hdr, CAPTURE_MAGIC, 4);
+    hdr[4] = CAPTURE_VERSION;
+    for(i=0;i<8;i++)
+        hdr[5 + i] = start >> (8 * i);
+    fwrite(hdr, 1, sizeof(hdr), captureFile);
+
+    captureLast = trace_now();
+
+    if(capturePort.baud != 0)
+        capture_port();
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void capture_record(uint8_t type, const void* data, int len)
+{
+    uint32_t v;
+    uint64_t dt;
+    int i;
+
+    if(captureFile == NULL)
+        return;
+
+    /* Advance by the rounded delta, so rounding errors don't add up over a session */
+    dt = (trace_now() - captureLast) / 1000;
+    captureLast += dt * 1000;
+    if(dt > 0xFFFFFFFF)
+        dt = 0xFFFFFFFF;
+
+    fputc(type, captureFile);
+    for(i=0;i<2;i++)
+    {
+        v = (i == 0) ? (uint32_t)dt : (uint32_t)len;
+        while(v >= 0x80)
+        {
+            fputc((v & 0x7F) | 0x80, captureFile);
+            v >>= 7;
+        }
+        fputc(v, captureFile);
+    }
+    fwrite(data, 1, len, captureFile);
+}
+/*-----------------------------------------------------------------------------------------------*/
+void capture_image(uint64_t hash, uint32_t size)
+{
+    int i;
+    uint8_t b[12];
+
+    for(i=0;i<8;i++)
+        b[i] = hash >> (8 * i);
+    for(i=0;i<4;i++)
+        b[8 + i] = size >> (8 * i);
+
+    capture_record(CAPTURE_IMAGE, b, sizeof(b));
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void capture_port(void)
+{
+    int i;
+    int n = strlen(capturePort.path);
+    uint8_t b[7 + sizeof(capturePort.path)];
+
+    for(i=0;i<4;i++)
+        b[i] = capturePort.baud >> (8 * i);
+    b[4] = capturePort.parity;
+    b[5] = capturePort.flowControl;
+    b[6] = capturePort.lowLatency;
+    memcpy(b + 7, capturePort.path, n);
+
+    capture_record(CAPTURE_PORT, b, 7 + n);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int capture_close(void)
+{
+    int res;
+
+    if(captureFile == NULL)
+        return 0;
+
+    res = fclose(captureFile);
+    captureFile = NULL;
+
+    return res;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -15,10 +15,74 @@
 #include <string.h>   
 #include <sys/ioctl.h>
 
+/* Byte counters for everything that went through this library */
+typedef struct
+{
+    uint32_t txBytes;
+    uint32_t rxBytes;
+} serialport_stats_t;
+
+extern serialport_stats_t serialport_stats;
+
+/* serialport is a device node, or a port of a serial server: tcp://host:port for a raw TCP port
+   and rfc2217://host:port for a telnet one with remote port control, see serial_net.h */
 int serialport_init(const char* serialport, int baud,char parity);
 int serialport_close(int fd);
+int serialport_set_flowcontrol(int fd, int enable);
+/* Changes the rate once the output queue has drained */
+int serialport_set_baud(int fd, int baud);
+/* 1 for a port behind a serial server, ACKs take a network round trip on top */
+int serialport_is_network(int fd);
+/* Modem control lines, a raw TCP port has none and returns -1 */
+int serialport_set_dtr(int fd, int level);
+int serialport_set_rts(int fd, int level);
+/* Drops received bytes and bytes not sent yet */
+int serialport_discard(int fd);
+/* Waits until everything written is out of the host */
+int serialport_drain(int fd);
+/* USB serial number of the adapter behind the tty, from sysfs. Returns 1 if there is one, Linux
+   only. */
+int serialport_usb_serial(const char* serialport, char* out, int len);
+/* Asks the driver to pass received bytes on without delay: ASYNC_LOW_LATENCY and, for USB serial
+   adapters, a 1 ms latency_timer in sysfs. Returns the SERIAL_LOWLAT_ bits which are in effect.
+   Changed settings go back to what they were on serialport_close(), serialport_restore_latency()
+   or exit. serialport_latency_timer() is the timer value before, -1 if it wasn't changed. Linux
+   only, returns 0 elsewhere. */
+#define SERIAL_LOWLAT_ASYNC 1
+#define SERIAL_LOWLAT_TIMER 2
+int serialport_set_lowlatency(int fd);
+void serialport_restore_latency(void);
+int serialport_latency_timer(void);
 int serialport_writebyte( int fd, uint8_t b);
+int serialport_writebuf(int fd, const uint8_t* buf, int len);
 int serialport_write(int fd, const char* str);
 int serialport_read_until(int fd, char* buf, char until, int buf_max,int timeout);
 int serialport_flush(int fd);
 int readRawBytes(int fd,char* buffer,int desiredCount,int timeout);
+
+/* Optional wire tracer. Every TX/RX chunk and every span goes into a ring of preallocated events
+   with a monotonic nanosecond timestamp, oldest ones are overwritten. Span names must be string
+   literals or otherwise outlive the tracer. Nothing is recorded until trace_init() is called. */
+int trace_init(int capacity);
+void trace_begin(const char* name, int32_t arg);
+void trace_end(const char* name);
+int trace_export(const char* path);
+uint64_t trace_now(void);
+
+/* Session capture, for replaying the device side later (see replay.c). Everything sent and
+   received goes into the file as it happens, together with the port settings.
+   File: "TLR1", version byte, CLOCK_REALTIME start in ns (u64). Then records of a type byte,
+   varint microseconds since the previous record, varint length and the payload. Multi byte
+   fields are little endian, varints are 7 bits per byte, least significant group first.
+   CAPTURE_PORT:  baud (u32), parity, flow control, SERIAL_LOWLAT_ bits, port path
+   CAPTURE_IMAGE: fnv1a64() of the image data (u64), image size (u32) */
+#define CAPTURE_MAGIC "TLR1"
+#define CAPTURE_VERSION 1
+#define CAPTURE_TX 'T'
+#define CAPTURE_RX 'R'
+#define CAPTURE_PORT 'P'
+#define CAPTURE_IMAGE 'I'
+int capture_open(const char* path);
+void capture_record(uint8_t type, const void* data, int len);
+void capture_image(uint64_t hash, uint32_t size);
+int capture_close(void);
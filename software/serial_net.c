@@ -0,0 +1,535 @@
+/*-------------------------------------------------------------------------------------------------
+/ TCP and RFC 2217 transports for serial_lib.c, see serial_net.h.
+/------------------------------------------------------------------------------------------------*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+    #include <linux/sockios.h>
+#endif
+#include "serial_net.h"
+/*-----------------------------------------------------------------------------------------------*/
+#define TELNET_DATA 0
+#define TELNET_CMD 1
+#define TELNET_OPTION 2
+#define TELNET_SUB 3
+#define TELNET_SUB_IAC 4
+/*-----------------------------------------------------------------------------------------------*/
+/* How long the server gets to take the COM-PORT-OPTION */
+#define RFC2217_OPEN_TIMEOUT_MS 2000
+/*-----------------------------------------------------------------------------------------------*/
+int telnet_decode(telnet_t* t, const uint8_t* in, int len, uint8_t* out, telnet_cb cb, void* ctx)
+{
+    int i;
+    int n = 0;
+    uint8_t b;
+
+    for(i=0;i<len;i++)
+    {
+        b = in[i];
+        switch(t->state)
+        {
+            case TELNET_DATA:
+            {
+                if(b == TELNET_IAC)
+                    t->state = TELNET_CMD;
+                else
+                    out[n++] = b;
+                break;
+            }
+            case TELNET_CMD:
+            {
+                t->state = TELNET_DATA;
+                if(b == TELNET_IAC)
+                {
+                    out[n++] = b;
+                }
+                else if((b >= TELNET_WILL) && (b <= TELNET_DONT))
+                {
+                    t->verb = b;
+                    t->state = TELNET_OPTION;
+                }
+                else if(b == TELNET_SB)
+                {
+                    t->sbLen = 0;
+                    t->state = TELNET_SUB;
+                }
+                /* NOP, GA and the like don't matter here */
+                break;
+            }
+            case TELNET_OPTION:
+            {
+                t->state = TELNET_DATA;
+                if(cb != NULL)
+                    cb(ctx, t->verb, &b, 1);
+                break;
+            }
+            case TELNET_SUB:
+            {
+                if(b == TELNET_IAC)
+                    t->state = TELNET_SUB_IAC;
+                else if(t->sbLen < TELNET_SB_MAX)
+                    t->sb[t->sbLen++] = b;
+                break;
+            }
+            default:
+            {
+                if(b == TELNET_IAC)
+                {
+                    if(t->sbLen < TELNET_SB_MAX)
+                        t->sb[t->sbLen++] = b;
+                    t->state = TELNET_SUB;
+                }
+                else
+                {
+                    if((b == TELNET_SE) && (cb != NULL) && (t->sbLen > 0))
+                        cb(ctx, TELNET_SB, t->sb, t->sbLen);
+                    t->state = TELNET_DATA;
+                }
+                break;
+            }
+        }
+    }
+
+    return n;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int telnet_escape(const uint8_t* in, int len, uint8_t* out)
+{
+    int i;
+    int n = 0;
+
+    for(i=0;i<len;i++)
+    {
+        out[n++] = in[i];
+        if(in[i] == TELNET_IAC)
+            out[n++] = TELNET_IAC;
+    }
+
+    return n;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int rfc2217_command(uint8_t cmd, const uint8_t* value, int len, uint8_t* out)
+{
+    int n = 0;
+
+    out[n++] = TELNET_IAC;
+    out[n++] = TELNET_SB;
+    out[n++] = TELNET_OPT_COM_PORT;
+    out[n++] = cmd;
+    n += telnet_escape(value, len, &out[n]);
+    out[n++] = TELNET_IAC;
+    out[n++] = TELNET_SE;
+
+    return n;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int net_write_all(int fd, const uint8_t* buf, int len)
+{
+    int n;
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+
+    while(len > 0)
+    {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if(n < 0)
+        {
+            if((errno != EAGAIN) && (errno != EINTR))
+                return -1;
+            poll(&pfd, 1, 100);
+            continue;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int net_connect(const char* hostPort)
+{
+    int fd = -1;
+    int on = 1;
+    int err;
+    char host[256];
+    const char* port;
+    struct addrinfo hints;
+    struct addrinfo* res;
+    struct addrinfo* ai;
+
+    /* host:port, [v6 address]:port */
+    port = strrchr(hostPort, ':');
+    if((port == NULL) || (port == hostPort) || ((port - hostPort) >= (int)sizeof(host)))
+    {
+        fprintf(stderr, "%s: expected host:port\n", hostPort);
+        return -1;
+    }
+    if(hostPort[0] == '[')
+        snprintf(host, sizeof(host), "%.*s", (int)(port - hostPort) - 2, hostPort + 1);
+    else
+        snprintf(host, sizeof(host), "%.*s", (int)(port - hostPort), hostPort);
+    port++;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if((err = getaddrinfo(host, port, &hints, &res)) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", hostPort, gai_strerror(err));
+        return -1;
+    }
+
+    for(ai=res;ai!=NULL;ai=ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(fd < 0)
+            continue;
+        if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if(fd < 0)
+    {
+        perror("Unable to connect to the serial server ");
+        return -1;
+    }
+
+    /* Every single byte ACK would otherwise wait for Nagle */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int net_listen(int port)
+{
+    int fd;
+    int on = 1;
+    struct sockaddr_in addr;
+
+    if((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(fd, 1) < 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int net_recv(serial_port_t* port, uint8_t* buf, int len)
+{
+    int n = recv(port->fd, buf, len, 0);
+
+    /* The server hung up, the same as a serial adapter which went away */
+    if(n == 0)
+    {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    return n;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Waits until the peer has everything, how long the server's UART takes for it isn't known */
+static int net_drain(serial_port_t* port)
+{
+#ifdef SIOCOUTQ
+    int i;
+    int queued;
+
+    for(i=0;i<1000;i++)
+    {
+        if((ioctl(port->fd, SIOCOUTQ, &queued) < 0) || (queued == 0))
+            return 0;
+        usleep(1000);
+    }
+#endif
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Only what already came in can be dropped, bytes still on the way arrive later */
+static int tcp_discard(serial_port_t* port)
+{
+    uint8_t buf[256];
+
+    while(port->transport->read(port, buf, sizeof(buf)) > 0)
+        ;
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int tcp_open(serial_port_t* port, const char* path, int baud, char parity)
+{
+    return port->fd = net_connect(path);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int tcp_read(serial_port_t* port, uint8_t* buf, int len)
+{
+    return net_recv(port, buf, len);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int tcp_write(serial_port_t* port, const uint8_t* buf, int len)
+{
+    return send(port->fd, buf, len, MSG_NOSIGNAL);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* A raw TCP port runs at whatever the server was set up with */
+static int tcp_unsupported(serial_port_t* port, int value)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int tcp_set_line(serial_port_t* port, int line, int level)
+{
+    errno = ENOTSUP;
+    return -1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+const serial_transport_t serial_tcp_transport =
+{
+    "tcp://",
+    tcp_open,
+    tcp_read,
+    tcp_write,
+    tcp_unsupported,
+    tcp_unsupported,
+    tcp_set_line,
+    tcp_discard,
+    net_drain,
+};
+/*-----------------------------------------------------------------------------------------------*/
+static void rfc2217_option(void* ctx, uint8_t verb, const uint8_t* args, int len)
+{
+    uint8_t reply[3];
+    serial_port_t* port = ctx;
+    const uint8_t opt = args[0];
+
+    switch(verb)
+    {
+        case TELNET_DO:
+        {
+            if((opt == TELNET_OPT_COM_PORT) || (opt == TELNET_OPT_BINARY) || (opt == TELNET_OPT_SGA))
+                return;
+            reply[1] = TELNET_WONT;
+            break;
+        }
+        case TELNET_WILL:
+        {
+            if((opt == TELNET_OPT_BINARY) || (opt == TELNET_OPT_SGA))
+                return;
+            reply[1] = TELNET_DONT;
+            break;
+        }
+        case TELNET_DONT:
+        {
+            if(opt == TELNET_OPT_COM_PORT)
+                port->comPort = -1;
+            return;
+        }
+        case TELNET_SB:
+        {
+            /* Any answer from the port control means the server took the option */
+            if((opt == TELNET_OPT_COM_PORT) && (len >= 2) && (args[1] > RFC2217_SERVER) && (port->comPort == 0))
+                port->comPort = 1;
+            return;
+        }
+        default:
+            return;
+    }
+
+    reply[0] = TELNET_IAC;
+    reply[2] = opt;
+    net_write_all(port->fd, reply, sizeof(reply));
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int rfc2217_send(serial_port_t* port, uint8_t cmd, const uint8_t* value, int len)
+{
+    uint8_t buf[6 + 8];
+
+    return net_write_all(port->fd, buf, rfc2217_command(cmd, value, len, buf));
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int rfc2217_read(serial_port_t* port, uint8_t* buf, int len)
+{
+    int n;
+    uint8_t in[sizeof(port->rx)];
+
+    while(port->rxLen == 0)
+    {
+        n = net_recv(port, in, sizeof(in));
+        if(n < 0)
+            return -1;
+        port->rxHead = 0;
+        port->rxLen = telnet_decode(&port->telnet, in, n, port->rx, rfc2217_option, port);
+    }
+
+    n = (len < port->rxLen) ? len : port->rxLen;
+    memcpy(buf, &port->rx[port->rxHead], n);
+    port->rxHead += n;
+    port->rxLen -= n;
+
+    return n;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Everything is taken, waiting for room in the socket as needed. The doubled 255s would make a
+   partial write hard to account for. */
+static int rfc2217_write(serial_port_t* port, const uint8_t* buf, int len)
+{
+    int i;
+    int n;
+    uint8_t out[2 * 256];
+
+    for(i=0;i<len;i+=n)
+    {
+        n = ((len - i) < 256) ? (len - i) : 256;
+        if(net_write_all(port->fd, out, telnet_escape(&buf[i], n, out)) < 0)
+            return -1;
+    }
+
+    return len;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int rfc2217_set_baud(serial_port_t* port, int baud)
+{
+    uint8_t value[4];
+
+    value[0] = baud >> 24;
+    value[1] = baud >> 16;
+    value[2] = baud >> 8;
+    value[3] = baud;
+
+    return rfc2217_send(port, RFC2217_SET_BAUDRATE, value, sizeof(value));
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int rfc2217_set_flowcontrol(serial_port_t* port, int enable)
+{
+    uint8_t value = enable ? RFC2217_CONTROL_HW_FLOW : RFC2217_CONTROL_NO_FLOW;
+
+    return rfc2217_send(port, RFC2217_SET_CONTROL, &value, 1);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int rfc2217_set_line(serial_port_t* port, int line, int level)
+{
+    uint8_t value;
+
+    if(line == SERIAL_DTR)
+        value = level ? RFC2217_CONTROL_DTR_ON : RFC2217_CONTROL_DTR_OFF;
+    else
+        value = level ? RFC2217_CONTROL_RTS_ON : RFC2217_CONTROL_RTS_OFF;
+
+    return rfc2217_send(port, RFC2217_SET_CONTROL, &value, 1);
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* The server drops what its UART still holds, what is on the network in between comes later */
+static int rfc2217_discard(serial_port_t* port)
+{
+    uint8_t value = RFC2217_PURGE_BOTH;
+
+    tcp_discard(port);
+
+    return rfc2217_send(port, RFC2217_PURGE_DATA, &value, 1);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static int rfc2217_open(serial_port_t* port, const char* path, int baud, char parity)
+{
+    int left;
+    uint8_t value;
+    uint8_t buf[64];
+    struct pollfd pfd;
+    uint64_t deadline;
+    struct timespec now;
+    static const uint8_t hello[] =
+    {
+        TELNET_IAC, TELNET_WILL, TELNET_OPT_COM_PORT,
+        TELNET_IAC, TELNET_WILL, TELNET_OPT_BINARY,
+        TELNET_IAC, TELNET_DO, TELNET_OPT_BINARY,
+        TELNET_IAC, TELNET_WILL, TELNET_OPT_SGA,
+        TELNET_IAC, TELNET_DO, TELNET_OPT_SGA,
+    };
+
+    if((port->fd = net_connect(path)) < 0)
+        return -1;
+
+    net_write_all(port->fd, hello, sizeof(hello));
+
+    rfc2217_set_baud(port, baud);
+    value = 8;
+    rfc2217_send(port, RFC2217_SET_DATASIZE, &value, 1);
+    switch(parity)
+    {
+        case 'o': case 'O': value = RFC2217_PARITY_ODD; break;
+        case 'e': case 'E': value = RFC2217_PARITY_EVEN; break;
+        default: value = RFC2217_PARITY_NONE; break;
+    }
+    rfc2217_send(port, RFC2217_SET_PARITY, &value, 1);
+    value = 1;
+    rfc2217_send(port, RFC2217_SET_STOPSIZE, &value, 1);
+    rfc2217_set_flowcontrol(port, 0);
+
+    /* A plain telnet server would leave the port at its own settings */
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + RFC2217_OPEN_TIMEOUT_MS;
+    pfd.fd = port->fd;
+    pfd.events = POLLIN;
+    while(port->comPort == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = (int)(deadline - ((uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000));
+        if((left <= 0) || (poll(&pfd, 1, left) <= 0))
+            break;
+        if((rfc2217_read(port, buf, sizeof(buf)) < 0) && (errno != EAGAIN))
+            break;
+    }
+
+    if(port->comPort <= 0)
+    {
+        fprintf(stderr, "%s doesn't do RFC 2217 port control, tcp:// talks to it as a raw port\n", path);
+        close(port->fd);
+        return port->fd = -1;
+    }
+
+    return port->fd;
+}
+/*-----------------------------------------------------------------------------------------------*/
+const serial_transport_t serial_rfc2217_transport =
+{
+    "rfc2217://",
+    rfc2217_open,
+    rfc2217_read,
+    rfc2217_write,
+    rfc2217_set_baud,
+    rfc2217_set_flowcontrol,
+    rfc2217_set_line,
+    rfc2217_discard,
+    net_drain,
+};
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,125 @@
+/*-------------------------------------------------------------------------------------------------
+/ Serial ports behind a network hop, the way ser2net style serial servers offer them.
+/
+/ tcp://host:port is a raw byte stream, the server's port settings are fixed. rfc2217://host:port
+/ is telnet with the COM-PORT-OPTION of RFC 2217: data bytes of 255 are doubled, and the client
+/ sets the rate, flow control and the DTR and RTS lines of the server's port with subnegotiations.
+/
+/ serial_lib.c picks a transport by the port path, everything above it keeps using the fd it
+/ returns. serialserver.c is the other end, for testing without a serial server.
+/------------------------------------------------------------------------------------------------*/
+#ifndef SERIAL_NET_H
+#define SERIAL_NET_H
+
+#include <stdint.h>
+
+#define TELNET_SE 240
+#define TELNET_SB 250
+#define TELNET_WILL 251
+#define TELNET_WONT 252
+#define TELNET_DO 253
+#define TELNET_DONT 254
+#define TELNET_IAC 255
+
+#define TELNET_OPT_BINARY 0
+#define TELNET_OPT_SGA 3
+#define TELNET_OPT_COM_PORT 44
+
+/* Client to server, the server answers with the same command plus RFC2217_SERVER */
+#define RFC2217_SET_BAUDRATE 1
+#define RFC2217_SET_DATASIZE 2
+#define RFC2217_SET_PARITY 3
+#define RFC2217_SET_STOPSIZE 4
+#define RFC2217_SET_CONTROL 5
+#define RFC2217_PURGE_DATA 12
+#define RFC2217_SERVER 100
+
+#define RFC2217_PARITY_NONE 1
+#define RFC2217_PARITY_ODD 2
+#define RFC2217_PARITY_EVEN 3
+
+#define RFC2217_CONTROL_NO_FLOW 1
+#define RFC2217_CONTROL_HW_FLOW 3
+#define RFC2217_CONTROL_DTR_ON 8
+#define RFC2217_CONTROL_DTR_OFF 9
+#define RFC2217_CONTROL_RTS_ON 11
+#define RFC2217_CONTROL_RTS_OFF 12
+
+#define RFC2217_PURGE_BOTH 3
+
+#define SERIAL_DTR 0
+#define SERIAL_RTS 1
+
+#define TELNET_SB_MAX 16
+
+typedef struct
+{
+    int state;
+    uint8_t verb;
+    uint8_t sb[TELNET_SB_MAX];
+    int sbLen;
+} telnet_t;
+
+/* Gets WILL, WONT, DO and DONT with their option, and TELNET_SB with a whole subnegotiation,
+   option first */
+typedef void (*telnet_cb)(void* ctx, uint8_t verb, const uint8_t* args, int len);
+
+/* Takes the telnet commands out of in, the data bytes go to out, which may be in. Returns their
+   count. Commands split over several calls are put together. */
+int telnet_decode(telnet_t* t, const uint8_t* in, int len, uint8_t* out, telnet_cb cb, void* ctx);
+
+/* Doubles the bytes of 255, out needs room for 2 * len. Returns the length of out. */
+int telnet_escape(const uint8_t* in, int len, uint8_t* out);
+
+/* IAC SB COM-PORT-OPTION cmd value IAC SE, out needs room for 6 + 2 * len */
+int rfc2217_command(uint8_t cmd, const uint8_t* value, int len, uint8_t* out);
+
+/* Writes all of buf to a non-blocking socket, waiting for room as needed */
+int net_write_all(int fd, const uint8_t* buf, int len);
+
+/* Connects to host:port with TCP_NODELAY, the socket is non-blocking. -1 on failure. */
+int net_connect(const char* hostPort);
+
+/* Listens on port of the loopback interface */
+int net_listen(int port);
+
+/* Transport of a port path with its fd and what it keeps per port. The termios one is in
+   serial_lib.c, it is also used for fds which didn't come from serialport_init(). */
+typedef struct serial_port serial_port_t;
+
+typedef struct
+{
+    const char* scheme;     /* the path prefix, NULL for device nodes */
+    int (*open)(serial_port_t* port, const char* path, int baud, char parity);
+    /* Like read(2) on a non-blocking fd, -1 with EAGAIN when there is nothing */
+    int (*read)(serial_port_t* port, uint8_t* buf, int len);
+    /* Like write(2) on a non-blocking fd */
+    int (*write)(serial_port_t* port, const uint8_t* buf, int len);
+    /* A server applies it when the bytes before it have left its UART */
+    int (*set_baud)(serial_port_t* port, int baud);
+    int (*set_flowcontrol)(serial_port_t* port, int enable);
+    /* SERIAL_DTR or SERIAL_RTS */
+    int (*set_line)(serial_port_t* port, int line, int level);
+    /* Drops what is queued in both directions */
+    int (*discard)(serial_port_t* port);
+    /* Waits until what was written has left */
+    int (*drain)(serial_port_t* port);
+} serial_transport_t;
+
+struct serial_port
+{
+    int fd;
+    const serial_transport_t* transport;
+    telnet_t telnet;
+    /* 1 once the server answered a port command, -1 if it refused the option */
+    int comPort;
+    /* Data bytes decoded already but not asked for yet */
+    uint8_t rx[512];
+    int rxHead;
+    int rxLen;
+};
+
+extern const serial_transport_t serial_tcp_transport;
+extern const serial_transport_t serial_rfc2217_transport;
+
+#endif /* SERIAL_NET_H */
@@ -0,0 +1,389 @@
+/*-------------------------------------------------------------------------------------------------
+/ A serial server on the loopback interface, the way ser2net offers a port, for trying the tcp://
+/ and rfc2217:// ports of the host without a fixture behind a real one.
+/
+/ One client at a time. In RFC 2217 mode the client's baud rate, flow control, DTR, RTS and purge
+/ commands are applied to the port in order with the data around them, and answered. -L holds
+/ everything back for the given time in each direction, like a network hop would.
+/
+/ Usage: serialserver [-t] [-L ms] [-P port] [-b baud] [-v] <serial port>
+/   -t: raw TCP, the port stays at -b
+/   -L: one way latency in ms
+/   -P: TCP port to listen on, 2217 by default
+/   -b: rate the port starts at, LINK_BAUD by default
+/   -v: print every command
+/------------------------------------------------------------------------------------------------*/
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "serial_lib.h"
+#include "serial_net.h"
+/*-----------------------------------------------------------------------------------------------*/
+#ifndef LINK_BAUD
+#define LINK_BAUD 115200
+#endif
+#define DEFAULT_PORT 2217
+/* Chunks on their way in each direction, and bytes per chunk */
+#define QUEUE_CHUNKS 4096
+#define CHUNK_MAX 256
+/*-----------------------------------------------------------------------------------------------*/
+/* Towards the port a chunk holds data or one port command, towards the client wire bytes */
+typedef struct
+{
+    uint64_t due;
+    int cmd;             /* RFC2217_ command, 0 for data */
+    int len;
+    uint8_t data[CHUNK_MAX];
+} chunk_t;
+/*-----------------------------------------------------------------------------------------------*/
+typedef struct
+{
+    chunk_t chunks[QUEUE_CHUNKS];
+    int head;
+    int count;
+} queue_t;
+/*-----------------------------------------------------------------------------------------------*/
+static queue_t toPort;
+static queue_t toClient;
+static int serialFd = -1;
+static int client = -1;
+static int raw = 0;
+static int verbose = 0;
+static int startBaud = LINK_BAUD;
+static uint64_t latencyNs = 0;
+/* Options the client was told we do, each is confirmed once */
+static uint8_t agreed[256];
+/* Data decoded from the client which isn't queued yet */
+static uint8_t pending[CHUNK_MAX];
+static int pendingLen = 0;
+/*-----------------------------------------------------------------------------------------------*/
+static uint64_t nowNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static chunk_t* queue_push(queue_t* q, int cmd)
+{
+    chunk_t* c;
+
+    if(q->count == QUEUE_CHUNKS)
+        return NULL;
+
+    c = &q->chunks[(q->head + q->count) % QUEUE_CHUNKS];
+    q->count++;
+
+    c->due = nowNs() + latencyNs;
+    c->cmd = cmd;
+    c->len = 0;
+    return c;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void queue_data(queue_t* q, const uint8_t* buf, int len)
+{
+    int n;
+    chunk_t* c;
+
+    while(len > 0)
+    {
+        if((c = queue_push(q, 0)) == NULL)
+            return;
+        n = (CHUNK_MAX < len) ? CHUNK_MAX : len;
+        memcpy(&c->data[c->len], buf, n);
+        c->len += n;
+        buf += n;
+        len -= n;
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void reply(uint8_t cmd, const uint8_t* value, int len)
+{
+    uint8_t buf[6 + 2 * TELNET_SB_MAX];
+
+    queue_data(&toClient, buf, rfc2217_command(cmd + RFC2217_SERVER, value, len, buf));
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void negotiate(uint8_t verb, uint8_t opt)
+{
+    uint8_t buf[3];
+    const int ours = (opt == TELNET_OPT_BINARY) || (opt == TELNET_OPT_SGA) || (opt == TELNET_OPT_COM_PORT);
+
+    buf[0] = TELNET_IAC;
+    buf[2] = opt;
+
+    /* Each side only says it once, so agreeing can't turn into a loop */
+    if((verb == TELNET_DO) || (verb == TELNET_WILL))
+    {
+        if(ours && (agreed[opt] & (1 << (verb == TELNET_DO))))
+            return;
+        if(ours)
+            agreed[opt] |= 1 << (verb == TELNET_DO);
+
+        if(verb == TELNET_DO)
+            buf[1] = ((opt != TELNET_OPT_COM_PORT) && ours) ? TELNET_WILL : TELNET_WONT;
+        else
+            buf[1] = ours ? TELNET_DO : TELNET_DONT;
+        queue_data(&toClient, buf, sizeof(buf));
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void onTelnet(void* ctx, uint8_t verb, const uint8_t* args, int len)
+{
+    chunk_t* c;
+
+    if(verb != TELNET_SB)
+    {
+        negotiate(verb, args[0]);
+        return;
+    }
+
+    if((args[0] != TELNET_OPT_COM_PORT) || (len < 2))
+        return;
+
+    /* Goes to the port in order with the data */
+    queue_data(&toPort, pending, pendingLen);
+    pendingLen = 0;
+    if((c = queue_push(&toPort, args[1])) == NULL)
+        return;
+    c->len = len - 2;
+    memcpy(c->data, &args[2], len - 2);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void applyCommand(const chunk_t* c)
+{
+    int baud;
+    uint8_t value = c->len ? c->data[0] : 0;
+
+    switch(c->cmd)
+    {
+        case RFC2217_SET_BAUDRATE:
+        {
+            if(c->len < 4)
+                return;
+            baud = (c->data[0] << 24) | (c->data[1] << 16) | (c->data[2] << 8) | c->data[3];
+            if(baud != 0)
+                serialport_set_baud(serialFd, baud);
+            if(verbose)
+                printf("> Baud rate %d\n",baud);
+            break;
+        }
+        case RFC2217_SET_CONTROL:
+        {
+            if((value == RFC2217_CONTROL_NO_FLOW) || (value == RFC2217_CONTROL_HW_FLOW))
+                serialport_set_flowcontrol(serialFd, value == RFC2217_CONTROL_HW_FLOW);
+            else if((value == RFC2217_CONTROL_DTR_ON) || (value == RFC2217_CONTROL_DTR_OFF))
+                serialport_set_dtr(serialFd, value == RFC2217_CONTROL_DTR_ON);
+            else if((value == RFC2217_CONTROL_RTS_ON) || (value == RFC2217_CONTROL_RTS_OFF))
+                serialport_set_rts(serialFd, value == RFC2217_CONTROL_RTS_ON);
+            if(verbose)
+                printf("> Control %d\n",value);
+            break;
+        }
+        case RFC2217_PURGE_DATA:
+        {
+            serialport_discard(serialFd);
+            if(verbose)
+                printf("> Purge\n");
+            break;
+        }
+        default:
+        {
+            /* Data size, parity and stop bits stay at 8N1 */
+            if(verbose)
+                printf("> Command %d\n",c->cmd);
+            break;
+        }
+    }
+
+    reply(c->cmd, c->data, c->len);
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void fromClient(void)
+{
+    int i;
+    int n;
+    uint8_t b;
+    uint8_t buf[CHUNK_MAX];
+    static telnet_t telnet;
+
+    n = recv(client, buf, sizeof(buf), 0);
+    if(n <= 0)
+    {
+        if((n < 0) && ((errno == EAGAIN) || (errno == EINTR)))
+            return;
+        printf("> Client left\n");
+        close(client);
+        client = -1;
+        memset(&telnet, 0, sizeof(telnet));
+        return;
+    }
+
+    if(raw)
+    {
+        queue_data(&toPort, buf, n);
+        return;
+    }
+
+    /* A byte at a time, commands have to stay in order with the data around them */
+    for(i=0;i<n;i++)
+    {
+        if(telnet_decode(&telnet, &buf[i], 1, &b, onTelnet, NULL) == 1)
+            pending[pendingLen++] = b;
+    }
+    queue_data(&toPort, pending, pendingLen);
+    pendingLen = 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+static void fromPort(void)
+{
+    int n;
+    uint8_t buf[CHUNK_MAX / 2];
+    uint8_t out[CHUNK_MAX];
+
+    while((n = read(serialFd, buf, sizeof(buf))) > 0)
+    {
+        if(client < 0)
+            continue;
+        if(raw)
+            queue_data(&toClient, buf, n);
+        else
+            queue_data(&toClient, out, telnet_escape(buf, n, out));
+    }
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Sends what is due, returns ms until the next chunk is, -1 if there is none */
+static int deliver(void)
+{
+    int64_t left;
+    chunk_t* c;
+
+    while(toPort.count > 0)
+    {
+        c = &toPort.chunks[toPort.head];
+        if(c->due > nowNs())
+            break;
+        if(c->cmd != 0)
+            applyCommand(c);
+        else
+            serialport_writebuf(serialFd, c->data, c->len);
+        toPort.head = (toPort.head + 1) % QUEUE_CHUNKS;
+        toPort.count--;
+    }
+
+    while(toClient.count > 0)
+    {
+        c = &toClient.chunks[toClient.head];
+        if(c->due > nowNs())
+            break;
+        if(client >= 0)
+            net_write_all(client, c->data, c->len);
+        toClient.head = (toClient.head + 1) % QUEUE_CHUNKS;
+        toClient.count--;
+    }
+
+    left = INT64_MAX;
+    if(toPort.count > 0)
+        left = toPort.chunks[toPort.head].due - nowNs();
+    if((toClient.count > 0) && ((int64_t)(toClient.chunks[toClient.head].due - nowNs()) < left))
+        left = toClient.chunks[toClient.head].due - nowNs();
+
+    if(left == INT64_MAX)
+        return -1;
+    return (left <= 0) ? 0 : (int)((left + 999999) / 1000000);
+}
+/*-----------------------------------------------------------------------------------------------*/
+int main(int argc, char** argv)
+{
+    int opt;
+    int listenFd;
+    int timeout;
+    int port = DEFAULT_PORT;
+    struct pollfd pfd[2];
+
+    while((opt = getopt(argc, argv, "tL:P:b:v")) != -1)
+    {
+        switch(opt)
+        {
+            case 't': raw = 1; break;
+            case 'L': latencyNs = (uint64_t)(atof(optarg) * 1e6); break;
+            case 'P': port = atoi(optarg); break;
+            case 'b': startBaud = atoi(optarg); break;
+            case 'v': verbose = 1; break;
+            default:
+                printf("Usage: %s [-t] [-L ms] [-P port] [-b baud] [-v] <serial port>\n",argv[0]);
+                return 1;
+        }
+    }
+
+    if(optind >= argc)
+    {
+        printf("Usage: %s [-t] [-L ms] [-P port] [-b baud] [-v] <serial port>\n",argv[0]);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if((serialFd = serialport_init(argv[optind], startBaud, 'n')) < 0)
+    {
+        printf("[err]: Couldn't open %s\n",argv[optind]);
+        return 1;
+    }
+
+    if((listenFd = net_listen(port)) < 0)
+    {
+        printf("[err]: Couldn't listen on port %d\n",port);
+        return 1;
+    }
+
+    printf("> %s on %s://127.0.0.1:%d, %.1f ms each way\n",argv[optind],raw ? "tcp" : "rfc2217",port,latencyNs / 1e6);
+
+    while(1)
+    {
+        timeout = deliver();
+
+        pfd[0].fd = serialFd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = (client >= 0) ? client : listenFd;
+        /* A full queue holds the client back, TCP does the rest. One read takes up to a chunk per
+           byte. */
+        pfd[1].events = (toPort.count < QUEUE_CHUNKS - CHUNK_MAX) ? POLLIN : 0;
+
+        if(poll(pfd, 2, timeout) <= 0)
+            continue;
+
+        if(pfd[0].revents & POLLIN)
+            fromPort();
+
+        if(!(pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+
+        if(client >= 0)
+        {
+            fromClient();
+            continue;
+        }
+
+        if((client = accept(listenFd, NULL, NULL)) < 0)
+            continue;
+
+        printf("> Client connected\n");
+        memset(agreed, 0, sizeof(agreed));
+        toPort.count = 0;
+        toClient.count = 0;
+        serialport_set_baud(serialFd, startBaud);
+        serialport_set_flowcontrol(serialFd, 0);
+    }
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,508 @@
+/*-------------------------------------------------------------------------------------------------
+/ tealoaderd - keeps the serial port open and the target in the bootloader between flashes.
+/
+/ Jobs come in over a Unix socket as one line, "FLASH <absolute path> run|hold". The output of the
+/ job goes back over the same connection and ends with "@OK" or "@FAIL". While idle the target is
+/ pinged often enough to keep the bootloader's watchdog from starting the application. The last
+/ parsed image stays in memory and the last flashed one is used as the base of an incremental
+/ upload, so a reflash only sends the pages which changed.
+/------------------------------------------------------------------------------------------------*/
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "serial_lib.h"
+#include "hexcache.h"
+#include "image.h"
+#include "loader.h"
+#include "tune.h"
+#include "log.h"
+/*-----------------------------------------------------------------------------------------------*/
+#ifdef __APPLE__
+    #define st_mtim st_mtimespec
+#endif
+/*-----------------------------------------------------------------------------------------------*/
+int fd = -1;
+int listenFd = -1;
+int inBootloader = 0;
+int lowLatency = 0;
+char* appCommand = NULL;
+volatile sig_atomic_t quit = 0;
+const char* socketPath = NULL;
+char portPath[256];
+/*-----------------------------------------------------------------------------------------------*/
+/* Last parsed file, reused as long as it doesn't change on disk */
+tl_image image;
+char imagePath[4096];
+struct timespec imageMtime;
+off_t imageSize = -1;
+/*-----------------------------------------------------------------------------------------------*/
+/* What the device holds, valid after a successful job */
+tl_image deviceImage;
+int haveDeviceImage = 0;
+/*-----------------------------------------------------------------------------------------------*/
+/* Incremental frames are built here, image keeps its full frames for the next job */
+tl_image jobImage;
+/*-----------------------------------------------------------------------------------------------*/
+int openSocket(const char* path);
+int enterBootloader(int fd);
+int prepareImage(char* path);
+int flashImage(char* path, int hold);
+void serveClient(int client);
+void onSignal(int sig);
+/*-----------------------------------------------------------------------------------------------*/
+int main(int argc, char *argv[])
+{
+    int c;
+    int err = 0;
+    int gotPort = 0;
+    int client;
+    struct pollfd pfd;
+
+    while ((c = getopt(argc, argv, "p:s:cvrla:")) != -1)
+    {
+        switch (c)
+        {
+            case 'p':
+            {
+                gotPort = 1;
+                snprintf(portPath,sizeof(portPath),"%s",optarg);
+                break;
+            }
+            case 's':
+            {
+                socketPath = optarg;
+                break;
+            }
+            case 'c':
+            {
+                useCache = 1;
+                break;
+            }
+            case 'v':
+            {
+                verbose = 1;
+                break;
+            }
+            case 'r':
+            {
+                flowControl = 1;
+                break;
+            }
+            case 'l':
+            {
+                lowLatency = 1;
+                break;
+            }
+            case 'a':
+            {
+                appCommand = optarg;
+                break;
+            }
+            default:
+            {
+                err = 1;
+                break;
+            }
+        }
+    }
+
+    if((err==1) || (gotPort==0))
+    {
+        log_printf("Usage: %s [-p <portPath>] [-s <socket>] [-c] [-v] [-r] [-l] [-a <command>]\n",argv[0]);
+        log_printf("       -s: socket to listen on, default $TEALOADER_SOCKET or /tmp/tealoaderd-<uid>.sock\n");
+        log_printf("       -c: cache parsed images (in $TEALOADER_CACHE or ~/.cache/tealoader)\n");
+        log_printf("       -v: verbose output\n");
+        log_printf("       -r: RTS/CTS flow control during uploads, needs a FLOW_CONTROL=1 bootloader\n");
+        log_printf("       -l: lower the USB serial latency timer, restored on exit\n");
+        log_printf("       -a: command which makes the application start the bootloader, tried before RTS/DTR\n");
+        log_printf("Jobs are sent with: tealoader -d <socket> -f <fileName> [-k]\n");
+        return 1;
+    }
+
+    if(socketPath == NULL)
+        socketPath = loader_default_socket();
+
+    /* A client going away in the middle of a job must not take the daemon with it */
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    /* The log thread flushes after every batch, so progress reaches the client as it is printed */
+    log_start();
+
+    fd = connectDevice(portPath);
+    if(fd < 0)
+    {
+        return 1;
+    }
+
+    /* The only full flush, later resets don't need to wait for stale bytes to arrive */
+    serialport_flush(fd);
+
+    if(enterBootloader(fd) == 0)
+    {
+        log_printf("> Target didn't answer, it will be reset again with the first job\n");
+    }
+    else if(lowLatency)
+    {
+        tuneLatency(fd);
+    }
+
+    listenFd = openSocket(socketPath);
+    if(listenFd < 0)
+    {
+        serialport_close(fd);
+        return 1;
+    }
+
+    log_printf("> Listening on %s\n",socketPath);
+
+    pfd.fd = listenFd;
+    pfd.events = POLLIN;
+
+    while(!quit)
+    {
+        if(poll(&pfd, 1, KEEPALIVE_MS) <= 0)
+        {
+            if(inBootloader && (keepAlive(fd) == 0))
+            {
+                log_printf("> Target left the bootloader\n");
+                inBootloader = 0;
+            }
+            continue;
+        }
+
+        client = accept(listenFd, NULL, NULL);
+        if(client < 0)
+        {
+            continue;
+        }
+
+        serveClient(client);
+        close(client);
+    }
+
+    log_printf("> Exiting\n");
+
+    close(listenFd);
+    unlink(socketPath);
+
+    /* Leave the device running whatever it has */
+    if(inBootloader)
+        serialport_writebyte(fd,'x');
+    serialport_close(fd);
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int openSocket(const char* path)
+{
+    int s;
+    struct sockaddr_un addr;
+
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        log_printf("[err]: Socket path is too long: %s\n",path);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(s < 0)
+    {
+        perror("socket");
+        return -1;
+    }
+
+    /* A stale socket from a daemon that didn't exit cleanly */
+    unlink(path);
+
+    if((bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(s, 4) < 0))
+    {
+        log_printf("[err]: Couldn't listen on %s: %s\n",path,strerror(errno));
+        close(s);
+        return -1;
+    }
+
+    chmod(path, 0600);
+
+    return s;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int enterBootloader(int fd)
+{
+    /* A fresh bootloader talks at LINK_BAUD, whatever the last job switched to */
+    if(baudRate != LINK_BAUD)
+    {
+        serialport_set_baud(fd, LINK_BAUD);
+        baudRate = LINK_BAUD;
+    }
+
+    if((appCommand != NULL) && enterFromApp(fd, appCommand))
+    {
+        log_printf("> Application handed over to the bootloader\n");
+    }
+    else
+    {
+        /* Whatever the application printed since the last job */
+        serialport_discard(fd);
+
+        resetDevice(fd);
+
+        if(sendPing(fd) <= 0)
+        {
+            if(verbose)
+                log_printf("[err]: Ping problem\n");
+            return 0;
+        }
+    }
+
+    log_printf("> Ping OK\n");
+
+    fwVersion = getVersion(fd);
+    log_printf("> Firmware version: %d\n",fwVersion);
+
+    /* Saved with tealoader -T for this adapter */
+    tune_apply(fd, portPath);
+    coverNetworkLatency(fd);
+
+    inBootloader = 1;
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Parses path into image unless it is the file parsed last time and it didn't change since */
+int prepareImage(char* path)
+{
+    struct stat st;
+
+    if(stat(path, &st) < 0)
+    {
+        log_printf("[err]: Couldn't open %s\n",path);
+        return 0;
+    }
+
+    if((imageSize == st.st_size) &&
+       (imageMtime.tv_sec == st.st_mtim.tv_sec) && (imageMtime.tv_nsec == st.st_mtim.tv_nsec) &&
+       (strcmp(imagePath, path) == 0))
+    {
+        if(verbose)
+            log_printf("[dbg]: %s didn't change, using the parsed image\n",path);
+        return 1;
+    }
+
+    imageSize = -1;
+
+    if(loadImage(path, &image) == 0)
+    {
+        return 0;
+    }
+
+    /* A cache hit maps the frames, the daemon would collect one mapping per reload otherwise */
+    hexcache_detach(&image);
+
+    if(image.startAddress != 0)
+    {
+        log_printf("> You should change the startAddress = 0 assumption\n");
+        return 0;
+    }
+
+    if(image.endAddress > APP_SECTION_SIZE)
+    {
+        log_printf("Program size is too big!\n");
+        return 0;
+    }
+
+    snprintf(imagePath, sizeof(imagePath), "%s", path);
+    imageMtime = st.st_mtim;
+    imageSize = st.st_size;
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int flashImage(char* path, int hold)
+{
+    int ok;
+    const tl_image* img = &image;
+    uint64_t t0;
+
+    if(prepareImage(path) == 0)
+    {
+        return 0;
+    }
+
+    /* Waiting for the job and parsing it may have taken longer than the watchdog runs */
+    if(inBootloader && (keepAlive(fd) == 0))
+    {
+        log_printf("> Target left the bootloader\n");
+        inBootloader = 0;
+    }
+
+    if(inBootloader)
+    {
+        log_printf("> Target is waiting in the bootloader\n");
+    }
+    else if(enterBootloader(fd) == 0)
+    {
+        log_printf("[err]: Ping problem\n");
+        return 0;
+    }
+
+    /* Older bootloaders only know 'b' and 'c' */
+    frameType = (fwVersion < WRITE_FRAME_VERSION) ? FRAME_LEGACY : FRAME_WRITE;
+    if(image.frameType != frameType)
+    {
+        image.frameType = frameType;
+        image_build_frames(&image);
+    }
+
+    if(flowControl && (serialport_set_flowcontrol(fd, 1) < 0))
+    {
+        log_printf("[err]: Couldn't enable RTS/CTS flow control\n");
+        return 0;
+    }
+
+    /* Until this job succeeds nobody knows what is in the flash */
+    if(haveDeviceImage && (fwVersion >= PATCH_VERSION))
+    {
+        haveDeviceImage = 0;
+        memcpy(&jobImage, &image, sizeof(jobImage));
+        buildPatch(fd, &deviceImage, &jobImage);
+        img = &jobImage;
+    }
+    else
+    {
+        haveDeviceImage = 0;
+        if(eraseDevice(fd) == 0)
+        {
+            serialport_set_flowcontrol(fd, 0);
+            return 0;
+        }
+    }
+
+    memset(&hostStats, 0, sizeof(hostStats));
+    pagesDone = 0;
+    pagesTotal = img->frameCount;
+
+    /* A full upload is picked up again after a lost ACK. Patches build on pages which may be half
+       written by then, a failed one leaves the next job to start with an erase. */
+    t0 = nowNs();
+    if((img == &image) && (fwVersion >= RESUME_VERSION))
+        ok = uploadResumable(fd, img, 0, NULL, NULL);
+    else
+        ok = uploadFrames(fd, img->frames, img->frameCount);
+
+    if(ok == 0)
+    {
+        serialport_set_flowcontrol(fd, 0);
+        log_printf("\n[err]: Upload failed at page %d of %d\n",pagesDone,pagesTotal);
+        return 0;
+    }
+    hostStats.uploadNs = nowNs() - t0;
+
+    /* The reset lines are ours again */
+    serialport_set_flowcontrol(fd, 0);
+
+    memcpy(deviceImage.data, image.data, sizeof(deviceImage.data));
+    deviceImage.startAddress = image.startAddress;
+    deviceImage.endAddress = image.endAddress;
+    haveDeviceImage = 1;
+
+    log_printf("> Uploading: %c%d, %d frames in %.3f s\n",'%',100,pagesTotal,hostStats.uploadNs / 1e9);
+
+    if(hold)
+    {
+        log_printf("> Holding the target in the bootloader\n");
+    }
+    else
+    {
+        log_printf("> Jumping to the user application\n");
+        serialport_writebyte(fd,'x');
+        inBootloader = 0;
+    }
+
+    return 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Runs one job with stdout pointed at the client */
+void serveClient(int client)
+{
+    int n;
+    int got;
+    int ok = 0;
+    int saved;
+    int hold;
+    char* path;
+    char* mode;
+    char* end;
+    char line[4200];
+    int64_t left;
+    uint64_t deadline;
+    struct pollfd pfd;
+
+    /* No pings go out meanwhile, so the whole line has to be in within one keepalive period. A
+       client which trickles it in gets its job turned down. */
+    deadline = nowNs() + KEEPALIVE_MS * 1000000ULL;
+    pfd.fd = client;
+    pfd.events = POLLIN;
+
+    n = 0;
+    end = NULL;
+    while((end == NULL) && (n < (int)sizeof(line) - 1))
+    {
+        left = ((int64_t)(deadline - nowNs())) / 1000000;
+        if((left <= 0) || (poll(&pfd, 1, left) <= 0))
+            break;
+        got = read(client, &line[n], sizeof(line) - 1 - n);
+        if(got <= 0)
+            break;
+        line[n + got] = 0;
+        end = strchr(&line[n], '\n');
+        n += got;
+    }
+    line[(end != NULL) ? (end - line) : n] = 0;
+
+    mode = strrchr(line, ' ');
+    if((strncmp(line, "FLASH ", 6) != 0) || (mode == NULL) || (mode < line + 6))
+    {
+        log_printf("> Bad job: \"%s\"\n",line);
+        dprintf(client, "> Bad job\n@FAIL\n");
+        return;
+    }
+
+    *mode++ = 0;
+    path = line + 6;
+    hold = (strcmp(mode, "hold") == 0);
+
+    log_printf("> Job: %s (%s)\n",path,mode);
+
+    /* Everything logged before the job belongs to the daemon's own stdout */
+    log_flush();
+    saved = dup(1);
+    dup2(client, 1);
+
+    ok = flashImage(path, hold);
+    log_printf(ok ? "@OK\n" : "@FAIL\n");
+    log_flush();
+
+    dup2(saved, 1);
+    close(saved);
+
+    log_printf("> Job %s\n",ok ? "done" : "failed");
+}
+/*-----------------------------------------------------------------------------------------------*/
+void onSignal(int sig)
+{
+    quit = 1;
+}
+/*-----------------------------------------------------------------------------------------------*/
@@ -0,0 +1,372 @@
+/*-------------------------------------------------------------------------------------------------
+/ Link tuning: baud rate and stream window per fixture.
+/------------------------------------------------------------------------------------------------*/
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "serial_lib.h"
+#include "hexcache.h"
+#include "image.h"
+#include "crc.h"
+#include "loader.h"
+#include "tune.h"
+#include "log.h"
+/*-----------------------------------------------------------------------------------------------*/
+/* Same order as the bootloader's table, the index goes out with 'u' */
+static const int bauds[] = { 115200, 230400, 460800, 921600, 500000, 1000000, 2000000 };
+#define BAUD_COUNT ((int)(sizeof(bauds) / sizeof(bauds[0])))
+
+/* Stream windows tried with flow control, without it the upload is stop and wait */
+static const int windows[] = { 1, 2, 4, 8 };
+#define WINDOW_COUNT ((int)(sizeof(windows) / sizeof(windows[0])))
+/*-----------------------------------------------------------------------------------------------*/
+int tune_baud_index(int baud)
+{
+    int i;
+
+    for(i=0;i<BAUD_COUNT;i++)
+    {
+        if(bauds[i] == baud)
+            return i;
+    }
+
+    return -1;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int tune_switch_baud(int fd, int baud)
+{
+    int old = baudRate;
+    int index = tune_baud_index(baud);
+    uint8_t cmd[2];
+
+    if(index < 0)
+    {
+        log_printf("[err]: The bootloader can't do %d baud\n",baud);
+        return 0;
+    }
+
+    if(baud == baudRate)
+    {
+        return 1;
+    }
+
+    /* A raw TCP port stays at the rate its serial server was set up with */
+    if(serialport_set_baud(fd, old) < 0)
+    {
+        return 0;
+    }
+
+    trace_begin("baud", baud);
+
+    cmd[0] = 'u';
+    cmd[1] = index;
+    serialport_writebuf(fd, cmd, 2);
+    if(readACK(fd) <= 0)
+    {
+        trace_end("baud");
+        return 0;
+    }
+
+    /* The ACK was the last byte at the old rate, the first ping at the new one confirms it */
+    serialport_set_baud(fd, baud);
+    if(measureAckRtt(fd, 1) >= 0)
+    {
+        baudRate = baud;
+        trace_end("baud");
+        return 1;
+    }
+
+    /* The bootloader goes back by itself once it has waited long enough */
+    serialport_set_baud(fd, old);
+    usleep(2 * TUNE_PROBE_MS * 1000);
+    serialport_discard(fd);
+
+    if(measureAckRtt(fd, 1) < 0)
+    {
+        log_printf("[err]: Lost the bootloader while trying %d baud\n",baud);
+    }
+
+    trace_end("baud");
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Writes the frames with up to window of them in flight and returns the number of errors, each
+   missing ACK ends the run */
+static int sendWindowed(int fd, const tl_frame* frames, int count, int window)
+{
+    int res;
+    int sent = 0;
+    int pending = 0;
+    int errors = 0;
+
+    while((sent < count) || (pending > 0))
+    {
+        if((sent < count) && (pending < (window * frame_acks(&frames[sent]))))
+        {
+            serialport_writebuf(fd, frames[sent].bytes, frames[sent].length);
+            pending += frame_acks(&frames[sent]);
+            sent++;
+            continue;
+        }
+
+        res = readACK(fd);
+        if(res == ACK_VERIFY)
+        {
+            errors++;
+        }
+        else if(res < 0)
+        {
+            return errors + 1 + (count - sent);
+        }
+        pending--;
+    }
+
+    return errors;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Bytes per second of page writes at the current rate, *errors gets everything that went wrong */
+static double measure(int fd, const tl_frame* frames, int window, int* errors)
+{
+    int i;
+    uint64_t t0;
+    double secs;
+    uint16_t crcs[TUNE_FRAMES];
+    deviceStats_t before;
+    deviceStats_t after;
+
+    *errors = 0;
+
+    if(getDeviceStats(fd, &before) < 0)
+    {
+        *errors = 1;
+        return 0.0;
+    }
+
+    t0 = nowNs();
+    *errors += sendWindowed(fd, frames, TUNE_FRAMES, window);
+    secs = (nowNs() - t0) / 1e9;
+
+    /* A missing ACK leaves the device somewhere in the middle of a frame */
+    if(*errors > 0)
+    {
+        resyncDevice(fd);
+    }
+
+    /* Corrupted bytes in either direction show up in the CRCs */
+    if(readPageCrcs(fd, 0, TUNE_FRAMES, crcs) == 0)
+    {
+        (*errors)++;
+    }
+    else
+    {
+        for(i=0;i<TUNE_FRAMES;i++)
+        {
+            if(crcs[i] != frames[i].crc)
+                (*errors)++;
+        }
+    }
+
+    if(getDeviceStats(fd, &after) < 0)
+    {
+        (*errors)++;
+    }
+    else
+    {
+        *errors += (uint16_t)(after.overruns - before.overruns);
+        *errors += (uint16_t)(after.frameErrors - before.frameErrors);
+        *errors += (uint16_t)(after.dropped - before.dropped);
+    }
+
+    return (secs > 0) ? (TUNE_FRAMES * PAGE_SIZE / secs) : 0.0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int tune_calibrate(int fd, tune_link_t* best)
+{
+    int i;
+    int b;
+    int w;
+    int errors;
+    int found = 0;
+    uint32_t seed = 0x7EA10ADB;
+    double rtt;
+    double rate;
+    double bestRate = 0.0;
+    uint8_t page[PAGE_SIZE];
+    static tl_frame frames[TUNE_FRAMES];
+
+    /* Pseudo random pages, runs of one value would hide bit errors */
+    for(i=0;i<TUNE_FRAMES;i++)
+    {
+        for(w=0;w<PAGE_SIZE;w++)
+        {
+            seed = seed * 1103515245 + 12345;
+            page[w] = seed >> 16;
+        }
+        image_encode_frame(&frames[i], FRAME_WRITE, page, i * PAGE_SIZE);
+    }
+
+    best->baud = LINK_BAUD;
+    best->window = STREAM_WINDOW;
+
+    if(flowControl)
+    {
+        serialport_set_flowcontrol(fd, 1);
+    }
+
+    for(b=0;b<BAUD_COUNT;b++)
+    {
+        if(tune_switch_baud(fd, bauds[b]) == 0)
+        {
+            log_printf("> Tune %7d baud: no answer\n",bauds[b]);
+            continue;
+        }
+
+        rtt = measureAckRtt(fd, TUNE_PINGS);
+
+        for(w=0;w<(flowControl ? WINDOW_COUNT : 1);w++)
+        {
+            rate = measure(fd, frames, windows[w], &errors);
+            if(rtt < 0)
+                errors++;
+
+            log_printf("> Tune %7d baud, window %d: ACK %.3f ms, %.0f bytes/s, %d errors\n",
+                bauds[b], windows[w], rtt, rate, errors);
+
+            if((errors == 0) && (rate > bestRate))
+            {
+                bestRate = rate;
+                best->baud = bauds[b];
+                best->window = windows[w];
+                found = 1;
+            }
+        }
+
+        if(tune_switch_baud(fd, LINK_BAUD) == 0)
+        {
+            /* Both sides should be back at LINK_BAUD by now, or the board needs a reset */
+            serialport_set_baud(fd, LINK_BAUD);
+            baudRate = LINK_BAUD;
+            if(resyncDevice(fd) == 0)
+            {
+                break;
+            }
+        }
+    }
+
+    if(flowControl)
+    {
+        serialport_set_flowcontrol(fd, 0);
+    }
+
+    if(found)
+    {
+        log_printf("> Tune: %d baud, window %d, %.0f bytes/s\n",best->baud,best->window,bestRate);
+    }
+    else
+    {
+        log_printf("[err]: Tune: no setting went through without errors\n");
+    }
+
+    return found;
+}
+/*-----------------------------------------------------------------------------------------------*/
+/* Settings sit next to the image cache, named after the hash of the adapter's serial number or,
+   for adapters without one, of the canonical port path */
+static int settingsPath(const char* port, char* out, size_t len, char* key, size_t keyLen)
+{
+    char serial[128];
+    const char* dir = hexcache_default_dir();
+
+    if(dir == NULL)
+        return -1;
+
+    if(serialport_usb_serial(port, serial, sizeof(serial)))
+        snprintf(key, keyLen, "usb:%s", serial);
+    else if(realpath(port, key) == NULL)
+        snprintf(key, keyLen, "%s", port);
+
+    snprintf(out, len, "%s/%016llx.tll", dir,
+        (unsigned long long)fnv1a64(FNV64_INIT, key, strlen(key)));
+
+    return 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int tune_load(const char* port, tune_link_t* link)
+{
+    FILE* in;
+    int n = 0;
+    char line[256];
+    char key[PATH_MAX];
+    char path[PATH_MAX];
+
+    if((settingsPath(port, path, sizeof(path), key, sizeof(key)) < 0) || ((in = fopen(path, "r")) == NULL))
+        return 0;
+
+    link->baud = LINK_BAUD;
+    link->window = STREAM_WINDOW;
+
+    while(fgets(line, sizeof(line), in) != NULL)
+    {
+        n += (sscanf(line, "baud %d", &link->baud) == 1);
+        n += (sscanf(line, "window %d", &link->window) == 1);
+    }
+    fclose(in);
+
+    if((tune_baud_index(link->baud) < 0) || (link->window < 1))
+    {
+        log_printf("> Ignoring broken link settings in %s\n",path);
+        return 0;
+    }
+
+    return n > 0;
+}
+/*-----------------------------------------------------------------------------------------------*/
+int tune_save(const char* port, const tune_link_t* link)
+{
+    FILE* out;
+    int ok;
+    char key[PATH_MAX];
+    char path[PATH_MAX];
+
+    if((settingsPath(port, path, sizeof(path), key, sizeof(key)) < 0) ||
+       (hexcache_make_dirs(hexcache_default_dir()) < 0) || ((out = fopen(path, "w")) == NULL))
+    {
+        log_printf("[err]: Couldn't save the link settings\n");
+        return 0;
+    }
+
+    fprintf(out, "# tealoader -T for %s\n", key);
+    fprintf(out, "baud %d\n", link->baud);
+    ok = (fprintf(out, "window %d\n", link->window) > 0);
+    ok = (fclose(out) == 0) && ok;
+
+    if(ok)
+        log_printf("> Link settings saved for %s\n",key);
+
+    return ok;
+}
+/*-----------------------------------------------------------------------------------------------*/
+void tune_apply(int fd, const char* port)
+{
+    tune_link_t link;
+
+    if((fwVersion < TUNE_VERSION) || (tune_load(port, &link) == 0))
+    {
+        return;
+    }
+
+    streamWindow = link.window;
+
+    if(link.baud == baudRate)
+    {
+        return;
+    }
+
+    if(tune_switch_baud(fd, link.baud))
+        log_printf("> Link: %d baud, window %d\n",link.baud,link.window);
+    else
+        log_printf("> Link: %d baud didn't work, staying at %d\n",link.baud,baudRate);
+}
+/*-----------------------------------------------------------------------------------------------*/
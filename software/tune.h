@@ -0,0 +1,46 @@
+/*-------------------------------------------------------------------------------------------------
+/ Link tuning: baud rate and stream window per fixture.
+/
+/ Calibration tries every rate the bootloader knows and, with flow control, several stream windows.
+/ For each it measures the ACK round trip, the sustained rate of TUNE_FRAMES page writes and the
+/ errors: missing or failed ACKs, pages whose CRC doesn't match what was sent, and the overruns,
+/ framing errors and dropped bytes the device counted. The fastest setting without errors is kept
+/ per adapter, under its USB serial number when it has one and under the port path otherwise.
+/------------------------------------------------------------------------------------------------*/
+#ifndef TUNE_H
+#define TUNE_H
+
+#define TUNE_VERSION 9
+
+/* Pages written per measurement, from address 0 on. The flash is erased afterwards anyway. */
+#define TUNE_FRAMES 32
+#define TUNE_PINGS 20
+
+/* How long the bootloader waits at a new rate before it goes back to the old one */
+#define TUNE_PROBE_MS 100
+
+typedef struct
+{
+    int baud;
+    int window;
+} tune_link_t;
+
+/* Index of baud in the bootloader's 'u' table, -1 if it doesn't have it */
+int tune_baud_index(int baud);
+
+/* 'u', both sides end up at baud or, if that didn't work, at the rate they had. Returns 1 on
+   success. */
+int tune_switch_baud(int fd, int baud);
+
+/* Measures every candidate and fills best. Leaves the link at LINK_BAUD. Returns 1 if at least one
+   setting went through without errors. */
+int tune_calibrate(int fd, tune_link_t* best);
+
+/* Returns 1 if settings were saved for the adapter behind port */
+int tune_load(const char* port, tune_link_t* link);
+int tune_save(const char* port, const tune_link_t* link);
+
+/* Switches to the saved settings of the adapter, if there are any */
+void tune_apply(int fd, const char* port);
+
+#endif /* TUNE_H */